@@ -1,6 +1,19 @@
-
 #if LUA_VERSION_NUM < 502
 # define luaL_newlib(L,l) (lua_newtable(L), luaL_register(L,NULL,l))
 # define luaL_setfuncs(L,l,n) (assert(n==0), luaL_register(L,NULL,l))
-#endif
+# define lua_rawlen(L,i) lua_objlen(L,i)
+# define lua_getuservalue(L,i) lua_getfenv(L,i)
+# define lua_setuservalue(L,i) lua_setfenv(L,i)
+# define lua_resume(L,from,n) lua_resume(L,n)
+# ifndef LUA_OK
+#  define LUA_OK 0
+# endif
+#elif LUA_VERSION_NUM >= 504
+static inline int lua_resume_(lua_State *L, lua_State *from, int n)
+{
+	int nres;
 
+	return lua_resume(L, from, n, &nres);
+}
+# define lua_resume(L,from,n) lua_resume_(L,from,n)
+#endif
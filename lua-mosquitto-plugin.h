@@ -0,0 +1,41 @@
+/*
+ * Native message handlers for lua-mosquitto, see ctx:route_native.
+ *
+ * A plugin is a shared object exporting a handler
+ *
+ *	int symbol(void *state, const struct mosquitto_message *msg);
+ *
+ * called for every message on a topic matching the route's filter, on the
+ * thread running the instance's loop, before the message reaches Lua. It
+ * returns LUA_MOSQUITTO_PLUGIN_PASS to hand the message on to the next
+ * route and then Lua, LUA_MOSQUITTO_PLUGIN_CONSUMED to stop it there. msg
+ * and everything it points to are only valid during the call.
+ *
+ * The plugin may also export
+ *
+ *	int symbol_init(int version, const char *config, void **state);
+ *	void symbol_free(void *state);
+ *
+ * symbol_init is called when the route is added, with the version of this
+ * header the module was built with and the config string given to
+ * route_native, or NULL; whatever it stores in state is passed to the
+ * handler. Returning non-zero fails route_native. symbol_free is called
+ * once the route is replaced, removed or its instance destroyed.
+ */
+#ifndef LUA_MOSQUITTO_PLUGIN_H
+#define LUA_MOSQUITTO_PLUGIN_H
+
+#include <mosquitto.h>
+
+#define LUA_MOSQUITTO_PLUGIN_VERSION	1
+
+#define LUA_MOSQUITTO_PLUGIN_PASS		0
+#define LUA_MOSQUITTO_PLUGIN_CONSUMED	1
+
+typedef int (*lua_mosquitto_plugin_handler)(void *state,
+	const struct mosquitto_message *msg);
+typedef int (*lua_mosquitto_plugin_init)(int version, const char *config,
+	void **state);
+typedef void (*lua_mosquitto_plugin_free)(void *state);
+
+#endif
@@ -35,9 +35,22 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -45,7 +58,17 @@
 
 #include <mosquitto.h>
 
+#ifdef LUA_MOSQUITTO_ZSTD
+#include <zstd.h>
+#endif
+
 #include "compat.h"
+#include "lua-mosquitto-plugin.h"
+
+#ifndef LIBMOSQUITTO_VERSION_NUMBER
+/* predates the version macro, which arrived with 1.3.1 */
+#define LIBMOSQUITTO_VERSION_NUMBER 0
+#endif
 
 /* re-using mqtt3 message types as callback types */
 #define CONNECT		0x10
@@ -67,12 +90,158 @@ enum connect_return_codes {
 	CONN_REF_BAD_TLS
 };
 
+/* binding specific error codes, kept clear of the MOSQ_ERR_ range */
+#define ERR_RATE_LIMIT	0x100
+
+/* mids are 16 bit, so a flat table is the cheapest index there is */
+#define MOSQ_MAX_MID	65536
+
 /* unique naming for userdata metatables */
 #define MOSQ_META_CTX	"mosquitto.ctx"
 
+/* exported symbols, everything else may be hidden: the module entry point
+ * and the entry points for the LuaJIT FFI module, see mosquitto/ffi.lua */
+#define LUA_MOSQUITTO_API	__attribute__((visibility("default")))
+
+struct store;
+struct latency;
+struct msgq;
+struct streams;
+struct compress;
+struct dedup;
+struct filter;
+struct route;
+struct lvc;
+
+enum rate_mode {
+	RATE_REJECT,
+	RATE_QUEUE
+};
+
+/* publish held back by the rate limiter */
+typedef struct rate_msg {
+	struct rate_msg *next;
+	int payloadlen;
+	int qos;
+	bool retain;
+	char data[];	/* topic, NUL, payload */
+} rate_msg_t;
+
+/* token buckets for messages [0] and payload bytes [1] */
 typedef struct {
-	lua_State *L;
+	double rate[2];		/* tokens per second, 0 for unlimited */
+	double burst[2];
+	double tokens[2];
+	uint64_t last;		/* monotonic ns of the last refill */
+	enum rate_mode mode;
+	rate_msg_t *head;
+	rate_msg_t *tail;
+	size_t queued;
+	size_t queue_max;	/* 0 for unbounded */
+	bool draining;		/* QoS 0 completes inside the publish draining it */
+} rate_t;
+
+/* inbound flow control */
+typedef struct {
+	bool paused;		/* by pause_read */
+	bool throttled;		/* by the high watermark */
+	bool used;			/* the loop has to check before reading */
+	size_t pending;		/* messages delivered but not consumed yet */
+	size_t high;		/* 0 when watermarks are off */
+	size_t low;
+} flow_t;
+
+enum ack_mode {
+	ACK_EACH,
+	ACK_BATCH,
+	ACK_COUNT
+};
+
+/* publish completions waiting for the end of the loop pass */
+typedef struct {
+	enum ack_mode mode;
+	int *mids;
+	size_t len;
+	size_t cap;
+} acks_t;
+
+/* a callback raised inside an FFI call, LuaJIT can't be entered from there */
+typedef struct {
+	int slot;
+	int arg;		/* mid, log level or disconnect rc */
+	char *str;		/* log line */
+} ffi_event_t;
+
+typedef struct {
+	int depth;			/* FFI calls in progress */
+	pthread_t thread;	/* making them, loop_start runs callbacks elsewhere */
+	bool used;			/* loop_forever has to come back for the events */
+	ffi_event_t *events;	/* handed to Lua by the next loop */
+	size_t len;
+	size_t cap;
+} ffi_t;
+
+/* what mosquitto_loop_forever would otherwise keep to itself */
+typedef struct {
+	unsigned int delay;
+	unsigned int delay_max;
+	bool backoff;
+	bool disconnecting;	/* client asked to disconnect, don't reconnect */
+} reconnect_t;
+
+typedef struct {
+	unsigned long rate_rejected;
+	unsigned long rate_queued;
+	unsigned long read_throttled;
+	unsigned long queue_dropped;
+	unsigned long stream_frames;
+	unsigned long stream_completed;
+	unsigned long stream_dropped;
+	unsigned long compressed;
+	unsigned long compress_in;	/* payload bytes before compression */
+	unsigned long compress_out;	/* and after */
+	unsigned long decompressed;
+	unsigned long dedup_hits;
+	unsigned long filtered;
+	unsigned long routed;		/* consumed by a native route */
+	unsigned long cache_full;
+	unsigned long published;	/* completed, as reported to ON_PUBLISH */
+	unsigned long callback_errors;	/* raised by handlers, see last_error */
+} ctx_stats_t;
+
+typedef struct {
+	int depth;			/* library calls in progress that may run callbacks */
+	bool destroy_pending;	/* destroy was called from inside one of them */
 	struct mosquitto *mosq;
+	struct store *store;
+	struct latency *latency;
+	struct msgq *queue;
+	struct streams *streams;
+	uint32_t stream_id;	/* last id handed out by publish_stream */
+	struct compress *compress;
+	struct dedup *dedup;
+	struct filter *filters;
+	struct route *routes;
+	struct lvc *cache;
+	lua_State *H;		/* anchors D and the parked coroutines */
+	lua_State *D;		/* dispatch coroutine, handlers run on it */
+	lua_State **parked;	/* handlers that yielded, resumed by the loop */
+	int nparked;
+	int cparked;
+	int last_error;		/* registry ref of the last handler error */
+	int dispatching;	/* handler calls in progress on D */
+	bool handlers_dirty;	/* handlers changed while dispatching */
+	bool threaded;		/* a loop_start thread is running */
+	bool forever;		/* in mosquitto_loop_forever, see ctx__dispatch */
+	int pool;			/* registry ref of the recv record pool */
+	int pool_records;	/* pooled records handed out */
+	int pool_batches;	/* pooled batch tables handed out */
+	rate_t rate;
+	flow_t flow;
+	acks_t acks;
+	ffi_t ffi;
+	reconnect_t reconnect;
+	ctx_stats_t stats;
 	int on_connect;
 	int on_disconnect;
 	int on_publish;
@@ -114,256 +283,3361 @@ static int mosq__pstatus(lua_State *L, int mosq_errno) {
 			lua_pushstring(L, strerror(errno));
 			return 3;
 			break;
+
+		case ERR_RATE_LIMIT:
+			lua_pushnil(L);
+			lua_pushinteger(L, mosq_errno);
+			lua_pushstring(L, "Publish rate limit exceeded.");
+			return 3;
+			break;
 	}
 
 	return 0;
 }
 
-/***
- * Library functions
- * @section lib_functions
+/*
+ * Persistent store for QoS 1/2 messages awaiting acknowledgement.
+ *
+ * libmosquitto only keeps its in-flight messages in memory, so everything
+ * that has not been acknowledged is lost when the process goes away. A store
+ * records each QoS > 0 publish before it is handed to the library, learns
+ * its MID once mosquitto_publish returns and forgets it again when the
+ * publish callback reports completion. Whatever is left when the store is
+ * reopened is published once more after the next successful connect.
+ *
+ * The ctx holds the store's lock around every operation, and from reserve
+ * through mosquitto_publish to commit: with loop_start the acknowledgement
+ * arrives on the library thread, and must not find the record without its
+ * MID yet. The lock is recursive for the completions libmosquitto reports
+ * from inside mosquitto_publish.
+ *
+ * Backends implement struct store_ops, the default one is an mmap'd log.
  */
 
-/***
- * Return mosquitto library version.
- * @function version
- * @treturn string version string "major.minor.revision"
- * @see mosquitto_lib_version
+typedef struct store {
+	const struct store_ops *ops;
+	pthread_mutex_t lock;
+} store_t;
+
+struct store_ops {
+	const char *name;
+	store_t *(*open)(const char *path, size_t capacity, int *recovered);
+	/* record the publish about to be made, 0 on success */
+	int (*reserve)(store_t *store, const char *topic,
+		int payloadlen, const void *payload, int qos, bool retain);
+	/* the reserved publish got mid, or failed when mid is -1 */
+	void (*commit)(store_t *store, int mid);
+	void (*ack)(store_t *store, int mid);
+	/* republish recovered messages, returns the number of messages sent */
+	int (*resume)(store_t *store, struct mosquitto *mosq);
+	void (*close)(store_t *store);
+};
+
+/*
+ * Log backend: a file mapped into memory, holding a header followed by
+ * 8 byte aligned records. Records are appended on publish and flagged in
+ * place on acknowledgement. Dead records are squeezed out when they take up
+ * more space than the live ones, or when an append does not fit anymore.
  */
-static int mosq_version(lua_State *L)
-{
-	int major, minor, rev;
-	char version[16];
 
-	mosquitto_lib_version(&major, &minor, &rev);
-	sprintf(version, "%i.%i.%i", major, minor, rev);
-	lua_pushstring(L, version);
-	return 1;
-}
+#define STORE_LOG_MAGIC		0x4c4d5331	/* "LMS1" */
+#define STORE_LOG_MIN_CAP	65536
+#define STORE_LOG_ALIGN(n)	(((n) + 7) & ~(size_t) 7)
 
-/***
- * Does a topic match a subscription string?
- * @function topic_matches_sub
- * @tparam string subscription eg, blah/+/wop/#
- * @tparam string topic to test
- * @return[1] boolean result
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
- * @see mosquitto_topic_matches_sub
- */
-static int mosq_topic_matches_sub(lua_State *L)
+enum store_rec_state {
+	REC_ACKED,
+	REC_LIVE,	/* handed over to libmosquitto, waiting for its ack */
+	REC_RESUME,	/* recovered from a previous run, not published yet */
+	REC_PENDING	/* reserved, being published */
+};
+
+typedef struct {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t used;		/* bytes of records following the header */
+} store_log_hdr_t;
+
+typedef struct {
+	uint16_t state;
+	uint16_t mid;
+	uint8_t qos;
+	uint8_t retain;
+	uint16_t topiclen;	/* including the terminating NUL */
+	uint32_t payloadlen;
+	uint32_t reserved;
+} store_log_rec_t;
+
+typedef struct {
+	store_t base;
+	int fd;
+	char *map;
+	size_t cap;
+	size_t live;		/* bytes taken by records not acked */
+	uint32_t *slot;		/* mid -> record offset + 1, 0 if none */
+	size_t pending;		/* REC_PENDING record offset + 1, 0 if none */
+} store_log_t;
+
+static const struct store_ops store_log_ops;
+
+static int store__init(store_t *store, const struct store_ops *ops)
 {
-	const char *sub = luaL_checkstring(L, 1);
-	const char *topic = luaL_checkstring(L, 2);
+	pthread_mutexattr_t attr;
+	int rc;
 
-	bool result;
-	int rc = mosquitto_topic_matches_sub(sub, topic, &result);
-	if (rc != MOSQ_ERR_SUCCESS) {
-		return mosq__pstatus(L, rc);
-	} else {
-		lua_pushboolean(L, result);
-		return 1;
-	}
+	store->ops = ops;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	rc = pthread_mutex_init(&store->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return rc;
 }
 
-/***
- * @function init
- * @see mosquitto_lib_init
- * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
-*/
-static int mosq_init(lua_State *L)
-{
-	if (!mosq_initialized)
-		mosquitto_lib_init();
+#define STORE_LOG_HDR(s)	((store_log_hdr_t *) (s)->map)
+#define STORE_LOG_REC(s, off)	((store_log_rec_t *) ((s)->map + (off)))
 
-	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+static size_t store_log__size(const store_log_rec_t *rec)
+{
+	return STORE_LOG_ALIGN(sizeof(*rec) + rec->topiclen + rec->payloadlen);
 }
 
-/***
- * Cleanup mosquitto library.
- * This is called automatically by garbage collection, you shouldn't normally
- * have to call this.
- * @function cleanup
- * @see mosquitto_lib_cleanup
- * @return[1] true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
- */
-static int mosq_cleanup(lua_State *L)
+static int store_log__map(store_log_t *s, size_t cap)
 {
-	mosquitto_lib_cleanup();
-	mosq_initialized = 0;
-	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+	char *map;
+
+	if (ftruncate(s->fd, cap) < 0)
+		return -1;
+
+	map = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	if (s->map != NULL)
+		munmap(s->map, s->cap);
+
+	s->map = map;
+	s->cap = cap;
+	return 0;
 }
 
-static void ctx__on_init(ctx_t *ctx)
+/* squeeze out acked records, keeping the mid index in sync */
+static void store_log__compact(store_log_t *s)
 {
-	ctx->on_connect = LUA_REFNIL;
-	ctx->on_disconnect = LUA_REFNIL;
-	ctx->on_publish = LUA_REFNIL;
-	ctx->on_message = LUA_REFNIL;
-	ctx->on_subscribe = LUA_REFNIL;
-	ctx->on_unsubscribe = LUA_REFNIL;
-	ctx->on_log = LUA_REFNIL;
+	store_log_hdr_t *hdr = STORE_LOG_HDR(s);
+	size_t end = sizeof(*hdr) + hdr->used;
+	size_t off = sizeof(*hdr);
+	size_t dst = sizeof(*hdr);
+
+	while (off < end) {
+		store_log_rec_t *rec = STORE_LOG_REC(s, off);
+		size_t len = store_log__size(rec);
+
+		if (rec->state != REC_ACKED) {
+			if (dst != off)
+				memmove(s->map + dst, rec, len);
+			rec = STORE_LOG_REC(s, dst);
+			if (rec->state == REC_LIVE)
+				s->slot[rec->mid] = dst + 1;
+			else if (rec->state == REC_PENDING && s->pending == off + 1)
+				s->pending = dst + 1;
+			dst += len;
+		}
+		off += len;
+	}
+
+	hdr->used = dst - sizeof(*hdr);
 }
 
-static void ctx__on_clear(ctx_t *ctx)
+static void store_log_close(store_t *store)
 {
-	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->on_connect);
-	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->on_disconnect);
-	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->on_publish);
-	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->on_message);
-	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->on_subscribe);
-	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->on_unsubscribe);
-	luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->on_log);
+	store_log_t *s = (store_log_t *) store;
+
+	if (s->map != NULL) {
+		msync(s->map, s->cap, MS_ASYNC);
+		munmap(s->map, s->cap);
+	}
+	if (s->fd >= 0)
+		close(s->fd);
+	free(s->slot);
+	pthread_mutex_destroy(&s->base.lock);
+	free(s);
 }
 
-/***
- * Create a new mosquitto instance
- * @function new
- * @tparam[opt=nil] string client id, optional. nil to allow library to generate
- * @tparam[opt=true] boolean clean_session
- * @return[1] a mosquitto instance
- * @raise For some out of memory or illegal states, or both nil id and clean session true
- * @see mosquitto_new
- */
-static int mosq_new(lua_State *L)
+static store_t *store_log_open(const char *path, size_t capacity, int *recovered)
 {
-	const char *id = luaL_optstring(L, 1, NULL);
-	bool clean_session = (lua_isboolean(L, 2) ? lua_toboolean(L, 2) : true);
+	store_log_t *s = calloc(1, sizeof(*s));
+	store_log_hdr_t *hdr, old;
+	struct stat st;
+	size_t off, end;
+	int saved_errno;
+
+	if (s == NULL)
+		return NULL;
+	if ((errno = store__init(&s->base, &store_log_ops)) != 0) {
+		free(s);
+		return NULL;
+	}
 
-	if (id == NULL && !clean_session) {
-		return luaL_argerror(L, 2, "if 'id' is nil then 'clean session' must be true");
+	s->fd = -1;
+	s->slot = calloc(MOSQ_MAX_MID, sizeof(*s->slot));
+	s->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (s->slot == NULL || s->fd < 0 || fstat(s->fd, &st) < 0)
+		goto fail;
+
+	/* checked before the file is grown or mapped, it may be anything */
+	if (st.st_size > 0) {
+		ssize_t n = pread(s->fd, &old, sizeof(old), 0);
+
+		if (n < 0)
+			goto fail;
+		if ((size_t) n < sizeof(old) || old.magic != STORE_LOG_MAGIC
+				|| old.used > (uint64_t) st.st_size - sizeof(old)) {
+			errno = EINVAL;
+			goto fail;
+		}
 	}
 
-	ctx_t *ctx = (ctx_t *) lua_newuserdata(L, sizeof(ctx_t));
+	if (capacity < STORE_LOG_MIN_CAP)
+		capacity = STORE_LOG_MIN_CAP;
+	if ((size_t) st.st_size > capacity)
+		capacity = st.st_size;
 
-	/* ctx will be passed as void *obj arg in the callback functions */
-	ctx->mosq = mosquitto_new(id, clean_session, ctx);
+	if (store_log__map(s, capacity) < 0)
+		goto fail;
 
-	if (ctx->mosq == NULL) {
-		return luaL_error(L, strerror(errno));
+	hdr = STORE_LOG_HDR(s);
+	if (st.st_size == 0) {
+		hdr->magic = STORE_LOG_MAGIC;
+		hdr->used = 0;
 	}
 
-	ctx->L = NULL;
-	ctx__on_init(ctx);
+	/* whatever was not acked in the previous run has to go out again */
+	*recovered = 0;
+	end = sizeof(*hdr) + hdr->used;
+	for (off = sizeof(*hdr); off < end; off += store_log__size(STORE_LOG_REC(s, off))) {
+		store_log_rec_t *rec = STORE_LOG_REC(s, off);
 
-	luaL_getmetatable(L, MOSQ_META_CTX);
-	lua_setmetatable(L, -2);
+		if (off + sizeof(*rec) > end || off + store_log__size(rec) > end) {
+			/* torn append at the tail, drop it */
+			hdr->used = off - sizeof(*hdr);
+			break;
+		}
+		if (rec->state != REC_ACKED) {
+			rec->state = REC_RESUME;
+			s->live += store_log__size(rec);
+			(*recovered)++;
+		}
+	}
 
-	return 1;
+	store_log__compact(s);
+	return &s->base;
+
+fail:
+	saved_errno = errno;
+	store_log_close(&s->base);
+	errno = saved_errno;
+	return NULL;
 }
 
-static ctx_t * ctx_check(lua_State *L, int i)
+static void store_log_ack(store_t *store, int mid)
 {
-	return (ctx_t *) luaL_checkudata(L, i, MOSQ_META_CTX);
-}
+	store_log_t *s = (store_log_t *) store;
+	store_log_rec_t *rec;
 
-/***
- * Instance functions
- * @section instance_functions
- */
+	if (s->slot[mid] == 0)
+		return;
 
-/***
- * Destroy context
- * This is called automatically by garbage collection, you shouldn't normally
- * have to call this.
- * @function destroy
- * @see mosquitto_destroy
- * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
- */
-static int ctx_destroy(lua_State *L)
+	rec = STORE_LOG_REC(s, s->slot[mid] - 1);
+	rec->state = REC_ACKED;
+	s->live -= store_log__size(rec);
+	s->slot[mid] = 0;
+}
+
+static int store_log_reserve(store_t *store, const char *topic,
+	int payloadlen, const void *payload, int qos, bool retain)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	mosquitto_destroy(ctx->mosq);
+	store_log_t *s = (store_log_t *) store;
+	store_log_hdr_t *hdr = STORE_LOG_HDR(s);
+	size_t topiclen = strlen(topic) + 1;
+	size_t len = STORE_LOG_ALIGN(sizeof(store_log_rec_t) + topiclen + payloadlen);
+	store_log_rec_t *rec;
+	size_t off;
+
+	if (topiclen > UINT16_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
 
-	/* clean up Lua callback functions in the registry */
-	ctx__on_clear(ctx);
+	if (sizeof(*hdr) + hdr->used + len > s->cap
+			|| hdr->used - s->live > s->live + STORE_LOG_MIN_CAP) {
+		store_log__compact(s);
+	}
 
-	/* remove all methods operating on ctx */
-	lua_newtable(L);
-	lua_setmetatable(L, -2);
+	if (sizeof(*hdr) + hdr->used + len > s->cap) {
+		size_t cap = s->cap * 2;
+		while (cap < sizeof(*hdr) + hdr->used + len)
+			cap *= 2;
+		if (store_log__map(s, cap) < 0)
+			return -1;
+		hdr = STORE_LOG_HDR(s);
+	}
 
-	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+	off = sizeof(*hdr) + hdr->used;
+	rec = STORE_LOG_REC(s, off);
+	rec->mid = 0;
+	rec->qos = qos;
+	rec->retain = retain;
+	rec->topiclen = topiclen;
+	rec->payloadlen = payloadlen;
+	rec->reserved = 0;
+	memcpy(rec + 1, topic, topiclen);
+	if (payloadlen > 0)
+		memcpy((char *) (rec + 1) + topiclen, payload, payloadlen);
+
+	/* only now the record becomes visible to a reader of the log, one
+	 * pending after a crash is published again like a live one */
+	rec->state = REC_PENDING;
+	hdr->used += len;
+
+	s->pending = off + 1;
+	s->live += len;
+	return 0;
 }
 
-/***
- * Reinitialise
- * @function reinitialise
- * @tparam[opt=nil] string client id, nil to allow the library to determine
- * @tparam[opt=true] boolean clean session.
- * @see mosquitto_reinitialise
- * @see new
- * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
-*/
-static int ctx_reinitialise(lua_State *L)
+static void store_log_commit(store_t *store, int mid)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	const char *id = luaL_optstring(L, 1, NULL);
-	bool clean_session = (lua_isboolean(L, 2) ? lua_toboolean(L, 2) : true);
+	store_log_t *s = (store_log_t *) store;
+	store_log_rec_t *rec;
 
-	if (id == NULL && !clean_session) {
-		return luaL_argerror(L, 3, "if 'id' is nil then 'clean session' must be true");
+	if (s->pending == 0)
+		return;
+
+	rec = STORE_LOG_REC(s, s->pending - 1);
+	if (mid < 0) {
+		rec->state = REC_ACKED;
+		s->live -= store_log__size(rec);
+	} else {
+		/* a recycled mid means libmosquitto is done with the old message */
+		store_log_ack(store, mid);
+		rec->mid = mid;
+		rec->state = REC_LIVE;
+		s->slot[mid] = s->pending;
 	}
+	s->pending = 0;
+}
 
-	int rc = mosquitto_reinitialise(ctx->mosq, id, clean_session, ctx);
+static int store_log_resume(store_t *store, struct mosquitto *mosq)
+{
+	store_log_t *s = (store_log_t *) store;
+	store_log_hdr_t *hdr = STORE_LOG_HDR(s);
+	size_t end = sizeof(*hdr) + hdr->used;
+	size_t off;
+	int sent = 0;
+
+	for (off = sizeof(*hdr); off < end; off += store_log__size(STORE_LOG_REC(s, off))) {
+		store_log_rec_t *rec = STORE_LOG_REC(s, off);
+		const char *topic = (const char *) (rec + 1);
+		int mid;
+
+		if (rec->state != REC_RESUME)
+			continue;
+
+		if (mosquitto_publish(mosq, &mid, topic, rec->payloadlen,
+				topic + rec->topiclen, rec->qos, rec->retain) != MOSQ_ERR_SUCCESS) {
+			/* try again on the next connect */
+			break;
+		}
 
-	/* clean up Lua callback functions in the registry */
-	ctx__on_clear(ctx);
-	ctx__on_init(ctx);
+		store_log_ack(store, mid);
+		rec->mid = mid;
+		rec->state = REC_LIVE;
+		s->slot[mid] = off + 1;
+		sent++;
+	}
 
-	return mosq__pstatus(L, rc);
+	return sent;
 }
 
-/***
- * Set a Will
- * @function will_set
- * @tparam string topic as per mosquitto_will_set
- * @tparam string payload as per mosquitto_will_set (but a proper lua string)
- * @tparam[opt=0] number qos 0, 1 or 2
- * @tparam[opt=false] boolean retain
- * @see mosquitto_will_set
- * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
- */
-static int ctx_will_set(lua_State *L)
-{
-	ctx_t *ctx = ctx_check(L, 1);
-	const char *topic = luaL_checkstring(L, 2);
-	size_t payloadlen = 0;
-	const void *payload = NULL;
+static const struct store_ops store_log_ops = {
+	"log",
+	store_log_open,
+	store_log_reserve,
+	store_log_commit,
+	store_log_ack,
+	store_log_resume,
+	store_log_close
+};
 
-	if (!lua_isnil(L, 3)) {
-		payload = lua_tolstring(L, 3, &payloadlen);
-	};
+static const struct store_ops *store_backends[] = {
+	&store_log_ops,
+	NULL
+};
 
-	int qos = luaL_optinteger(L, 4, 0);
-	bool retain = lua_toboolean(L, 5);
+/* monotonic clock in ns, used by everything that measures time natively */
+static uint64_t mosq__now(void)
+{
+	struct timespec ts;
 
-	int rc = mosquitto_will_set(ctx->mosq, topic, payloadlen, payload, qos, retain);
-	return mosq__pstatus(L, rc);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-/***
+/*
+ * Latency histograms.
+ *
+ * Log-linear buckets in the spirit of HdrHistogram: values below 2^HIST_BITS
+ * ns get a bucket each, above that every power of two is split into
+ * 2^HIST_BITS buckets, which keeps the relative error under 3% across the
+ * whole uint64_t range in under 16kB.
+ */
+
+#define HIST_BITS		5
+#define HIST_SUB		(1 << HIST_BITS)
+#define HIST_BUCKETS	((64 - HIST_BITS + 1) * HIST_SUB)
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+} hist_t;
+
+typedef struct latency {
+	hist_t publish;		/* publish until the library reports it complete */
+	hist_t dispatch;	/* time spent in the ON_MESSAGE handler */
+	uint64_t sent[MOSQ_MAX_MID];	/* publish timestamp by mid */
+	uint64_t pending;	/* the publish in progress, it may complete before
+						 * returning its mid (QoS 0 is written right away) */
+} latency_t;
+
+static int hist__index(uint64_t v)
+{
+	int msb;
+
+	if (v < HIST_SUB)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_BITS + 1) * HIST_SUB
+		+ ((v >> (msb - HIST_BITS)) & (HIST_SUB - 1));
+}
+
+/* midpoint of the values falling into bucket i */
+static double hist__value(int i)
+{
+	int msb;
+	uint64_t low;
+
+	if (i < HIST_SUB)
+		return i;
+
+	msb = i / HIST_SUB + HIST_BITS - 1;
+	low = ((uint64_t) 1 << msb) | ((uint64_t) (i % HIST_SUB) << (msb - HIST_BITS));
+	return low + ((uint64_t) 1 << (msb - HIST_BITS)) / 2.0;
+}
+
+static void hist__add(hist_t *h, uint64_t v)
+{
+	if (h->count == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->bucket[hist__index(v)]++;
+}
+
+static double hist__percentile(const hist_t *h, double p)
+{
+	uint64_t rank = (uint64_t) (p / 100 * h->count + 0.5);
+	uint64_t seen = 0;
+	double v;
+	int i;
+
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+
+	/* the bucket midpoint may lie outside what was actually recorded */
+	v = hist__value(i);
+	if (v < h->min)
+		v = h->min;
+	if (v > h->max)
+		v = h->max;
+	return v;
+}
+
+/* taken before mosquitto_publish, the completion can come from inside it */
+static void latency__begin(latency_t *lat)
+{
+	lat->pending = mosq__now();
+}
+
+/* after mosquitto_publish, what didn't complete yet is waited for by mid */
+static void latency__sent(latency_t *lat, int mid, int rc)
+{
+	if (rc == MOSQ_ERR_SUCCESS && lat->pending != 0) {
+		lat->sent[mid] = lat->pending;
+	}
+	lat->pending = 0;
+}
+
+static void latency__acked(latency_t *lat, int mid)
+{
+	uint64_t start = lat->sent[mid] != 0 ? lat->sent[mid] : lat->pending;
+
+	if (start != 0) {
+		hist__add(&lat->publish, mosq__now() - start);
+		lat->sent[mid] = 0;
+		lat->pending = 0;
+	}
+}
+
+/*
+ * Pull-mode message queue.
+ *
+ * Instead of calling into Lua, ctx_on_message can copy messages into a
+ * bounded FIFO to be collected later. Each message is a single allocation
+ * holding the struct, the topic and the payload. The queue has its own lock
+ * since the library thread started by loop_start fills it while Lua drains
+ * it; with a queue nothing on the receiving side touches the Lua state.
+ */
+
+typedef struct msgq_node {
+	struct msgq_node *next;
+	struct mosquitto_message msg;
+	char data[];
+} msgq_node_t;
+
+typedef struct msgq {
+	pthread_mutex_t lock;
+	pthread_cond_t nonempty;
+	msgq_node_t *head;
+	msgq_node_t *tail;
+	size_t len;
+	size_t max;
+} msgq_t;
+
+static msgq_t *msgq__new(size_t max)
+{
+	msgq_t *q = calloc(1, sizeof(*q));
+
+	if (q == NULL)
+		return NULL;
+
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->nonempty, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&q->lock, NULL);
+	q->max = max;
+	return q;
+}
+
+static void msgq__free(msgq_t *q)
+{
+	while (q->head != NULL) {
+		msgq_node_t *node = q->head;
+		q->head = node->next;
+		free(node);
+	}
+	pthread_cond_destroy(&q->nonempty);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+static msgq_node_t *msgq__node(const struct mosquitto_message *msg)
+{
+	size_t topiclen = strlen(msg->topic) + 1;
+	msgq_node_t *node = malloc(sizeof(*node) + topiclen + msg->payloadlen + 1);
+
+	if (node == NULL)
+		return NULL;
+
+	node->next = NULL;
+	node->msg = *msg;
+	node->msg.topic = node->data;
+	node->msg.payload = node->data + topiclen;
+	memcpy(node->msg.topic, msg->topic, topiclen);
+	memcpy(node->msg.payload, msg->payload, msg->payloadlen);
+	/* NUL terminate for the convenience of C consumers, as libmosquitto does */
+	((char *) node->msg.payload)[msg->payloadlen] = '\0';
+	return node;
+}
+
+static void msgq__release(struct mosquitto_message *msg)
+{
+	free((char *) msg - offsetof(msgq_node_t, msg));
+}
+
+/* queue a copy of msg, maintaining the flow control watermark */
+static void ctx__queue_push(ctx_t *ctx, const struct mosquitto_message *msg)
+{
+	msgq_t *q = ctx->queue;
+	msgq_node_t *node = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->max == 0 || q->len < q->max) {
+		node = msgq__node(msg);
+	}
+	if (node == NULL) {
+		ctx->stats.queue_dropped++;
+	} else {
+		if (q->tail != NULL)
+			q->tail->next = node;
+		else
+			q->head = node;
+		q->tail = node;
+		q->len++;
+		if (ctx->flow.high > 0 && q->len >= ctx->flow.high && !ctx->flow.throttled) {
+			ctx->flow.throttled = true;
+			ctx->stats.read_throttled++;
+		}
+		pthread_cond_signal(&q->nonempty);
+	}
+	ctx->flow.pending = q->len;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* take up to max messages off the queue, oldest first */
+static int ctx__queue_pop(ctx_t *ctx, struct mosquitto_message **msgs, int max)
+{
+	msgq_t *q = ctx->queue;
+	int n = 0;
+
+	if (q == NULL)
+		return 0;
+
+	pthread_mutex_lock(&q->lock);
+	while (n < max && q->head != NULL) {
+		msgq_node_t *node = q->head;
+		q->head = node->next;
+		msgs[n++] = &node->msg;
+	}
+	if (q->head == NULL)
+		q->tail = NULL;
+	q->len -= n;
+	ctx->flow.pending = q->len;
+	if (ctx->flow.throttled && q->len <= ctx->flow.low)
+		ctx->flow.throttled = false;
+	pthread_mutex_unlock(&q->lock);
+
+	return n;
+}
+
+/*
+ * Chunked transfer of large payloads.
+ *
+ * publish_stream cuts a payload into frames small enough for the broker,
+ * each starting with a 16 byte header in network byte order:
+ *
+ *   0   "LMS"   magic
+ *   3   version STREAM_VERSION in the high nibble, flags in the low one,
+ *               STREAM_LAST on the final frame
+ *   4   id      stream id, unique per sending context, never 0
+ *   8   seq     frame number, counting from 0
+ *   12  total   payload bytes up to and including this frame
+ *
+ * The receiver only looks for frames on the topics it was asked to, and
+ * whatever there fails the header checks is an ordinary message after all.
+ * It collects frames per topic and id and delivers the payload as a single
+ * message once the last frame is in. MQTT keeps messages of a topic
+ * in order, so repeated frames (QoS 1 redelivery) are ignored and a gap
+ * drops the stream. Buffers come out of a fixed budget; when it runs out the
+ * streams that have been quiet for longest are evicted.
+ */
+
+#define STREAM_MAGIC	"LMS"
+#define STREAM_HDR		16
+#define STREAM_VERSION	1
+#define STREAM_LAST		0x01
+
+typedef struct stream {
+	struct stream *next;
+	uint32_t id;
+	uint32_t seq;		/* next frame expected */
+	uint64_t touched;	/* monotonic ns of the last frame */
+	size_t len;
+	size_t cap;
+	char *buf;
+	char topic[];
+} stream_t;
+
+typedef struct streams {
+	stream_t *head;
+	size_t used;		/* buffer bytes held by all streams */
+	size_t max;
+	char **patterns;	/* topics reassembled, NULL terminated */
+} streams_t;
+
+static void ctx__deliver(ctx_t *ctx, const struct mosquitto_message *msg);
+
+static void stream__put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t stream__get32(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static bool stream__is_frame(const streams_t *s, const struct mosquitto_message *msg)
+{
+	const unsigned char *hdr = msg->payload;
+	uint32_t len = msg->payloadlen - STREAM_HDR;
+	uint32_t total;
+	bool match = false;
+	char **p;
+
+	if (msg->payloadlen < STREAM_HDR || memcmp(hdr, STREAM_MAGIC, 3) != 0
+			|| hdr[3] >> 4 != STREAM_VERSION || (hdr[3] & 0x0f & ~STREAM_LAST) != 0
+			|| stream__get32(hdr + 4) == 0) {
+		return false;
+	}
+	/* the frame itself counts towards total, and the first is all of it */
+	total = stream__get32(hdr + 12);
+	if (total < len || (stream__get32(hdr + 8) == 0 && total != len)) {
+		return false;
+	}
+
+	for (p = s->patterns; *p != NULL && !match; p++) {
+		if (mosquitto_topic_matches_sub(*p, msg->topic, &match) != MOSQ_ERR_SUCCESS)
+			match = false;
+	}
+	return match;
+}
+
+static void stream__unlink(streams_t *s, stream_t *st)
+{
+	stream_t **pp = &s->head;
+
+	while (*pp != st)
+		pp = &(*pp)->next;
+	*pp = st->next;
+	s->used -= st->cap;
+}
+
+static void stream__drop(streams_t *s, stream_t *st)
+{
+	stream__unlink(s, st);
+	free(st->buf);
+	free(st);
+}
+
+static void streams__free_patterns(char **patterns)
+{
+	char **p;
+
+	for (p = patterns; p != NULL && *p != NULL; p++)
+		free(*p);
+	free(patterns);
+}
+
+static void streams__free(streams_t *s)
+{
+	while (s->head != NULL)
+		stream__drop(s, s->head);
+	streams__free_patterns(s->patterns);
+	free(s);
+}
+
+/* get need more buffer bytes under budget, evicting streams other than keep */
+static bool ctx__stream_reserve(ctx_t *ctx, stream_t *keep, size_t need)
+{
+	streams_t *s = ctx->streams;
+
+	while (s->used + need > s->max) {
+		stream_t *st, *oldest = NULL;
+
+		for (st = s->head; st != NULL; st = st->next) {
+			if (st != keep && (oldest == NULL || st->touched < oldest->touched))
+				oldest = st;
+		}
+		if (oldest == NULL)
+			return false;
+		stream__drop(s, oldest);
+		ctx->stats.stream_dropped++;
+	}
+	return true;
+}
+
+static bool ctx__stream_append(ctx_t *ctx, stream_t *st, const void *data, size_t len)
+{
+	if (len == 0)
+		return true;
+	if (st->len + len > st->cap) {
+		size_t cap = st->cap ? st->cap : 4096;
+		char *buf;
+
+		while (cap < st->len + len)
+			cap *= 2;
+		if (cap > ctx->streams->max)
+			cap = st->len + len;
+		if (!ctx__stream_reserve(ctx, st, cap - st->cap))
+			return false;
+		buf = realloc(st->buf, cap);
+		if (buf == NULL)
+			return false;
+		ctx->streams->used += cap - st->cap;
+		st->buf = buf;
+		st->cap = cap;
+	}
+	memcpy(st->buf + st->len, data, len);
+	st->len += len;
+	return true;
+}
+
+/* take in one frame, delivering the payload when it completes a stream */
+static void ctx__stream_frame(ctx_t *ctx, const struct mosquitto_message *msg)
+{
+	streams_t *s = ctx->streams;
+	const unsigned char *hdr = msg->payload;
+	uint32_t id = stream__get32(hdr + 4);
+	uint32_t seq = stream__get32(hdr + 8);
+	uint32_t total = stream__get32(hdr + 12);
+	stream_t *st;
+
+	ctx->stats.stream_frames++;
+
+	for (st = s->head; st != NULL; st = st->next) {
+		if (st->id == id && strcmp(st->topic, msg->topic) == 0)
+			break;
+	}
+
+	if (st == NULL) {
+		if (seq != 0) {
+			/* rest of a stream dropped before, or missing its start */
+			return;
+		}
+		size_t topiclen = strlen(msg->topic) + 1;
+
+		st = calloc(1, sizeof(*st) + topiclen);
+		if (st == NULL) {
+			ctx->stats.stream_dropped++;
+			return;
+		}
+		st->id = id;
+		memcpy(st->topic, msg->topic, topiclen);
+		st->next = s->head;
+		s->head = st;
+	} else if (seq < st->seq) {
+		/* redelivered */
+		return;
+	} else if (seq > st->seq) {
+		stream__drop(s, st);
+		ctx->stats.stream_dropped++;
+		return;
+	}
+
+	if (!ctx__stream_append(ctx, st, hdr + STREAM_HDR, msg->payloadlen - STREAM_HDR)
+			|| st->len != total) {
+		stream__drop(s, st);
+		ctx->stats.stream_dropped++;
+		return;
+	}
+	st->seq++;
+	st->touched = mosq__now();
+
+	if (hdr[3] & STREAM_LAST) {
+		struct mosquitto_message whole = *msg;
+
+		whole.payload = st->buf;
+		whole.payloadlen = st->len;
+		/* unlinked first, the handler may well disable reassembly */
+		stream__unlink(s, st);
+		ctx->stats.stream_completed++;
+		ctx__deliver(ctx, &whole);
+		free(st->buf);
+		free(st);
+	}
+}
+
+/*
+ * Duplicate suppression.
+ *
+ * A reconnect makes the broker resend every QoS 1 message it has no PUBACK
+ * for, and the library has no way of telling those apart. So QoS 1 messages
+ * are hashed over topic and payload and remembered for a time window in a
+ * fixed size open addressing table; a message already seen within the
+ * window is dropped. When the probe sequence is full the oldest entry on it
+ * is overwritten, so a table too small for the message rate forgets early
+ * instead of growing.
+ */
+
+#define DEDUP_PROBE	8
+
+typedef struct {
+	uint64_t hash;
+	uint64_t seen;		/* monotonic ns, 0 for an empty slot */
+} dedup_slot_t;
+
+typedef struct dedup {
+	uint64_t window;	/* ns */
+	size_t mask;
+	dedup_slot_t slot[];
+} dedup_t;
+
+#define FNV_BASIS	0xcbf29ce484222325ULL
+
+/* FNV-1a, continuing from h */
+static uint64_t mosq__fnv(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* over the topic, including its NUL, and the payload */
+static uint64_t dedup__hash(const struct mosquitto_message *msg)
+{
+	uint64_t h = mosq__fnv(FNV_BASIS, msg->topic, strlen(msg->topic) + 1);
+
+	return mosq__fnv(h, msg->payload, msg->payloadlen);
+}
+
+/* remember msg, true if it was seen within the window already */
+static bool dedup__seen(dedup_t *d, const struct mosquitto_message *msg)
+{
+	uint64_t now = mosq__now();
+	uint64_t h = dedup__hash(msg);
+	dedup_slot_t *victim = NULL;
+	size_t i;
+
+	/* expired slots are reused but don't end the probe, entries may follow */
+	for (i = 0; i < DEDUP_PROBE; i++) {
+		dedup_slot_t *s = &d->slot[(h + i) & d->mask];
+		bool live = s->seen != 0 && now - s->seen <= d->window;
+
+		if (live && s->hash == h) {
+			return true;
+		}
+		if (victim == NULL || s->seen < victim->seen) {
+			victim = s;
+		}
+	}
+	victim->hash = h;
+	victim->seen = now;
+	return false;
+}
+
+/*
+ * Message filters.
+ *
+ * Predicates checked in C before a message is delivered, so the messages an
+ * application would throw away right away never get into Lua. Filters are
+ * kept in the order they were added and the first one whose pattern matches
+ * the topic decides. "changed" remembers a hash of the last payload per
+ * topic in a fixed table; a collision can only let a repeat through, never
+ * drop a change.
+ */
+
+#define FILTER_CHANGED_SLOTS	1024
+
+typedef struct filter {
+	struct filter *next;
+	char *pattern;
+	lua_Integer min_len;
+	lua_Integer max_len;		/* -1 for no bound */
+	char *prefix;				/* NULL for no prefix test */
+	size_t prefixlen;
+	size_t offset;				/* where the prefix has to be */
+	uint64_t (*changed)[2];		/* topic and payload hash per slot, or NULL */
+	unsigned long sample;		/* deliver one in sample, 0 or 1 for all */
+	unsigned long count;
+} filter_t;
+
+static void filter__free(filter_t *f)
+{
+	free(f->pattern);
+	free(f->prefix);
+	free(f->changed);
+	free(f);
+}
+
+static bool filter__pass(filter_t *f, const struct mosquitto_message *msg)
+{
+	if (msg->payloadlen < f->min_len
+			|| (f->max_len >= 0 && msg->payloadlen > f->max_len)) {
+		return false;
+	}
+
+	if (f->prefix != NULL && ((size_t) msg->payloadlen < f->offset + f->prefixlen
+			|| memcmp((char *) msg->payload + f->offset, f->prefix, f->prefixlen) != 0)) {
+		return false;
+	}
+
+	if (f->changed != NULL) {
+		uint64_t t = mosq__fnv(FNV_BASIS, msg->topic, strlen(msg->topic));
+		uint64_t p = mosq__fnv(FNV_BASIS, msg->payload, msg->payloadlen);
+		uint64_t *slot = f->changed[t % FILTER_CHANGED_SLOTS];
+
+		if (slot[0] == t && slot[1] == p) {
+			return false;
+		}
+		slot[0] = t;
+		slot[1] = p;
+	}
+
+	if (f->sample > 1 && f->count++ % f->sample != 0) {
+		return false;
+	}
+
+	return true;
+}
+
+/* true if msg is to be dropped */
+static bool ctx__filtered(ctx_t *ctx, const struct mosquitto_message *msg)
+{
+	filter_t *f;
+
+	for (f = ctx->filters; f != NULL; f = f->next) {
+		bool match = false;
+
+		if (mosquitto_topic_matches_sub(f->pattern, msg->topic, &match)
+				== MOSQ_ERR_SUCCESS && match) {
+			return !filter__pass(f, msg);
+		}
+	}
+	return false;
+}
+
+/*
+ * Native routes.
+ *
+ * Messages on matching topics go through C handlers loaded from plugins
+ * before they reach the queue or Lua, see lua-mosquitto-plugin.h.
+ */
+
+typedef struct route {
+	struct route *next;
+	char *pattern;
+	void *dl;
+	void *state;
+	lua_mosquitto_plugin_handler handler;
+	lua_mosquitto_plugin_free free;
+} route_t;
+
+static void route__free(route_t *r)
+{
+	if (r->free != NULL) {
+		r->free(r->state);
+	}
+	if (r->dl != NULL) {
+		dlclose(r->dl);
+	}
+	free(r->pattern);
+	free(r);
+}
+
+/* true if a handler consumed msg */
+static bool ctx__routed(ctx_t *ctx, const struct mosquitto_message *msg)
+{
+	route_t *r;
+
+	for (r = ctx->routes; r != NULL; r = r->next) {
+		bool match = false;
+
+		if (mosquitto_topic_matches_sub(r->pattern, msg->topic, &match)
+				== MOSQ_ERR_SUCCESS && match
+				&& r->handler(r->state, msg) == LUA_MOSQUITTO_PLUGIN_CONSUMED) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Last value cache.
+ *
+ * The latest message per topic, kept natively so high rate updates never
+ * have to enter Lua. Entries live in one arena and are indexed by an open
+ * addressing table of arena offsets. A new payload is written over the old
+ * one when it fits, otherwise the entry moves to the end of the arena and
+ * the old copy becomes garbage, reclaimed by compacting into a fresh arena
+ * once the end is reached. Updates that still don't fit are counted as
+ * cache_full and dropped. Lua reads copies taken under the lock, since the
+ * cache is written from the loop_start thread.
+ */
+
+typedef struct {
+	uint64_t updated;	/* monotonic ns */
+	uint32_t topiclen;	/* excluding the NUL */
+	uint32_t cap;
+	uint32_t len;
+	int qos;
+	bool retain;
+	char data[];		/* topic, NUL, payload */
+} lvc_entry_t;
+
+typedef struct lvc {
+	pthread_mutex_t lock;
+	char *arena;
+	size_t size;
+	size_t used;
+	size_t dead;		/* bytes of entries that have moved on */
+	size_t *index;		/* arena offset + 1, 0 for an empty slot */
+	size_t mask;
+	size_t count;
+} lvc_t;
+
+#define LVC_ALIGN(n)	(((n) + 7) & ~(size_t) 7)
+
+static size_t lvc__entry_size(size_t topiclen, size_t cap)
+{
+	return LVC_ALIGN(sizeof(lvc_entry_t) + topiclen + 1 + cap);
+}
+
+static lvc_entry_t *lvc__at(lvc_t *c, size_t slot)
+{
+	return (lvc_entry_t *) (c->arena + c->index[slot] - 1);
+}
+
+static lvc_t *lvc__new(size_t size)
+{
+	lvc_t *c = calloc(1, sizeof(*c));
+
+	if (c == NULL)
+		return NULL;
+	c->arena = malloc(size);
+	c->index = calloc(64, sizeof(*c->index));
+	if (c->arena == NULL || c->index == NULL) {
+		free(c->arena);
+		free(c->index);
+		free(c);
+		return NULL;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	c->size = size;
+	c->mask = 63;
+	return c;
+}
+
+static void lvc__free(lvc_t *c)
+{
+	pthread_mutex_destroy(&c->lock);
+	free(c->arena);
+	free(c->index);
+	free(c);
+}
+
+/* slot holding topic, or the empty slot it would go into */
+static size_t lvc__slot(lvc_t *c, const char *topic, size_t topiclen)
+{
+	size_t i = mosq__fnv(FNV_BASIS, topic, topiclen) & c->mask;
+
+	while (c->index[i] != 0) {
+		lvc_entry_t *e = lvc__at(c, i);
+
+		if (e->topiclen == topiclen && memcmp(e->data, topic, topiclen) == 0)
+			break;
+		i = (i + 1) & c->mask;
+	}
+	return i;
+}
+
+/* double the index once it is half full */
+static bool lvc__grow_index(lvc_t *c)
+{
+	size_t *old = c->index, oldmask = c->mask, i;
+
+	c->index = calloc((oldmask + 1) * 2, sizeof(*c->index));
+	if (c->index == NULL) {
+		c->index = old;
+		return false;
+	}
+	c->mask = oldmask * 2 + 1;
+	for (i = 0; i <= oldmask; i++) {
+		if (old[i] != 0) {
+			lvc_entry_t *e = (lvc_entry_t *) (c->arena + old[i] - 1);
+			c->index[lvc__slot(c, e->data, e->topiclen)] = old[i];
+		}
+	}
+	free(old);
+	return true;
+}
+
+/* copy the live entries into a fresh arena, dropping the garbage */
+static bool lvc__compact(lvc_t *c)
+{
+	char *arena = malloc(c->size);
+	size_t used = 0, i;
+
+	if (arena == NULL)
+		return false;
+	for (i = 0; i <= c->mask; i++) {
+		if (c->index[i] != 0) {
+			lvc_entry_t *e = lvc__at(c, i);
+			size_t n = lvc__entry_size(e->topiclen, e->cap);
+
+			memcpy(arena + used, e, n);
+			c->index[i] = used + 1;
+			used += n;
+		}
+	}
+	free(c->arena);
+	c->arena = arena;
+	c->used = used;
+	c->dead = 0;
+	return true;
+}
+
+/* room for an entry of n bytes at the end of the arena, offset + 1 or 0 */
+static size_t lvc__alloc(lvc_t *c, size_t n)
+{
+	size_t off;
+
+	if (c->used + n > c->size) {
+		/* only worth it if that makes enough room */
+		if (c->used - c->dead + n > c->size || !lvc__compact(c))
+			return 0;
+	}
+	off = c->used;
+	c->used += n;
+	return off + 1;
+}
+
+static bool lvc__update(lvc_t *c, const struct mosquitto_message *msg)
+{
+	size_t topiclen = strlen(msg->topic);
+	size_t slot, off;
+	lvc_entry_t *e;
+
+	if (c->count + 1 > (c->mask + 1) / 2 && !lvc__grow_index(c))
+		return false;
+
+	slot = lvc__slot(c, msg->topic, topiclen);
+	if (c->index[slot] == 0 || lvc__at(c, slot)->cap < (uint32_t) msg->payloadlen) {
+		size_t old = c->index[slot] ? lvc__entry_size(topiclen, lvc__at(c, slot)->cap) : 0;
+		/* some headroom, so a payload growing a little doesn't move again */
+		size_t cap = msg->payloadlen + msg->payloadlen / 4;
+
+		off = lvc__alloc(c, lvc__entry_size(topiclen, cap));
+		if (off == 0)
+			return false;
+		/* compacting may have moved everything, look again */
+		slot = lvc__slot(c, msg->topic, topiclen);
+		if (c->index[slot] == 0)
+			c->count++;
+		c->dead += old;
+		c->index[slot] = off;
+		e = lvc__at(c, slot);
+		e->topiclen = topiclen;
+		e->cap = cap;
+		memcpy(e->data, msg->topic, topiclen + 1);
+	}
+
+	e = lvc__at(c, slot);
+	e->updated = mosq__now();
+	e->len = msg->payloadlen;
+	e->qos = msg->qos;
+	e->retain = msg->retain;
+	memcpy(e->data + topiclen + 1, msg->payload, msg->payloadlen);
+	return true;
+}
+
+static void ctx__cache_update(ctx_t *ctx, const struct mosquitto_message *msg)
+{
+	lvc_t *c = ctx->cache;
+
+	pthread_mutex_lock(&c->lock);
+	if (!lvc__update(c, msg)) {
+		ctx->stats.cache_full++;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Payload compression.
+ *
+ * ctx__publish compresses payloads into a scratch buffer and sends them as
+ * a zstd frame behind an 8 byte header in network byte order:
+ *
+ *   0   "LMZ"   magic
+ *   3   version COMPRESS_VERSION in the high nibble, the codec in the low
+ *               one, COMPRESS_ZSTD
+ *   4   size    payload bytes once decompressed
+ *
+ * Received payloads are only decompressed when the header checks out and
+ * the frame inflates to exactly size bytes; anything else, a bare zstd frame
+ * published by someone else included, passes untouched. Small messages
+ * compress badly on their own, which is what dictionaries are for.
+ * Publishing and receiving have their own zstd context and buffer, as they
+ * may run on different threads.
+ */
+
+#ifdef LUA_MOSQUITTO_ZSTD
+#define COMPRESS_MAGIC		"LMZ"
+#define COMPRESS_HDR		8
+#define COMPRESS_VERSION	1
+#define COMPRESS_ZSTD		1
+
+typedef struct compress {
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+	ZSTD_CDict *cdict;
+	ZSTD_DDict *ddict;
+	int level;
+	size_t min_len;		/* smaller payloads go out as they are */
+	char *out;			/* compressed payload being published */
+	size_t out_cap;
+	char *in;			/* decompressed payload being delivered */
+	size_t in_cap;
+} compress_t;
+
+static void compress__free(compress_t *c)
+{
+	ZSTD_freeCCtx(c->cctx);
+	ZSTD_freeDCtx(c->dctx);
+	ZSTD_freeCDict(c->cdict);
+	ZSTD_freeDDict(c->ddict);
+	free(c->out);
+	free(c->in);
+	free(c);
+}
+
+static bool compress__grow(char **buf, size_t *cap, size_t need)
+{
+	if (need > *cap) {
+		char *p = realloc(*buf, need);
+
+		if (p == NULL)
+			return false;
+		*buf = p;
+		*cap = need;
+	}
+	return true;
+}
+
+/* the payload to send, compressed if that makes it smaller */
+static const void *ctx__compress(ctx_t *ctx, const void *payload, int *payloadlen)
+{
+	compress_t *c = ctx->compress;
+	size_t len = *payloadlen, n;
+
+	if (len == 0 || len < c->min_len)
+		return payload;
+	if (!compress__grow(&c->out, &c->out_cap, COMPRESS_HDR + ZSTD_compressBound(len)))
+		return payload;
+
+	if (c->cdict != NULL)
+		n = ZSTD_compress_usingCDict(c->cctx, c->out + COMPRESS_HDR,
+			c->out_cap - COMPRESS_HDR, payload, len, c->cdict);
+	else
+		n = ZSTD_compressCCtx(c->cctx, c->out + COMPRESS_HDR,
+			c->out_cap - COMPRESS_HDR, payload, len, c->level);
+	if (ZSTD_isError(n) || COMPRESS_HDR + n >= len)
+		return payload;
+
+	memcpy(c->out, COMPRESS_MAGIC, 3);
+	c->out[3] = COMPRESS_VERSION << 4 | COMPRESS_ZSTD;
+	stream__put32((unsigned char *) c->out + 4, len);
+	n += COMPRESS_HDR;
+
+	ctx->stats.compressed++;
+	ctx->stats.compress_in += len;
+	ctx->stats.compress_out += n;
+	*payloadlen = n;
+	return c->out;
+}
+
+/* decompress an enveloped frame into *plain, false if msg is to be delivered as is */
+static bool ctx__decompress(ctx_t *ctx, const struct mosquitto_message *msg,
+	struct mosquitto_message *plain)
+{
+	compress_t *c = ctx->compress;
+	const unsigned char *p = msg->payload;
+	size_t len = msg->payloadlen - COMPRESS_HDR;
+	unsigned long long size;
+	size_t n;
+
+	if (msg->payloadlen <= COMPRESS_HDR || memcmp(p, COMPRESS_MAGIC, 3) != 0
+			|| p[3] != (COMPRESS_VERSION << 4 | COMPRESS_ZSTD))
+		return false;
+
+	size = stream__get32(p + 4);
+	p += COMPRESS_HDR;
+	if (size > 268435455 || ZSTD_getFrameContentSize(p, len) != size)
+		return false;
+	if (!compress__grow(&c->in, &c->in_cap, size + 1))
+		return false;
+
+	if (c->ddict != NULL)
+		n = ZSTD_decompress_usingDDict(c->dctx, c->in, size, p, len, c->ddict);
+	else
+		n = ZSTD_decompressDCtx(c->dctx, c->in, size, p, len);
+	if (ZSTD_isError(n) || n != size)
+		return false;
+
+	c->in[n] = '\0';
+	*plain = *msg;
+	plain->payload = c->in;
+	plain->payloadlen = n;
+	ctx->stats.decompressed++;
+	return true;
+}
+#endif
+
+/*
+ * Publish rate limiting.
+ *
+ * Two token buckets, one counting messages and one counting payload bytes,
+ * refilled from the monotonic clock whenever the limiter is consulted. A
+ * publish has to take from both. Depending on the mode an over-limit publish
+ * is either rejected with ERR_RATE_LIMIT or queued, the queue being drained
+ * from the loop functions as tokens become available again.
+ */
+
+static void rate__refill(rate_t *rate)
+{
+	uint64_t now = mosq__now();
+	double elapsed = (now - rate->last) / 1e9;
+	int i;
+
+	rate->last = now;
+	for (i = 0; i < 2; i++) {
+		rate->tokens[i] += rate->rate[i] * elapsed;
+		if (rate->tokens[i] > rate->burst[i])
+			rate->tokens[i] = rate->burst[i];
+	}
+}
+
+/* tokens required before a publish may go out; anything larger than the
+ * bucket goes out once the bucket is full and leaves it in debt */
+static double rate__need(rate_t *rate, int i, int payloadlen)
+{
+	double need = i == 0 ? 1 : payloadlen;
+
+	return need < rate->burst[i] ? need : rate->burst[i];
+}
+
+static bool rate__take(rate_t *rate, int payloadlen)
+{
+	double need[2] = { 1, payloadlen };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (rate->rate[i] > 0 && rate->tokens[i] < rate__need(rate, i, payloadlen))
+			return false;
+	}
+	for (i = 0; i < 2; i++) {
+		if (rate->rate[i] > 0)
+			rate->tokens[i] -= need[i];
+	}
+	return true;
+}
+
+/* seconds until a publish of payloadlen bytes would be admitted */
+static double rate__delay(rate_t *rate, int payloadlen)
+{
+	double delay = 0;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		double need = rate__need(rate, i, payloadlen);
+		double d;
+		if (rate->rate[i] <= 0 || rate->tokens[i] >= need)
+			continue;
+		d = (need - rate->tokens[i]) / rate->rate[i];
+		if (d > delay)
+			delay = d;
+	}
+	return delay;
+}
+
+static int rate__enqueue(rate_t *rate, const char *topic, int payloadlen,
+	const void *payload, int qos, bool retain)
+{
+	size_t topiclen = strlen(topic) + 1;
+	rate_msg_t *msg = malloc(sizeof(*msg) + topiclen + payloadlen);
+
+	if (msg == NULL)
+		return MOSQ_ERR_NOMEM;
+
+	msg->next = NULL;
+	msg->payloadlen = payloadlen;
+	msg->qos = qos;
+	msg->retain = retain;
+	memcpy(msg->data, topic, topiclen);
+	if (payloadlen > 0)
+		memcpy(msg->data + topiclen, payload, payloadlen);
+
+	if (rate->tail != NULL)
+		rate->tail->next = msg;
+	else
+		rate->head = msg;
+	rate->tail = msg;
+	rate->queued++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void rate__clear(rate_t *rate)
+{
+	while (rate->head != NULL) {
+		rate_msg_t *msg = rate->head;
+		rate->head = msg->next;
+		free(msg);
+	}
+	rate->tail = NULL;
+	rate->queued = 0;
+}
+
+/* mosquitto_publish, recorded in the store and timed around the call */
+static int ctx__publish_now(ctx_t *ctx, int *mid, const char *topic,
+	int payloadlen, const void *payload, int qos, bool retain)
+{
+	store_t *store = qos > 0 ? ctx->store : NULL;
+	bool reserved = false;
+	int rc;
+
+	if (store != NULL) {
+		pthread_mutex_lock(&store->lock);
+		/* a failing store only costs durability, the message still goes */
+		reserved = store->ops->reserve(store, topic, payloadlen, payload,
+			qos, retain) == 0;
+	}
+	if (ctx->latency != NULL) {
+		latency__begin(ctx->latency);
+	}
+
+	rc = mosquitto_publish(ctx->mosq, mid, topic, payloadlen, payload, qos, retain);
+
+	if (ctx->latency != NULL) {
+		latency__sent(ctx->latency, *mid, rc);
+	}
+	if (store != NULL) {
+		if (reserved) {
+			store->ops->commit(store, rc == MOSQ_ERR_SUCCESS ? *mid : -1);
+		}
+		pthread_mutex_unlock(&store->lock);
+	}
+	return rc;
+}
+
+/* publish queued messages for as long as the buckets allow */
+static void ctx__rate_drain(ctx_t *ctx)
+{
+	rate_t *rate = &ctx->rate;
+
+	if (rate->head == NULL || rate->draining)
+		return;
+
+	rate->draining = true;
+	rate__refill(rate);
+	while (rate->head != NULL && rate__take(rate, rate->head->payloadlen)) {
+		rate_msg_t *msg = rate->head;
+		const char *payload = msg->data + strlen(msg->data) + 1;
+		int mid;
+
+		if (ctx__publish_now(ctx, &mid, msg->data, msg->payloadlen,
+				payload, msg->qos, msg->retain) != MOSQ_ERR_SUCCESS) {
+			/* give the tokens back and retry on the next pass */
+			rate->tokens[0] += 1;
+			rate->tokens[1] += msg->payloadlen;
+			break;
+		}
+
+		rate->head = msg->next;
+		if (rate->head == NULL)
+			rate->tail = NULL;
+		rate->queued--;
+		free(msg);
+	}
+	rate->draining = false;
+}
+
+/***
+ * Library functions
+ * @section lib_functions
+ */
+
+/***
+ * Return mosquitto library version.
+ * @function version
+ * @treturn string version string "major.minor.revision"
+ * @see mosquitto_lib_version
+ */
+static int mosq_version(lua_State *L)
+{
+	int major, minor, rev;
+	char version[16];
+
+	mosquitto_lib_version(&major, &minor, &rev);
+	sprintf(version, "%i.%i.%i", major, minor, rev);
+	lua_pushstring(L, version);
+	return 1;
+}
+
+/***
+ * Does a topic match a subscription string?
+ * @function topic_matches_sub
+ * @tparam string subscription eg, blah/+/wop/#
+ * @tparam string topic to test
+ * @return[1] boolean result
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ * @see mosquitto_topic_matches_sub
+ */
+static int mosq_topic_matches_sub(lua_State *L)
+{
+	const char *sub = luaL_checkstring(L, 1);
+	const char *topic = luaL_checkstring(L, 2);
+
+	bool result;
+	int rc = mosquitto_topic_matches_sub(sub, topic, &result);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		return mosq__pstatus(L, rc);
+	} else {
+		lua_pushboolean(L, result);
+		return 1;
+	}
+}
+
+/***
+ * Monotonic clock
+ * The clock the native timing features run on, for measuring intervals.
+ * @function clock
+ * @treturn number seconds since an arbitrary point in the past
+ */
+static int mosq_clock(lua_State *L)
+{
+	lua_pushnumber(L, mosq__now() / 1e9);
+	return 1;
+}
+
+/***
+ * @function init
+ * @see mosquitto_lib_init
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+*/
+static int mosq_init(lua_State *L)
+{
+	if (!mosq_initialized)
+		mosquitto_lib_init();
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Cleanup mosquitto library.
+ * This is called automatically by garbage collection, you shouldn't normally
+ * have to call this.
+ * @function cleanup
+ * @see mosquitto_lib_cleanup
+ * @return[1] true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int mosq_cleanup(lua_State *L)
+{
+	mosquitto_lib_cleanup();
+	mosq_initialized = 0;
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+static void ctx__on_init(ctx_t *ctx)
+{
+	ctx->on_connect = LUA_REFNIL;
+	ctx->on_disconnect = LUA_REFNIL;
+	ctx->on_publish = LUA_REFNIL;
+	ctx->on_message = LUA_REFNIL;
+	ctx->on_subscribe = LUA_REFNIL;
+	ctx->on_unsubscribe = LUA_REFNIL;
+	ctx->on_log = LUA_REFNIL;
+}
+
+/*
+ * Handlers run on a coroutine of their own, created with the first handler
+ * and anchored in the uservalue of the instance. Its stack holds a copy of
+ * every handler in fixed slots, so dispatching an event is pushing the
+ * function already in place and its arguments, and resuming it. The
+ * registry refs stay the handlers of record: a handler replaced while
+ * another one runs can't be copied into the slots below it, those are
+ * refreshed once it returns.
+ *
+ * A handler may yield: its coroutine is parked, resumed once per loop pass
+ * until it returns, and a fresh one takes over dispatching. Inside
+ * mosquitto_loop_forever there are no passes to hook into, parked handlers
+ * get their turn after each event dispatched instead. Events raised
+ * by a handler while it runs (ON_LOG from a publish, say) are called on the
+ * same coroutine with a protected call, those can't yield.
+ */
+enum dispatch_slot {
+	SLOT_CONNECT = 1,
+	SLOT_DISCONNECT,
+	SLOT_PUBLISH,
+	SLOT_MESSAGE,
+	SLOT_SUBSCRIBE,
+	SLOT_UNSUBSCRIBE,
+	SLOT_LOG,
+	SLOT_TOP = SLOT_LOG
+};
+
+static int *ctx__slot_ref(ctx_t *ctx, int slot)
+{
+	switch (slot) {
+		case SLOT_CONNECT:		return &ctx->on_connect;
+		case SLOT_DISCONNECT:	return &ctx->on_disconnect;
+		case SLOT_PUBLISH:		return &ctx->on_publish;
+		case SLOT_MESSAGE:		return &ctx->on_message;
+		case SLOT_SUBSCRIBE:	return &ctx->on_subscribe;
+		case SLOT_UNSUBSCRIBE:	return &ctx->on_unsubscribe;
+		default:				return &ctx->on_log;
+	}
+}
+
+static int ctx__traceback(lua_State *L)
+{
+	const char *msg = lua_tostring(L, 1);
+
+	if (msg == NULL) {
+		msg = lua_pushfstring(L, "(error object is a %s value)",
+			luaL_typename(L, 1));
+	}
+#if LUA_VERSION_NUM >= 502
+	luaL_traceback(L, L, msg, 1);
+#else
+	lua_pushstring(L, msg);
+#endif
+	return 1;
+}
+
+/* copy the handlers of record into the slots, D must be idle */
+static void ctx__handlers_sync(ctx_t *ctx)
+{
+	lua_State *D = ctx->D;
+	int slot;
+
+	if (D == NULL) {
+		return;
+	}
+	if (ctx->dispatching > 0) {
+		ctx->handlers_dirty = true;
+		return;
+	}
+	for (slot = SLOT_CONNECT; slot <= SLOT_TOP; slot++) {
+		lua_rawgeti(D, LUA_REGISTRYINDEX, *ctx__slot_ref(ctx, slot));
+		lua_replace(D, slot);
+	}
+	ctx->handlers_dirty = false;
+}
+
+/* a fresh D, replacing the one at the bottom of H */
+static void ctx__dispatch_thread(ctx_t *ctx)
+{
+	lua_State *D = lua_newthread(ctx->H);
+	int slot;
+
+	if (lua_gettop(ctx->H) > 1) {
+		lua_replace(ctx->H, 1);
+	}
+	/* room for the slots and the arguments of any event but SUBSCRIBE */
+	lua_checkstack(D, SLOT_TOP + 8);
+	for (slot = SLOT_CONNECT; slot <= SLOT_TOP; slot++) {
+		lua_rawgeti(D, LUA_REGISTRYINDEX, *ctx__slot_ref(ctx, slot));
+	}
+	ctx->D = D;
+	ctx->handlers_dirty = false;
+}
+
+/*
+ * H never runs, its stack anchors D at 1 and the parked coroutines above,
+ * in the order of ctx->parked. The instance's uservalue anchors H.
+ */
+static void ctx__dispatch_new(lua_State *L, int idx, ctx_t *ctx)
+{
+	ctx->H = lua_newthread(L);
+	lua_getuservalue(L, idx);
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, 1);
+	lua_pop(L, 2);
+	ctx__dispatch_thread(ctx);
+}
+
+static void ctx__dispatch_free(lua_State *L, ctx_t *ctx)
+{
+	if (ctx->H != NULL) {
+		lua_settop(ctx->H, 0);
+	}
+	free(ctx->parked);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->last_error);
+	ctx->last_error = LUA_NOREF;
+	ctx->parked = NULL;
+	ctx->nparked = 0;
+	ctx->cparked = 0;
+	ctx->H = NULL;
+	ctx->D = NULL;
+}
+
+/* keep the error on top of T as the last one, traced back if T died of it */
+static void ctx__dispatch_error(ctx_t *ctx, lua_State *T, bool died)
+{
+	ctx->stats.callback_errors++;
+#if LUA_VERSION_NUM >= 502
+	if (died) {
+		const char *msg = lua_tostring(T, -1);
+
+		if (msg == NULL) {
+			msg = lua_pushfstring(T, "(error object is a %s value)",
+				luaL_typename(T, -1));
+		}
+		luaL_traceback(T, T, msg, 0);
+	}
+#else
+	(void) died;
+#endif
+	if (ctx->last_error == LUA_NOREF) {
+		ctx->last_error = luaL_ref(T, LUA_REGISTRYINDEX);
+	} else {
+		lua_rawseti(T, LUA_REGISTRYINDEX, ctx->last_error);
+	}
+}
+
+/* room for one more parked coroutine, false when out of memory */
+static bool ctx__park_reserve(ctx_t *ctx)
+{
+	if (!lua_checkstack(ctx->H, 1)) {
+		ctx->stats.callback_errors++;
+		return false;
+	}
+	if (ctx->nparked == ctx->cparked) {
+		int n = ctx->cparked ? ctx->cparked * 2 : 4;
+		lua_State **parked = realloc(ctx->parked, n * sizeof(*parked));
+
+		if (parked == NULL) {
+			/* dropped, as if it had failed */
+			ctx->stats.callback_errors++;
+			return false;
+		}
+		ctx->parked = parked;
+		ctx->cparked = n;
+	}
+	return true;
+}
+
+/*
+ * T yielded from a callback run by the library thread, which never resumes
+ * anything: kept as an error instead of parking it for good
+ */
+static bool ctx__dispatch_yield_threaded(ctx_t *ctx, lua_State *T)
+{
+	if (!ctx->threaded) {
+		return false;
+	}
+	lua_settop(T, 0);
+	lua_pushliteral(T, "attempt to yield from a callback under loop_start");
+	ctx__dispatch_error(ctx, T, false);
+	return true;
+}
+
+/* D yielded: set it aside for the loop to resume, dispatch on a new one */
+static void ctx__dispatch_park(ctx_t *ctx)
+{
+	lua_State *D = ctx->D;
+
+	/* whatever it yielded, nobody to hand it to */
+	lua_settop(D, 0);
+	if (!ctx__dispatch_yield_threaded(ctx, D) && ctx__park_reserve(ctx)) {
+		ctx->parked[ctx->nparked++] = D;
+		lua_pushvalue(ctx->H, 1);
+	}
+	ctx__dispatch_thread(ctx);
+}
+
+/*
+ * An event raised while a handler runs: D is busy, and need not be the
+ * running thread either as the handler may have resumed a coroutine of its
+ * own. It gets a fresh coroutine T, on top of H while it runs; parking T
+ * moves it down to the parked ones, under whatever nested T still runs.
+ */
+static void ctx__dispatch_nested(ctx_t *ctx, lua_State *T, int nargs)
+{
+	int status;
+
+	ctx->dispatching++;
+	status = lua_resume(T, NULL, nargs);
+	ctx->dispatching--;
+
+	if (status == LUA_YIELD) {
+		lua_settop(T, 0);
+		if (!ctx__dispatch_yield_threaded(ctx, T) && ctx__park_reserve(ctx)) {
+			ctx->parked[ctx->nparked++] = T;
+			lua_insert(ctx->H, 1 + ctx->nparked);
+			return;
+		}
+	} else if (status != LUA_OK) {
+		ctx__dispatch_error(ctx, T, true);
+	}
+	lua_pop(ctx->H, 1);
+}
+
+/* give the first n parked handlers one more turn, once per loop pass; the
+ * ones parked in the meantime wait for the next pass */
+static void ctx__resume_parked(ctx_t *ctx, int n)
+{
+	int i = 0;
+
+	if (ctx->destroy_pending) {
+		return;
+	}
+	while (i < n) {
+		lua_State *P = ctx->parked[i];
+		int status = lua_resume(P, NULL, 0);
+
+		if (status == LUA_YIELD) {
+			lua_settop(P, 0);
+			i++;
+			continue;
+		}
+		if (status != LUA_OK) {
+			ctx__dispatch_error(ctx, P, true);
+		}
+		ctx->nparked--;
+		n--;
+		memmove(&ctx->parked[i], &ctx->parked[i + 1],
+			(ctx->nparked - i) * sizeof(*ctx->parked));
+		lua_remove(ctx->H, 2 + i);
+	}
+}
+
+/* push the handler in slot onto the thread returned, with room for nargs
+ * arguments; NULL if the stack can't grow that far */
+static lua_State *ctx__dispatch_begin(ctx_t *ctx, int slot, int nargs)
+{
+	lua_State *D = ctx->D;
+
+	if (ctx->dispatching == 0) {
+		if (!lua_checkstack(D, nargs + 1)) {
+			return NULL;
+		}
+		lua_pushvalue(D, slot);
+	} else {
+		/* an event raised by a handler, see ctx__dispatch_nested */
+		if (!lua_checkstack(ctx->H, 1)) {
+			return NULL;
+		}
+		D = lua_newthread(ctx->H);
+		if (!lua_checkstack(D, nargs + 1)) {
+			lua_pop(ctx->H, 1);
+			return NULL;
+		}
+		lua_rawgeti(D, LUA_REGISTRYINDEX, *ctx__slot_ref(ctx, slot));
+	}
+	return D;
+}
+
+/* call the handler with nargs arguments pushed by ctx__dispatch_begin */
+static void ctx__dispatch(ctx_t *ctx, int nargs)
+{
+	lua_State *D = ctx->D;
+	int parked = ctx->nparked;
+	int status;
+
+	if (ctx->dispatching > 0) {
+		ctx__dispatch_nested(ctx, lua_tothread(ctx->H, -1), nargs);
+		return;
+	}
+
+	ctx->dispatching++;
+	status = lua_resume(D, NULL, nargs);
+	ctx->dispatching--;
+
+	if (status == LUA_OK) {
+		lua_settop(D, SLOT_TOP);
+	} else if (status == LUA_YIELD) {
+		ctx__dispatch_park(ctx);
+	} else {
+		/* D is dead, the error unwound it */
+		ctx__dispatch_error(ctx, D, true);
+		ctx__dispatch_thread(ctx);
+	}
+
+	if (ctx->mosq == NULL) {
+		/* destroyed by the handler, outside of any loop */
+		ctx__dispatch_free(D, ctx);
+		return;
+	}
+	if (ctx->handlers_dirty) {
+		ctx__handlers_sync(ctx);
+	}
+	/* no loop pass to resume them from, the ones parked before this event
+	 * go now */
+	if (ctx->forever && parked > 0) {
+		ctx__resume_parked(ctx, parked);
+	}
+}
+
+static void ctx__on_clear(lua_State *L, ctx_t *ctx)
+{
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->on_connect);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->on_disconnect);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->on_publish);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->on_message);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->on_subscribe);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->on_unsubscribe);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->on_log);
+}
+
+/***
+ * Create a new mosquitto instance
+ * @function new
+ * @tparam[opt=nil] string client id, optional. nil to allow library to generate
+ * @tparam[opt=true] boolean clean_session
+ * @return[1] a mosquitto instance
+ * @raise For some out of memory or illegal states, or both nil id and clean session true
+ * @see mosquitto_new
+ */
+static int mosq_new(lua_State *L)
+{
+	const char *id = luaL_optstring(L, 1, NULL);
+	bool clean_session = (lua_isboolean(L, 2) ? lua_toboolean(L, 2) : true);
+
+	if (id == NULL && !clean_session) {
+		return luaL_argerror(L, 2, "if 'id' is nil then 'clean session' must be true");
+	}
+
+	ctx_t *ctx = (ctx_t *) lua_newuserdata(L, sizeof(ctx_t));
+
+	/* ctx will be passed as void *obj arg in the callback functions */
+	ctx->mosq = mosquitto_new(id, clean_session, ctx);
+
+	if (ctx->mosq == NULL) {
+		return luaL_error(L, strerror(errno));
+	}
+
+	ctx->depth = 0;
+	ctx->destroy_pending = false;
+	ctx->store = NULL;
+	ctx->latency = NULL;
+	ctx->queue = NULL;
+	ctx->streams = NULL;
+	ctx->stream_id = (uint32_t) (mosq__now() ^ ((uint64_t) getpid() << 16));
+	ctx->compress = NULL;
+	ctx->dedup = NULL;
+	ctx->filters = NULL;
+	ctx->routes = NULL;
+	ctx->cache = NULL;
+	ctx->H = NULL;
+	ctx->D = NULL;
+	ctx->parked = NULL;
+	ctx->nparked = 0;
+	ctx->cparked = 0;
+	ctx->last_error = LUA_NOREF;
+	ctx->dispatching = 0;
+	ctx->handlers_dirty = false;
+	ctx->threaded = false;
+	ctx->forever = false;
+	ctx->pool = LUA_NOREF;
+	ctx->pool_records = 0;
+	ctx->pool_batches = 0;
+	memset(&ctx->rate, 0, sizeof(ctx->rate));
+	memset(&ctx->flow, 0, sizeof(ctx->flow));
+	memset(&ctx->acks, 0, sizeof(ctx->acks));
+	memset(&ctx->ffi, 0, sizeof(ctx->ffi));
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	/* libmosquitto defaults */
+	ctx->reconnect.delay = 1;
+	ctx->reconnect.delay_max = 1;
+	ctx->reconnect.backoff = false;
+	ctx->reconnect.disconnecting = false;
+	ctx__on_init(ctx);
+
+	/* anchors the dispatch coroutines, see ctx__dispatch_new */
+	lua_newtable(L);
+	lua_setuservalue(L, -2);
+	luaL_getmetatable(L, MOSQ_META_CTX);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static ctx_t * ctx_check(lua_State *L, int i)
+{
+	return (ctx_t *) luaL_checkudata(L, i, MOSQ_META_CTX);
+}
+
+/***
+ * Wait for socket activity on several instances
+ * Drives any number of instances from one thread together with loop_read,
+ * loop_write and loop_misc, without an external poll binding. Instances
+ * without a connection are skipped.
+ * @function poll
+ * @tparam table ctxs array of instances
+ * @tparam[opt=-1] number timeout ms to wait, -1 to wait indefinitely
+ * @treturn[1] table instances ready to read
+ * @treturn[1] table instances ready to write, out of those that want_write
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise If ctxs holds anything but instances
+ * @see want_write
+ */
+static int mosq_poll(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int timeout = luaL_optinteger(L, 2, -1);
+	int n = lua_rawlen(L, 1);
+	int i, k, nfds = 0, rc;
+	/* a userdata, so raising errors doesn't leak it */
+	struct pollfd *fds = lua_newuserdata(L, (n + 1) * (sizeof(*fds) + sizeof(int)));
+	int *index = (int *) (fds + n + 1);
+
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, 1, i);
+		ctx_t *ctx = ctx_check(L, -1);
+		int fd = ctx->mosq != NULL ? mosquitto_socket(ctx->mosq) : -1;
+
+		lua_pop(L, 1);
+		if (fd < 0) {
+			continue;
+		}
+		fds[nfds].fd = fd;
+		fds[nfds].events = POLLIN | (mosquitto_want_write(ctx->mosq) ? POLLOUT : 0);
+		fds[nfds].revents = 0;
+		index[nfds++] = i;
+	}
+
+	rc = poll(fds, nfds, timeout);
+	if (rc < 0 && errno != EINTR) {
+		return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+	}
+
+	lua_newtable(L);
+	lua_newtable(L);
+	int r = 0, w = 0;
+
+	for (k = 0; rc > 0 && k < nfds; k++) {
+		if (fds[k].revents & (POLLIN | POLLERR | POLLHUP)) {
+			lua_rawgeti(L, 1, index[k]);
+			lua_rawseti(L, -3, ++r);
+		}
+		if (fds[k].revents & POLLOUT) {
+			lua_rawgeti(L, 1, index[k]);
+			lua_rawseti(L, -2, ++w);
+		}
+	}
+
+	return 2;
+}
+
+/*
+ * Worker pool: threads running a Lua state each, exchanging records through
+ * one queue per state, queue 0 belonging to the state that made the pool.
+ * Instances belong to the state that created them, so a worker script
+ * creating its share of them spreads the connections across cores.
+ * Shared subscriptions are read by connections of the pool's own, on their
+ * library threads, and handed to the workers through a second, locked,
+ * queue per worker which the others may steal from.
+ *
+ * The queues are Vyukov's intrusive MPSC queue: a producer swaps its record
+ * in as the head with one atomic exchange and links the previous head to
+ * it, the single consumer walks from the tail. A consumer about to sleep
+ * raises its waiting flag, the producer clearing it writes to its pipe.
+ */
+#define MOSQ_META_POOL	"mosquitto.pool"
+
+typedef struct wq_node {
+	struct wq_node *next;
+	struct pool_share *share;	/* the shared subscription it came from */
+	int from;
+	int topiclen;
+	int payloadlen;
+	/* followed by the topic, NUL terminated, and the payload */
+} wq_node_t;
+
+typedef struct {
+	wq_node_t *head;	/* last pushed, swapped by the producers */
+	wq_node_t *tail;	/* next to pop, the consumer's alone */
+	wq_node_t stub;
+	int waiting;
+	int fds[2];
+} wq_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	wq_node_t *head;
+	wq_node_t **tail;
+	int count;			/* read unlocked, to pick the least loaded worker */
+	int busy;			/* the worker is handling one of these */
+} share_q_t;
+
+typedef struct pool_share {
+	struct pool_share *next;
+	struct pool *pool;
+	char *group;
+	char *sub;			/* $share/group/filter */
+	int qos;
+	unsigned int turn;	/* where the search for the least loaded starts */
+	int nconns;
+	struct mosquitto **conns;
+} pool_share_t;
+
+typedef struct pool_worker {
+	struct pool *pool;
+	int index;
+	lua_State *L;
+	pthread_t thread;
+	bool started;
+	char *error;		/* what the script died of */
+	share_q_t shared;
+} pool_worker_t;
+
+typedef struct pool {
+	int refs;			/* the pool object and the running workers */
+	int nworkers;
+	int stopping;
+	bool joined;
+	wq_t *queues;		/* nworkers + 1 */
+	pool_worker_t *workers;
+	pool_share_t *shares;
+} pool_t;
+
+/* the worker running on this thread, NULL outside of a pool */
+static __thread pool_worker_t *pool__self;
+
+LUA_MOSQUITTO_API int luaopen_mosquitto(lua_State *L);
+
+static bool wq__init(wq_t *q)
+{
+	int i;
+
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+	q->waiting = 0;
+	if (pipe(q->fds) < 0) {
+		q->fds[0] = q->fds[1] = -1;
+		return false;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(q->fds[i], F_SETFL, fcntl(q->fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(q->fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	return true;
+}
+
+static void wq__wake(wq_t *q)
+{
+	char c = 0;
+	/* a full pipe wakes the consumer as well */
+	ssize_t rc = write(q->fds[1], &c, 1);
+
+	(void) rc;
+}
+
+static void wq__push(wq_t *q, wq_node_t *n)
+{
+	wq_node_t *prev;
+
+	n->next = NULL;
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/* wake the consumer of q if it sleeps */
+static void wq__notify(wq_t *q)
+{
+	if (__atomic_exchange_n(&q->waiting, 0, __ATOMIC_SEQ_CST)) {
+		wq__wake(q);
+	}
+}
+
+/* NULL when empty, or while a push is half way */
+static wq_node_t *wq__pop(wq_t *q)
+{
+	wq_node_t *tail = q->tail;
+	wq_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	/* tail is the last one, put the stub behind it to take it out */
+	wq__push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static void wq__send(wq_t *q, wq_node_t *n)
+{
+	wq__push(q, n);
+	wq__notify(q);
+}
+
+static void share__put(share_q_t *q, wq_node_t *n)
+{
+	n->next = NULL;
+	pthread_mutex_lock(&q->lock);
+	*q->tail = n;
+	q->tail = &n->next;
+	__atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static wq_node_t *share__take(share_q_t *q)
+{
+	wq_node_t *n;
+
+	pthread_mutex_lock(&q->lock);
+	n = q->head;
+	if (n != NULL) {
+		q->head = n->next;
+		if (q->head == NULL) {
+			q->tail = &q->head;
+		}
+		__atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+static int share__load(share_q_t *q)
+{
+	return __atomic_load_n(&q->count, __ATOMIC_RELAXED)
+		+ __atomic_load_n(&q->busy, __ATOMIC_RELAXED);
+}
+
+/* a shared record of the worker with the most of them queued */
+static wq_node_t *pool__steal(pool_t *pool, pool_worker_t *thief)
+{
+	share_q_t *victim = NULL;
+	int most = 0;
+	int i;
+
+	for (i = 0; i < pool->nworkers; i++) {
+		share_q_t *q = &pool->workers[i].shared;
+		int count = __atomic_load_n(&q->count, __ATOMIC_RELAXED);
+
+		if (q != &thief->shared && count > most) {
+			victim = q;
+			most = count;
+		}
+	}
+	return victim != NULL ? share__take(victim) : NULL;
+}
+
+/* the next record for state index: its own, shared ones, stolen ones */
+static wq_node_t *pool__take(pool_t *pool, int index)
+{
+	wq_node_t *n = wq__pop(&pool->queues[index]);
+	pool_worker_t *w;
+
+	if (n != NULL || index == 0) {
+		return n;
+	}
+	w = &pool->workers[index - 1];
+	n = share__take(&w->shared);
+	if (n == NULL && __atomic_load_n(&pool->shares, __ATOMIC_RELAXED) != NULL) {
+		n = pool__steal(pool, w);
+	}
+	return n;
+}
+
+static wq_node_t *pool__wait(pool_t *pool, int index, int timeout)
+{
+	wq_t *q = &pool->queues[index];
+	uint64_t deadline = mosq__now() + (uint64_t) timeout * 1000000;
+	wq_node_t *n = pool__take(pool, index);
+	char buf[64];
+
+	while (n == NULL && timeout != 0
+			&& !__atomic_load_n(&pool->stopping, __ATOMIC_SEQ_CST)) {
+		struct pollfd pfd = { q->fds[0], POLLIN, 0 };
+		int ms = timeout;
+
+		if (timeout > 0) {
+			uint64_t now = mosq__now();
+
+			if (now >= deadline) {
+				break;
+			}
+			ms = (deadline - now + 999999) / 1000000;
+		}
+		__atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		/* a record pushed before the flag went up */
+		n = pool__take(pool, index);
+		if (n == NULL) {
+			poll(&pfd, 1, ms);
+			while (read(q->fds[0], buf, sizeof(buf)) > 0) {
+			}
+			n = pool__take(pool, index);
+		}
+		__atomic_store_n(&q->waiting, 0, __ATOMIC_SEQ_CST);
+	}
+	return n;
+}
+
+static void wq__free(wq_t *q)
+{
+	wq_node_t *n;
+
+	while ((n = wq__pop(q)) != NULL) {
+		free(n);
+	}
+	if (q->fds[0] >= 0) {
+		close(q->fds[0]);
+		close(q->fds[1]);
+	}
+}
+
+static wq_node_t *wq__node(int from, const char *topic, size_t topiclen,
+	const void *payload, size_t payloadlen)
+{
+	wq_node_t *n = malloc(sizeof(*n) + topiclen + 1 + payloadlen);
+	char *data;
+
+	if (n == NULL) {
+		return NULL;
+	}
+	data = (char *) (n + 1);
+	n->share = NULL;
+	n->from = from;
+	n->topiclen = topiclen;
+	n->payloadlen = payloadlen;
+	memcpy(data, topic, topiclen);
+	data[topiclen] = '\0';
+	memcpy(data + topiclen + 1, payload, payloadlen);
+	return n;
+}
+
+static int pool__send(lua_State *L, pool_t *pool, int from, int to_arg)
+{
+	int to = luaL_checkinteger(L, to_arg);
+	size_t topiclen, payloadlen = 0;
+	const char *topic = luaL_checklstring(L, to_arg + 1, &topiclen);
+	const char *payload = luaL_optlstring(L, to_arg + 2, "", &payloadlen);
+	wq_node_t *n;
+
+	luaL_argcheck(L, to >= 0 && to <= pool->nworkers, to_arg, "no such worker");
+	n = wq__node(from, topic, topiclen, payload, payloadlen);
+	if (n == NULL) {
+		return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+	}
+	wq__send(&pool->queues[to], n);
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+static int pool__recv(lua_State *L, pool_t *pool, int index, int timeout_arg)
+{
+	int timeout = luaL_optinteger(L, timeout_arg, -1);
+	wq_node_t *n;
+	const char *data;
+
+	if (index > 0) {
+		/* done with the last one, if it was shared */
+		__atomic_store_n(&pool->workers[index - 1].shared.busy, 0,
+			__ATOMIC_RELAXED);
+	}
+	n = pool__wait(pool, index, timeout);
+	if (n == NULL) {
+		if (__atomic_load_n(&pool->stopping, __ATOMIC_SEQ_CST)) {
+			lua_pushboolean(L, 0);
+		} else {
+			lua_pushnil(L);
+		}
+		return 1;
+	}
+	data = (const char *) (n + 1);
+	lua_pushlstring(L, data, n->topiclen);
+	lua_pushlstring(L, data + n->topiclen + 1, n->payloadlen);
+	if (n->share != NULL) {
+		__atomic_store_n(&pool->workers[index - 1].shared.busy, 1,
+			__ATOMIC_RELAXED);
+		lua_pushstring(L, n->share->group);
+	} else {
+		lua_pushinteger(L, n->from);
+	}
+	free(n);
+	return 3;
+}
+
+static void pool__stop(pool_t *pool)
+{
+	pool_share_t *share;
+	int i;
+
+	for (share = pool->shares; share != NULL; share = share->next) {
+		for (i = 0; i < share->nconns; i++) {
+			mosquitto_disconnect(share->conns[i]);
+		}
+	}
+	__atomic_store_n(&pool->stopping, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i <= pool->nworkers; i++) {
+		wq__wake(&pool->queues[i]);
+	}
+}
+
+/* wait for the workers and close their states, the first error if any */
+static const char *pool__join(pool_t *pool, int *index)
+{
+	const char *error = NULL;
+	int i;
+
+	for (i = 0; i < pool->nworkers; i++) {
+		pool_worker_t *w = &pool->workers[i];
+
+		if (w->started) {
+			pthread_join(w->thread, NULL);
+			w->started = false;
+		}
+		if (w->L != NULL) {
+			lua_close(w->L);
+			w->L = NULL;
+		}
+		if (w->error != NULL && error == NULL) {
+			error = w->error;
+			*index = w->index;
+		}
+	}
+	pool->joined = true;
+	return error;
+}
+
+/* no more records from share once this returns */
+static void share__close(pool_share_t *share)
+{
+	int i;
+
+	for (i = 0; i < share->nconns; i++) {
+		mosquitto_loop_stop(share->conns[i], false);
+		mosquitto_destroy(share->conns[i]);
+	}
+	share->nconns = 0;
+}
+
+/* only once no record of it is left, they point at the group */
+static void share__free(pool_share_t *share)
+{
+	free(share->conns);
+	free(share->group);
+	free(share->sub);
+	free(share);
+}
+
+static void pool__free(pool_t *pool)
+{
+	wq_node_t *n;
+	int i;
+
+	pool_share_t *share;
+
+	if (pool->queues != NULL) {
+		pool__stop(pool);
+	}
+	for (share = pool->shares; share != NULL; share = share->next) {
+		share__close(share);
+	}
+	if (pool->workers != NULL) {
+		pool__join(pool, &i);
+		for (i = 0; i < pool->nworkers; i++) {
+			pool_worker_t *w = &pool->workers[i];
+
+			while ((n = share__take(&w->shared)) != NULL) {
+				free(n);
+			}
+			pthread_mutex_destroy(&w->shared.lock);
+			free(w->error);
+		}
+		free(pool->workers);
+	}
+	if (pool->queues != NULL) {
+		for (i = 0; i <= pool->nworkers; i++) {
+			wq__free(&pool->queues[i]);
+		}
+		free(pool->queues);
+	}
+	/* the workers are gone and their records with them */
+	while (pool->shares != NULL) {
+		share = pool->shares;
+		pool->shares = share->next;
+		share__free(share);
+	}
+	free(pool);
+}
+
+/* the last one out frees the pool, the workers may outlive its object */
+static void pool__unref(pool_t *pool)
+{
+	if (__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		pool__free(pool);
+	}
+}
+
+static void *pool__run(void *arg)
+{
+	pool_worker_t *w = arg;
+
+	pool__self = w;
+	/* the traceback, the chunk and its arguments, see pool__open */
+	if (lua_pcall(w->L, 2, 0, 1)) {
+		const char *msg = lua_tostring(w->L, -1);
+
+		w->error = strdup(msg != NULL ? msg : "(error object is not a string)");
+	}
+	pool__unref(w->pool);
+	return NULL;
+}
+
+/* set up a worker state: libraries, this module and the script */
+static int pool__open(lua_State *L)
+{
+	const char *init = lua_tostring(L, 1);
+
+	luaL_openlibs(L);
+	/* the module as loaded here, whatever package.cpath says */
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaded");
+	lua_pushcfunction(L, luaopen_mosquitto);
+	lua_call(L, 0, 1);
+	lua_setfield(L, -2, "mosquitto");
+	lua_pop(L, 2);
+
+	lua_pushcfunction(L, ctx__traceback);
+	if (luaL_loadfile(L, init)) {
+		return lua_error(L);
+	}
+	return 2;
+}
+
+static pool_t *pool_check(lua_State *L, int i)
+{
+	pool_t *pool = *(pool_t **) luaL_checkudata(L, i, MOSQ_META_POOL);
+
+	luaL_argcheck(L, pool != NULL, i, "pool is gone");
+	return pool;
+}
+
+/***
+ * Create a pool of worker threads
+ * Every worker runs init in a Lua state of its own, on a thread of its own,
+ * with the worker's index and the number of workers as arguments. The
+ * module is loaded in there already; instances a worker creates are looped
+ * by it, so giving each its share of the connections uses that many cores.
+ * Workers and the creating state exchange messages with
+ * worker_send/worker_recv and the pool's send/recv; those are copied into
+ * lock-free queues, one per state, which are not bounded. A pool collected
+ * before join is stopped; workers still running are left to return on
+ * their own.
+ * @function pool
+ * @tparam table opts
+ * @tparam string opts.init path of the script the workers run
+ * @tparam[opt] number opts.threads workers, the number of online CPUs by default
+ * @return a pool
+ * @raise If init can't be loaded or a worker can't be set up
+ * @see worker_send
+ * @see worker_recv
+ */
+static int mosq_pool(lua_State *L)
+{
+	pool_t **pp;
+	pool_t *pool;
+	const char *init;
+	int n, i;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "init");
+	if (!lua_isstring(L, -1)) {
+		return luaL_argerror(L, 1, "init must be a string");
+	}
+	init = lua_tostring(L, -1);
+	lua_getfield(L, 1, "threads");
+	if (lua_isnil(L, -1)) {
+		n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	} else if (lua_isnumber(L, -1)) {
+		n = lua_tointeger(L, -1);
+	} else {
+		return luaL_argerror(L, 1, "threads must be a number");
+	}
+	luaL_argcheck(L, n > 0, 1, "threads must be positive");
+	lua_pop(L, 1);
+
+	/* whatever fails from here on, collecting the userdata cleans up */
+	pp = lua_newuserdata(L, sizeof(*pp));
+	*pp = NULL;
+	luaL_getmetatable(L, MOSQ_META_POOL);
+	lua_setmetatable(L, -2);
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		return luaL_error(L, "out of memory");
+	}
+	*pp = pool;
+	pool->refs = 1;
+	pool->queues = calloc(n + 1, sizeof(*pool->queues));
+	pool->workers = calloc(n, sizeof(*pool->workers));
+	if (pool->queues == NULL || pool->workers == NULL) {
+		free(pool->queues);
+		free(pool->workers);
+		pool->queues = NULL;
+		pool->workers = NULL;
+		return luaL_error(L, "out of memory");
+	}
+	pool->nworkers = n;
+	for (i = 0; i <= n; i++) {
+		pool->queues[i].fds[0] = pool->queues[i].fds[1] = -1;
+	}
+	for (i = 0; i < n; i++) {
+		pthread_mutex_init(&pool->workers[i].shared.lock, NULL);
+		pool->workers[i].shared.tail = &pool->workers[i].shared.head;
+	}
+	for (i = 0; i <= n; i++) {
+		if (!wq__init(&pool->queues[i])) {
+			return luaL_error(L, "pipe: %s", strerror(errno));
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		pool_worker_t *w = &pool->workers[i];
+
+		w->pool = pool;
+		w->index = i + 1;
+		w->L = luaL_newstate();
+		if (w->L == NULL) {
+			return luaL_error(L, "out of memory");
+		}
+		lua_pushcfunction(w->L, pool__open);
+		lua_pushstring(w->L, init);
+		if (lua_pcall(w->L, 1, 2, 0)) {
+			lua_pushstring(L, lua_tostring(w->L, -1));
+			return lua_error(L);
+		}
+		lua_pushinteger(w->L, w->index);
+		lua_pushinteger(w->L, n);
+	}
+
+	for (i = 0; i < n; i++) {
+		pool_worker_t *w = &pool->workers[i];
+		int rc;
+
+		__atomic_add_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL);
+		rc = pthread_create(&w->thread, NULL, pool__run, w);
+		if (rc != 0) {
+			__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL);
+			return luaL_error(L, "pthread_create: %s", strerror(rc));
+		}
+		w->started = true;
+	}
+
+	return 1;
+}
+
+/***
+ * Which worker is this?
+ * @function worker
+ * @treturn[1] number index of the worker running this state, from 1
+ * @treturn[1] number workers in its pool
+ * @return[2] nil outside of a pool
+ */
+static int mosq_worker(lua_State *L)
+{
+	if (pool__self == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, pool__self->index);
+	lua_pushinteger(L, pool__self->pool->nworkers);
+	return 2;
+}
+
+static pool_worker_t *worker_check(lua_State *L)
+{
+	if (pool__self == NULL) {
+		luaL_error(L, "not running in a worker");
+	}
+	return pool__self;
+}
+
+/***
+ * Send a message to another worker, from a worker
+ * @function worker_send
+ * @tparam number to worker index, 0 for the state that created the pool
+ * @tparam string topic
+ * @tparam[opt] string payload
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise Outside of a worker, or if there is no such worker
+ */
+static int mosq_worker_send(lua_State *L)
+{
+	pool_worker_t *w = worker_check(L);
+
+	return pool__send(L, w->pool, w->index, 1);
+}
+
+/***
+ * Receive a message sent to this worker
+ * @function worker_recv
+ * @tparam[opt=-1] number timeout ms to wait, -1 to wait indefinitely
+ * @treturn[1] string topic
+ * @treturn[1] string payload
+ * @treturn[1] number index of the sender, 0 for the state that created the pool
+ * @return[2] nil on timeout
+ * @return[3] false once the pool is stopping, the worker should return
+ * @raise Outside of a worker
+ */
+static int mosq_worker_recv(lua_State *L)
+{
+	pool_worker_t *w = worker_check(L);
+
+	return pool__recv(L, w->pool, w->index, 1);
+}
+
+/***
+ * Send a message to a worker
+ * @function pool:send
+ * @tparam number to worker index
+ * @tparam string topic
+ * @tparam[opt] string payload
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise If there is no such worker
+ */
+static int pool_send(lua_State *L)
+{
+	return pool__send(L, pool_check(L, 1), 0, 2);
+}
+
+/***
+ * Receive a message sent by a worker
+ * @function pool:recv
+ * @tparam[opt=-1] number timeout ms to wait, -1 to wait indefinitely
+ * @treturn[1] string topic
+ * @treturn[1] string payload
+ * @treturn[1] number index of the sending worker
+ * @return[2] nil on timeout
+ * @return[3] false once the pool is stopping
+ */
+static int pool_recv(lua_State *L)
+{
+	return pool__recv(L, pool_check(L, 1), 0, 2);
+}
+
+/***
+ * Ask the workers to return
+ * worker_recv returns false to them from now on; it's up to the scripts to
+ * look.
+ * @function pool:stop
+ * @return[1] boolean true
+ */
+static int pool_stop(lua_State *L)
+{
+	pool__stop(pool_check(L, 1));
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Wait for the workers to return
+ * Their states are closed, collecting the instances left in them.
+ * @function pool:join
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] string the error the first failing worker raised
+ */
+static int pool_join(lua_State *L)
+{
+	pool_t *pool = pool_check(L, 1);
+	const char *error;
+	int index;
+
+	error = pool__join(pool, &index);
+	if (error != NULL) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "worker %d: %s", index, error);
+		return 2;
+	}
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/* on the library thread of a share connection */
+static void share__on_connect(struct mosquitto *mosq, void *obj, int rc)
+{
+	pool_share_t *share = obj;
+
+	if (rc == 0) {
+		mosquitto_subscribe(mosq, NULL, share->sub, share->qos);
+	}
+}
+
+static void share__on_message(struct mosquitto *mosq, void *obj,
+	const struct mosquitto_message *msg)
+{
+	pool_share_t *share = obj;
+	pool_t *pool = share->pool;
+	/* ties go round, not to the first worker every time */
+	int start = __atomic_fetch_add(&share->turn, 1, __ATOMIC_RELAXED)
+		% pool->nworkers;
+	pool_worker_t *w = &pool->workers[start];
+	int least = share__load(&w->shared);
+	wq_node_t *n;
+	int i;
+
+	for (i = 1; i < pool->nworkers && least > 0; i++) {
+		pool_worker_t *c = &pool->workers[(start + i) % pool->nworkers];
+		int load = share__load(&c->shared);
+
+		if (load < least) {
+			w = c;
+			least = load;
+		}
+	}
+
+	n = wq__node(0, msg->topic, strlen(msg->topic), msg->payload,
+		msg->payloadlen);
+	if (n == NULL) {
+		return;
+	}
+	n->share = share;
+	share__put(&w->shared, n);
+	wq__notify(&pool->queues[w->index]);
+}
+
+static lua_Integer share__optint(lua_State *L, const char *name, lua_Integer def)
+{
+	lua_Integer v = def;
+
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, name);
+		if (!lua_isnil(L, -1)) {
+			if (!lua_isnumber(L, -1)) {
+				return luaL_error(L, "share %s must be a number", name);
+			}
+			v = lua_tointeger(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+	return v;
+}
+
+/***
+ * Spread a shared subscription over the workers
+ * Opens connections of the pool's own subscribing to $share/group/filter.
+ * Their library threads hand every message to the least loaded worker, the
+ * one with the fewest shared messages queued or being handled; a worker
+ * running out of messages takes them from the one with the most queued, so
+ * a slow handler holds up little more than the message it is on. Workers
+ * get the messages from worker_recv, with the group in place of the sender.
+ * Stopping the pool disconnects them.
+ * @function pool:share
+ * @tparam string group
+ * @tparam string filter
+ * @tparam[opt] table opts
+ * @tparam[opt="localhost"] string opts.host
+ * @tparam[opt=1883] number opts.port
+ * @tparam[opt=60] number opts.keepalive
+ * @tparam[opt=0] number opts.qos
+ * @tparam[opt=1] number opts.connections subscribing, the broker shares
+ * the messages between them
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For out of memory
+ * @see worker_recv
+ */
+static int pool_share(lua_State *L)
+{
+	pool_t *pool = pool_check(L, 1);
+	const char *group = luaL_checkstring(L, 2);
+	const char *filter = luaL_checkstring(L, 3);
+	const char *host = "localhost";
+	int port = share__optint(L, "port", 1883);
+	int keepalive = share__optint(L, "keepalive", 60);
+	int qos = share__optint(L, "qos", 0);
+	int nconns = share__optint(L, "connections", 1);
+	pool_share_t *share;
+	int i, rc;
+
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, "host");
+		if (!lua_isnil(L, -1)) {
+			host = luaL_checkstring(L, -1);
+		}
+	}
+	luaL_argcheck(L, nconns > 0, 4, "connections must be positive");
+	luaL_argcheck(L, qos >= 0 && qos <= 2, 4, "qos must be 0, 1 or 2");
+	luaL_argcheck(L, !__atomic_load_n(&pool->stopping, __ATOMIC_SEQ_CST), 1,
+		"pool is stopping");
+
+	share = calloc(1, sizeof(*share));
+	if (share == NULL) {
+		return luaL_error(L, "out of memory");
+	}
+	/* linked right away, so whatever fails is freed with the pool */
+	share->next = pool->shares;
+	__atomic_store_n(&pool->shares, share, __ATOMIC_RELEASE);
+	share->pool = pool;
+	share->qos = qos;
+	share->group = strdup(group);
+	share->sub = strdup(lua_pushfstring(L, "$share/%s/%s", group, filter));
+	share->conns = calloc(nconns, sizeof(*share->conns));
+	if (share->group == NULL || share->sub == NULL || share->conns == NULL) {
+		return luaL_error(L, "out of memory");
+	}
+
+	for (i = 0; i < nconns; i++) {
+		struct mosquitto *mosq = mosquitto_new(NULL, true, share);
+
+		if (mosq == NULL) {
+			return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+		}
+		share->conns[share->nconns++] = mosq;
+		mosquitto_connect_callback_set(mosq, share__on_connect);
+		mosquitto_message_callback_set(mosq, share__on_message);
+		rc = mosquitto_connect(mosq, host, port, keepalive);
+		if (rc == MOSQ_ERR_SUCCESS) {
+			rc = mosquitto_loop_start(mosq);
+		}
+		if (rc != MOSQ_ERR_SUCCESS) {
+			return mosq__pstatus(L, rc);
+		}
+	}
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/*
+ * stops the workers without waiting for them: the ones still running are
+ * detached and the last of them frees the pool
+ */
+static int pool_gc(lua_State *L)
+{
+	pool_t **pp = luaL_checkudata(L, 1, MOSQ_META_POOL);
+	pool_t *pool = *pp;
+	int i;
+
+	if (pool == NULL) {
+		return 0;
+	}
+	*pp = NULL;
+	if (pool->queues != NULL) {
+		pool__stop(pool);
+	}
+	for (i = 0; pool->workers != NULL && i < pool->nworkers; i++) {
+		pool_worker_t *w = &pool->workers[i];
+
+		if (w->started) {
+			pthread_detach(w->thread);
+			w->started = false;
+		}
+	}
+	pool__unref(pool);
+	return 0;
+}
+
+/* is the callback running inside an FFI call on this very thread? */
+static bool ctx__in_ffi(ctx_t *ctx)
+{
+	return ctx->ffi.depth > 0 && pthread_equal(ctx->ffi.thread, pthread_self());
+}
+
+/* keep a callback for the next loop, dropped when out of memory */
+static void ctx__ffi_defer(ctx_t *ctx, int slot, int arg, const char *str)
+{
+	ffi_t *ffi = &ctx->ffi;
+	ffi_event_t *ev;
+
+	if (ffi->len == ffi->cap) {
+		size_t cap = ffi->cap ? ffi->cap * 2 : 16;
+		ffi_event_t *events = realloc(ffi->events, cap * sizeof(*events));
+
+		if (events == NULL) {
+			return;
+		}
+		ffi->events = events;
+		ffi->cap = cap;
+	}
+	ev = &ffi->events[ffi->len];
+	ev->slot = slot;
+	ev->arg = arg;
+	ev->str = NULL;
+	if (str != NULL && (ev->str = strdup(str)) == NULL) {
+		return;
+	}
+	ffi->len++;
+}
+
+static void ctx__ffi_clear(ctx_t *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < ctx->ffi.len; i++) {
+		free(ctx->ffi.events[i].str);
+	}
+	free(ctx->ffi.events);
+	ctx->ffi.events = NULL;
+	ctx->ffi.len = 0;
+	ctx->ffi.cap = 0;
+}
+
+static void ctx_on_connect(struct mosquitto *, void *, int);
+static void ctx_on_publish(struct mosquitto *, void *, int);
+static void ctx_on_message(struct mosquitto *, void *, const struct mosquitto_message *);
+static void ctx__acks_flush(ctx_t *ctx);
+
+/* (re)install the C callbacks the native features depend on */
+static void ctx__native_callbacks(ctx_t *ctx)
+{
+	if (ctx->store != NULL) {
+		mosquitto_connect_callback_set(ctx->mosq, ctx_on_connect);
+		mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
+	}
+	if (ctx->rate.mode == RATE_QUEUE || ctx->latency != NULL
+			|| ctx->acks.mode != ACK_EACH) {
+		mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
+	}
+	if (ctx->queue != NULL || ctx->streams != NULL || ctx->cache != NULL
+			|| ctx->routes != NULL) {
+		mosquitto_message_callback_set(ctx->mosq, ctx_on_message);
+	}
+}
+
+/***
+ * Instance functions
+ * @section instance_functions
+ */
+
+/***
+ * Destroy context
+ * This is called automatically by garbage collection, you shouldn't normally
+ * have to call this. Called from a callback, the instance disconnects and is
+ * released once the loop returns.
+ * @function destroy
+ * @see mosquitto_destroy
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static void ctx__destroy(lua_State *L, ctx_t *ctx)
+{
+	mosquitto_destroy(ctx->mosq);
+	ctx->mosq = NULL;
+
+	if (ctx->store != NULL) {
+		ctx->store->ops->close(ctx->store);
+		ctx->store = NULL;
+	}
+	rate__clear(&ctx->rate);
+	free(ctx->latency);
+	ctx->latency = NULL;
+	if (ctx->queue != NULL) {
+		msgq__free(ctx->queue);
+		ctx->queue = NULL;
+	}
+	if (ctx->streams != NULL) {
+		streams__free(ctx->streams);
+		ctx->streams = NULL;
+	}
+#ifdef LUA_MOSQUITTO_ZSTD
+	if (ctx->compress != NULL) {
+		compress__free(ctx->compress);
+		ctx->compress = NULL;
+	}
+#endif
+	free(ctx->dedup);
+	ctx->dedup = NULL;
+	while (ctx->filters != NULL) {
+		filter_t *f = ctx->filters;
+		ctx->filters = f->next;
+		filter__free(f);
+	}
+	while (ctx->routes != NULL) {
+		route_t *r = ctx->routes;
+		ctx->routes = r->next;
+		route__free(r);
+	}
+	if (ctx->cache != NULL) {
+		lvc__free(ctx->cache);
+		ctx->cache = NULL;
+	}
+	free(ctx->acks.mids);
+	memset(&ctx->acks, 0, sizeof(ctx->acks));
+	ctx__ffi_clear(ctx);
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->pool);
+	ctx->pool = LUA_NOREF;
+	/* a handler still running on D releases it when it returns */
+	if (ctx->dispatching == 0) {
+		ctx__dispatch_free(L, ctx);
+	}
+}
+
+static int ctx_destroy(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	/* clean up Lua callback functions in the registry */
+	ctx__on_clear(L, ctx);
+	ctx__on_init(ctx);
+	ctx__handlers_sync(ctx);
+
+	if (ctx->depth > 0) {
+		/*
+		 * called from a callback, the library is still working on mosq:
+		 * stop the loop and leave the rest to ctx__leave
+		 */
+		ctx->destroy_pending = true;
+		ctx->reconnect.disconnecting = true;
+		mosquitto_disconnect(ctx->mosq);
+	} else {
+		ctx__destroy(L, ctx);
+	}
+
+	/* remove all methods operating on ctx */
+	lua_newtable(L);
+	lua_setmetatable(L, -2);
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/*
+ * Library calls that may run callbacks are bracketed by these, so that a
+ * destroy from inside is finished once the outermost call has returned.
+ */
+static void ctx__enter(ctx_t *ctx)
+{
+	ctx->depth++;
+}
+
+/*
+ * libmosquitto holds its callback mutex while a callback runs, a loop on the
+ * same instance from inside one would deadlock on it
+ */
+static void ctx__loop_enter(lua_State *L, ctx_t *ctx)
+{
+	if (ctx->depth > 0) {
+		luaL_error(L, "loop called from a callback of the same instance");
+	}
+	ctx__enter(ctx);
+}
+
+/*
+ * the loop_start thread reads the native state without a lock, settings
+ * allocating or freeing it can only change while that thread is stopped
+ */
+static void ctx__check_stopped(lua_State *L, ctx_t *ctx, const char *what)
+{
+	if (ctx->threaded) {
+		luaL_error(L, "%s cannot change while loop_start is running", what);
+	}
+}
+
+static void ctx__leave(lua_State *L, ctx_t *ctx)
+{
+	if (--ctx->depth == 0 && ctx->destroy_pending) {
+		ctx__destroy(L, ctx);
+	}
+}
+
+/***
+ * Reinitialise
+ * @function reinitialise
+ * @tparam[opt=nil] string client id, nil to allow the library to determine
+ * @tparam[opt=true] boolean clean session.
+ * @see mosquitto_reinitialise
+ * @see new
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+*/
+static int ctx_reinitialise(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *id = luaL_optstring(L, 1, NULL);
+	bool clean_session = (lua_isboolean(L, 2) ? lua_toboolean(L, 2) : true);
+
+	if (id == NULL && !clean_session) {
+		return luaL_argerror(L, 3, "if 'id' is nil then 'clean session' must be true");
+	}
+
+	int rc = mosquitto_reinitialise(ctx->mosq, id, clean_session, ctx);
+
+	/* clean up Lua callback functions in the registry */
+	ctx__on_clear(L, ctx);
+	ctx__on_init(ctx);
+	ctx__handlers_sync(ctx);
+	ctx__native_callbacks(ctx);
+
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Set a Will
+ * @function will_set
+ * @tparam string topic as per mosquitto_will_set
+ * @tparam string payload as per mosquitto_will_set (but a proper lua string)
+ * @tparam[opt=0] number qos 0, 1 or 2
+ * @tparam[opt=false] boolean retain
+ * @see mosquitto_will_set
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_will_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *topic = luaL_checkstring(L, 2);
+	size_t payloadlen = 0;
+	const void *payload = NULL;
+
+	if (!lua_isnil(L, 3)) {
+		payload = lua_tolstring(L, 3, &payloadlen);
+	};
+
+	int qos = luaL_optinteger(L, 4, 0);
+	bool retain = lua_toboolean(L, 5);
+
+	int rc = mosquitto_will_set(ctx->mosq, topic, payloadlen, payload, qos, retain);
+	return mosq__pstatus(L, rc);
+}
+
+/***
  * Clear a will
  * @function will_clear
  * @see mosquitto_will_clear
@@ -371,393 +3645,2040 @@ static int ctx_will_set(lua_State *L)
  * @return[2] nil
  * @treturn[2] number error code
  * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_will_clear(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	int rc = mosquitto_will_clear(ctx->mosq);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Set login details
+ * @function login_set
+ * @tparam[opt=nil] string username may be nil
+ * @tparam[opt=nil] string password may be nil
+ * @see mosquitto_username_pw_set
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_login_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *username = (lua_isnil(L, 2) ? NULL : luaL_checkstring(L, 2));
+	const char *password = (lua_isnil(L, 3) ? NULL : luaL_checkstring(L, 3));
+
+	int rc = mosquitto_username_pw_set(ctx->mosq, username, password);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Set TLS opts flag details
+ * @function tls_opts_set
+ * @tparam[opt=nil] int cert_reqs may be nil
+ * @tparam[opt=nil] string tls_version may be nil
+ * @tparam[opt=nil] string ciphers may be nil
+ * @see mosquitto_tls_opts_set
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_tls_opts_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int cert_reqs = luaL_optinteger(L, 2, 0);
+	const char *tls_version	 = luaL_optstring(L, 3, NULL);
+	const char *ciphers = luaL_optstring(L, 4, NULL);
+		
+	int rc = mosquitto_tls_opts_set(ctx->mosq, cert_reqs, tls_version, ciphers);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Set mosquitto protocol version (mqttv31 or mqttv311)
+ * @function version_set
+ * @tparam[opt=nil] string mqtt_version may be nil
+ * @see mosquitto_version_set
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_version_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *mqtt_version = luaL_optstring(L, 2, NULL);
+	int protocol_version=MQTT_PROTOCOL_V31;
+	if(!strcmp(mqtt_version, "mqttv31"))
+	{
+		protocol_version = MQTT_PROTOCOL_V31;
+	}else if(!strcmp(mqtt_version, "mqttv311")){
+		protocol_version = MQTT_PROTOCOL_V311;
+	}
+		
+	int rc = mosquitto_opts_set(ctx->mosq, MOSQ_OPT_PROTOCOL_VERSION, &protocol_version);
+	return mosq__pstatus(L, rc);
+}
+
+enum option_kind {
+	OPT_INT,		/* a MOSQ_OPT_* taking an int */
+	OPT_INFLIGHT	/* mosquitto_max_inflight_messages_set */
+};
+
+struct option {
+	const char *name;
+	int option;
+	enum option_kind kind;
+};
+
+static const struct option ctx_options[] = {
+	{"PROTOCOL_VERSION",		MOSQ_OPT_PROTOCOL_VERSION,		OPT_INT},
+	{"MAX_INFLIGHT_MESSAGES",	0,								OPT_INFLIGHT},
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1005000
+	{"SSL_CTX_WITH_DEFAULTS",	MOSQ_OPT_SSL_CTX_WITH_DEFAULTS,	OPT_INT},
+#endif
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+	{"RECEIVE_MAXIMUM",			MOSQ_OPT_RECEIVE_MAXIMUM,		OPT_INT},
+	{"SEND_MAXIMUM",			MOSQ_OPT_SEND_MAXIMUM,			OPT_INT},
+#endif
+#if LIBMOSQUITTO_VERSION_NUMBER >= 2000000
+	{"TCP_NODELAY",				MOSQ_OPT_TCP_NODELAY,			OPT_INT},
+#endif
+	{NULL,						0,								0}
+};
+
+/***
+ * Set a library option
+ * Names are those of the MOSQ_OPT_* constants without the prefix, in any
+ * case, plus MAX_INFLIGHT_MESSAGES. Options are only available when the
+ * libmosquitto the module was built against knows them:
+ * PROTOCOL_VERSION and MAX_INFLIGHT_MESSAGES always,
+ * SSL_CTX_WITH_DEFAULTS from 1.5, RECEIVE_MAXIMUM and SEND_MAXIMUM from 1.6
+ * and TCP_NODELAY from 2.0.
+ * @function option
+ * @tparam string name eg "TCP_NODELAY"
+ * @param value number or boolean, for PROTOCOL_VERSION also
+ * "mqttv31", "mqttv311" or "mqttv5"
+ * @see mosquitto_int_option
+ * @see mosquitto_opts_set
+ * @see mosquitto_max_inflight_messages_set
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For unknown options or values, and for some out of memory or illegal states
+ */
+static int ctx_option(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *name = luaL_checkstring(L, 2);
+	const struct option *opt = ctx_options;
+	int value;
+	int rc;
+
+	while (opt->name != NULL && strcasecmp(opt->name, name) != 0) {
+		opt++;
+	}
+	if (opt->name == NULL) {
+		return luaL_argerror(L, 2, "unknown option");
+	}
+
+	if (lua_isboolean(L, 3)) {
+		value = lua_toboolean(L, 3);
+	} else if (opt->option == MOSQ_OPT_PROTOCOL_VERSION && lua_type(L, 3) == LUA_TSTRING) {
+		const char *version = lua_tostring(L, 3);
+		if (!strcmp(version, "mqttv31")) {
+			value = MQTT_PROTOCOL_V31;
+		} else if (!strcmp(version, "mqttv311")) {
+			value = MQTT_PROTOCOL_V311;
+#ifdef MQTT_PROTOCOL_V5
+		} else if (!strcmp(version, "mqttv5")) {
+			value = MQTT_PROTOCOL_V5;
+#endif
+		} else {
+			return luaL_argerror(L, 3, "unknown protocol version");
+		}
+	} else {
+		value = luaL_checkinteger(L, 3);
+	}
+
+	switch (opt->kind) {
+		case OPT_INFLIGHT:
+			luaL_argcheck(L, value >= 0, 3, "must not be negative");
+			rc = mosquitto_max_inflight_messages_set(ctx->mosq, value);
+			break;
+
+		default:
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+			rc = mosquitto_int_option(ctx->mosq, opt->option, value);
+#else
+			rc = mosquitto_opts_set(ctx->mosq, opt->option, &value);
+#endif
+			break;
+	}
+
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Set TLS details
+ * This doesn't currently support callbacks for passphrase prompting!
+ * @function tls_set
+ * @tparam[opt=nil] string cafile may be nil
+ * @tparam[opt=nil] string capath may be nil
+ * @tparam[opt=nil] string certfile may be nil
+ * @tparam[opt=nil] string keyfile may be nil
+ * @see mosquitto_tls_set
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_tls_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *cafile = luaL_optstring(L, 2, NULL);
+	const char *capath = luaL_optstring(L, 3, NULL);
+	const char *certfile = luaL_optstring(L, 4, NULL);
+	const char *keyfile = luaL_optstring(L, 5, NULL);
+
+	// the last param is a callback to a function that asks for a passphrase for a keyfile
+	// our keyfiles should NOT have a passphrase
+	int rc = mosquitto_tls_set(ctx->mosq, cafile, capath, certfile, keyfile, 0);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Set TLS insecure flags
+ * @function tls_insecure_set
+ * @tparam boolean value true or false
+ * @see mosquitto_tls_insecure_set
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_tls_insecure_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	bool value = lua_toboolean(L, 2);
+
+	int rc = mosquitto_tls_insecure_set(ctx->mosq, value);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Set TLS PSK options
+ * @function tls_psk_set
+ * @tparam string psk
+ * @tparam string identity
+ * @tparam[opt] string ciphers
+ * @see mosquitto_tls_psk_set
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_tls_psk_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *psk = luaL_checkstring(L, 2);
+	const char *identity = luaL_checkstring(L, 3);
+	const char *ciphers = luaL_optstring(L, 4, NULL);
+
+	int rc = mosquitto_tls_psk_set(ctx->mosq, psk, identity, ciphers);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Set/clear threaded flag
+ * @function threaded_set
+ * @tparam boolean value true or false
+ * @see mosquitto_threaded_set
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_threaded_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	bool value = lua_toboolean(L, 2);
+
+	int rc = mosquitto_threaded_set(ctx->mosq, value);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * Connect to a broker
+ * @function connect
+ * @tparam[opt=localhost] string host
+ * @tparam[opt=1883] number port
+ * @tparam[opt=60] number keepalive in seconds
+ * @see mosquitto_connect
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_connect(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *host = luaL_optstring(L, 2, "localhost");
+	int port = luaL_optinteger(L, 3, 1883);
+	int keepalive = luaL_optinteger(L, 4, 60);
+
+	ctx->reconnect.disconnecting = false;
+	ctx__enter(ctx);
+	int rc =  mosquitto_connect(ctx->mosq, host, port, keepalive);
+	ctx__leave(L, ctx);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * connect (async)
+ * @function connect_async
+ * @tparam[opt=localhost] string host
+ * @tparam[opt=1883] number port
+ * @tparam[opt=60] number keepalive in seconds
+ * @see mosquitto_connect_async
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_connect_async(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *host = luaL_optstring(L, 2, "localhost");
+	int port = luaL_optinteger(L, 3, 1883);
+	int keepalive = luaL_optinteger(L, 4, 60);
+
+	ctx->reconnect.disconnecting = false;
+	int rc =  mosquitto_connect_async(ctx->mosq, host, port, keepalive);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * @function reconnect
+ * @see mosquitto_reconnect
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_reconnect(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	ctx->reconnect.disconnecting = false;
+	ctx__enter(ctx);
+	int rc = mosquitto_reconnect(ctx->mosq);
+	ctx__leave(L, ctx);
+	return mosq__pstatus(L, rc);
+}
+/***
+ * @function reconnect_delay_set
+ * @see mosquitto_reconnect_delay_set
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_reconnect_delay_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int reconnect_delay = luaL_optinteger(L, 2, 1);
+	int reconnect_delay_max = luaL_optinteger(L, 3, 30);
+	bool reconnect_exponential_backoff = (lua_isboolean(L, 4) ? lua_toboolean(L, 4) : true);
+
+	int rc = mosquitto_reconnect_delay_set(ctx->mosq, reconnect_delay, reconnect_delay_max, reconnect_exponential_backoff);
+	if (rc == MOSQ_ERR_SUCCESS) {
+		ctx->reconnect.delay = reconnect_delay;
+		ctx->reconnect.delay_max = reconnect_delay_max;
+		ctx->reconnect.backoff = reconnect_exponential_backoff;
+	}
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * @function reconnect_async
+ * @see mosquitto_reconnect_async
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_reconnect_async(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	ctx->reconnect.disconnecting = false;
+	int rc = mosquitto_reconnect_async(ctx->mosq);
+	return mosq__pstatus(L, rc);
+}
+
+/***
+ * @function disconnect
+ * @see mosquitto_disconnect
+ * @return[1] boolean true
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_disconnect(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	ctx->reconnect.disconnecting = true;
+	ctx__enter(ctx);
+	int rc = mosquitto_disconnect(ctx->mosq);
+	ctx__leave(L, ctx);
+	return mosq__pstatus(L, rc);
+}
+
+/* publish through the native stages, *mid is 0 if the rate limiter queued it */
+static int ctx__publish(ctx_t *ctx, int *mid, const char *topic,
+	int payloadlen, const void *payload, int qos, bool retain)
+{
+	rate_t *rate = &ctx->rate;
+	int rc;
+
+	*mid = 0;
+
+#ifdef LUA_MOSQUITTO_ZSTD
+	if (ctx->compress != NULL) {
+		payload = ctx__compress(ctx, payload, &payloadlen);
+	}
+#endif
+
+	if (rate->rate[0] > 0 || rate->rate[1] > 0 || rate->head != NULL) {
+		rate__refill(rate);
+		/* queued messages go first to keep the publish order, even once the
+		 * limiter is switched to reject or off */
+		if (rate->head != NULL || !rate__take(rate, payloadlen)) {
+			if ((rate->mode == RATE_REJECT && rate->head == NULL)
+					|| (rate->queue_max && rate->queued >= rate->queue_max)) {
+				ctx->stats.rate_rejected++;
+				return ERR_RATE_LIMIT;
+			}
+			rc = rate__enqueue(rate, topic, payloadlen, payload, qos, retain);
+			if (rc == MOSQ_ERR_SUCCESS) {
+				ctx->stats.rate_queued++;
+			}
+			return rc;
+		}
+	}
+
+	return ctx__publish_now(ctx, mid, topic, payloadlen, payload, qos, retain);
+}
+
+/***
+ * Publish a message
+ * @function publish
+ * @tparam string topic
+ * @tparam string payload (may be nil)
+ * @tparam[opt=0] number qos 0, 1 or 2
+ * @tparam[opt=nil] boolean retain flag
+ * @return 
+ * @see mosquitto_publish
+ * @treturn[1] number MID can be used for correlation with callbacks, or
+ * true if the rate limiter queued the message
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For some out of memory or illegal states
+ */
+static int ctx_publish(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int mid;	/* message id is referenced in the publish callback */
+	const char *topic = luaL_checkstring(L, 2);
+	size_t payloadlen = 0;
+	const void *payload = NULL;
+
+	if (!lua_isnil(L, 3)) {
+		payload = lua_tolstring(L, 3, &payloadlen);
+	};
+
+	int qos = luaL_optinteger(L, 4, 0);
+	bool retain = lua_toboolean(L, 5);
+
+	/* a QoS 0 message written out right away completes in here */
+	ctx__enter(ctx);
+	int rc = ctx__publish(ctx, &mid, topic, payloadlen, payload, qos, retain);
+	ctx__leave(L, ctx);
+
+	if (rc != MOSQ_ERR_SUCCESS || mid == 0) {
+		return mosq__pstatus(L, rc);
+	}
+
+	lua_pushinteger(L, mid);
+	return 1;
+}
+
+/***
+ * Publish the contents of a file
+ * The file is mapped into memory and handed to the library from there, so
+ * large payloads never become Lua strings. This is not zero-copy:
+ * libmosquitto copies the payload into its outgoing packet, and a message
+ * held back by a queueing rate limiter is copied once more until then.
+ * @function publish_file
+ * @tparam string topic
+ * @param file path of the file, or an open file descriptor number
+ * @tparam[opt=0] number offset first byte to publish
+ * @tparam[opt] number len bytes to publish, defaults to the rest of the file
+ * @tparam[opt=0] number qos 0, 1 or 2
+ * @tparam[opt=nil] boolean retain flag
+ * @treturn[1] number MID can be used for correlation with callbacks, or
+ * true if the rate limiter queued the message
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For bad ranges, and for some out of memory or illegal states
+ * @see publish
+ */
+static int ctx_publish_file(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *topic = luaL_checkstring(L, 2);
+	lua_Integer offset = luaL_optinteger(L, 4, 0);
+	lua_Integer len = luaL_optinteger(L, 5, -1);
+	int qos = luaL_optinteger(L, 6, 0);
+	bool retain = lua_toboolean(L, 7);
+	char *map = NULL;
+	size_t maplen = 0;
+	struct stat st;
+	int fd, rc, saved_errno;
+	int mid = 0;
+	bool own = false;
+
+	if (lua_type(L, 3) == LUA_TNUMBER) {
+		fd = lua_tointeger(L, 3);
+	} else {
+		fd = open(luaL_checkstring(L, 3), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+		}
+		own = true;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		rc = MOSQ_ERR_ERRNO;
+		goto out;
+	}
+
+	if (len < 0) {
+		len = st.st_size - offset;
+	}
+	if (offset < 0 || len < 0 || offset + len > st.st_size) {
+		if (own) {
+			close(fd);
+		}
+		return luaL_error(L, "range %f+%f outside of file",
+			(lua_Number) offset, (lua_Number) len);
+	}
+	if (len > 268435455) {
+		/* more than the MQTT remaining length can carry */
+		rc = MOSQ_ERR_PAYLOAD_SIZE;
+		goto out;
+	}
+
+	if (len > 0) {
+		off_t start = offset & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+
+		maplen = len + (offset - start);
+		map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, start);
+		if (map == MAP_FAILED) {
+			map = NULL;
+			rc = MOSQ_ERR_ERRNO;
+			goto out;
+		}
+		madvise(map, maplen, MADV_SEQUENTIAL);
+		ctx__enter(ctx);
+		rc = ctx__publish(ctx, &mid, topic, len, map + (offset - start), qos, retain);
+		ctx__leave(L, ctx);
+	} else {
+		ctx__enter(ctx);
+		rc = ctx__publish(ctx, &mid, topic, 0, NULL, qos, retain);
+		ctx__leave(L, ctx);
+	}
+
+out:
+	saved_errno = errno;
+	if (map != NULL) {
+		munmap(map, maplen);
+	}
+	if (own) {
+		close(fd);
+	}
+	errno = saved_errno;
+
+	if (rc != MOSQ_ERR_SUCCESS || mid == 0) {
+		return mosq__pstatus(L, rc);
+	}
+
+	lua_pushinteger(L, mid);
+	return 1;
+}
+
+/* fill in the header and publish one frame of a stream */
+static int ctx__stream_emit(lua_State *L, ctx_t *ctx, const char *topic,
+	unsigned char *frame, size_t fill, int flags, uint32_t id, uint32_t seq,
+	uint32_t total, int qos)
+{
+	int mid, rc;
+
+	memcpy(frame, STREAM_MAGIC, 3);
+	frame[3] = STREAM_VERSION << 4 | flags;
+	stream__put32(frame + 4, id);
+	stream__put32(frame + 8, seq);
+	stream__put32(frame + 12, total);
+	ctx__enter(ctx);
+	rc = ctx__publish(ctx, &mid, topic, STREAM_HDR + fill, frame, qos, false);
+	ctx__leave(L, ctx);
+	return rc;
+}
+
+/***
+ * Publish a large payload as a stream of frames
+ * The payload is cut into frames of at most chunk_size bytes, header
+ * included, each published on topic as a message of its own. A receiver
+ * with stream_reassembly enabled puts them back together and delivers the
+ * payload as one message, other receivers see the frames as they are.
+ * Frames go through the rate limiter and the store like any publish; they
+ * are never retained.
+ * @function publish_stream
+ * @tparam string topic
+ * @param source the payload as a string, or a function returning the next
+ * piece of it on each call and nil or "" at the end
+ * @tparam[opt=0] number qos 0, 1 or 2, with 0 a lost frame loses the stream
+ * @tparam[opt=65536] number chunk_size frame size in bytes
+ * @treturn[1] number stream id
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise For bad arguments, errors raised by source, and for some out of
+ * memory or illegal states
+ * @see stream_reassembly
  */
-static int ctx_will_clear(lua_State *L)
+static int ctx_publish_stream(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
+	const char *topic = luaL_checkstring(L, 2);
+	bool reader = lua_isfunction(L, 3);
+	int qos = luaL_optinteger(L, 4, 0);
+	lua_Integer chunk = luaL_optinteger(L, 5, 65536);
+	const char *piece = NULL;
+	size_t piecelen = 0;
+	size_t fill = 0;
+	uint64_t total = 0;
+	uint32_t id, seq = 0;
+	int rc;
 
-	int rc = mosquitto_will_clear(ctx->mosq);
-	return mosq__pstatus(L, rc);
+	luaL_argcheck(L, reader || lua_type(L, 3) == LUA_TSTRING, 3,
+		"string or function expected");
+	luaL_argcheck(L, chunk > STREAM_HDR && chunk <= 268435455, 5, "out of range");
+
+	size_t room = chunk - STREAM_HDR;
+	/* a userdata, so errors raised by source don't leak it */
+	lua_settop(L, 5);
+	unsigned char *frame = lua_newuserdata(L, chunk);
+
+	if (!reader) {
+		piece = lua_tolstring(L, 3, &piecelen);
+	}
+	/* 0 tells a receiver it is no frame */
+	if ((id = ++ctx->stream_id) == 0) {
+		id = ++ctx->stream_id;
+	}
+
+	for (;;) {
+		if (reader) {
+			lua_pushvalue(L, 3);
+			lua_call(L, 0, 1);
+			if (lua_isnil(L, -1)) {
+				break;
+			}
+			piece = lua_tolstring(L, -1, &piecelen);
+			if (piece == NULL) {
+				return luaL_error(L, "stream source returned %s",
+					luaL_typename(L, -1));
+			}
+			if (piecelen == 0) {
+				break;
+			}
+		}
+		total += piecelen;
+		if (total > UINT32_MAX) {
+			return luaL_error(L, "stream longer than 4GB");
+		}
+		while (piecelen > 0) {
+			/* a full frame only goes out once more data follows it */
+			if (fill == room) {
+				rc = ctx__stream_emit(L, ctx, topic, frame, fill, 0, id, seq++,
+					total - piecelen, qos);
+				if (rc != MOSQ_ERR_SUCCESS) {
+					return mosq__pstatus(L, rc);
+				}
+				fill = 0;
+			}
+			size_t n = piecelen < room - fill ? piecelen : room - fill;
+
+			memcpy(frame + STREAM_HDR + fill, piece, n);
+			fill += n;
+			piece += n;
+			piecelen -= n;
+		}
+		if (!reader) {
+			break;
+		}
+		lua_pop(L, 1);
+	}
+
+	rc = ctx__stream_emit(L, ctx, topic, frame, fill, STREAM_LAST, id, seq, total, qos);
+	if (rc != MOSQ_ERR_SUCCESS) {
+		return mosq__pstatus(L, rc);
+	}
+
+	lua_pushinteger(L, id);
+	return 1;
 }
 
 /***
- * Set login details
- * @function login_set
- * @tparam[opt=nil] string username may be nil
- * @tparam[opt=nil] string password may be nil
- * @see mosquitto_username_pw_set
+ * Coalesce publish completions
+ * With "each", the default, ON_PUBLISH is called with the mid of every
+ * message as it completes. With "batch" the mids completed during a loop
+ * pass are collected natively and ON_PUBLISH is called once at the end of
+ * the pass, with a list of them and their number. With "count" ON_PUBLISH
+ * isn't called at all, completions are only counted as published in stats.
+ * Batches are delivered by loop, loop_forever, loop_read, loop_write and
+ * loop_misc; while a loop_start thread runs, "batch" behaves like "each".
+ * @function publish_coalesce
+ * @tparam[opt="each"] string mode "each", "batch" or "count"
+ * @return boolean true
+ * @see stats
+ */
+static int ctx_publish_coalesce(lua_State *L)
+{
+	static const char *const modes[] = { "each", "batch", "count", NULL };
+	ctx_t *ctx = ctx_check(L, 1);
+	enum ack_mode mode = luaL_checkoption(L, 2, "each", modes);
+
+	/* switching away from batch hands over what is pending first */
+	if (mode != ACK_BATCH) {
+		ctx__enter(ctx);
+
+		ctx__acks_flush(ctx);
+		ctx__leave(L, ctx);
+		if (ctx->mosq == NULL) {
+			/* ON_PUBLISH destroyed it */
+			return 0;
+		}
+	}
+	ctx->acks.mode = mode;
+	ctx__native_callbacks(ctx);
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Limit the publish rate
+ * Token buckets for messages and payload bytes per second, refilled from a
+ * monotonic clock. A publish beyond the limit is rejected with
+ * ERR_RATE_LIMIT, or queued and sent later from loop, loop_forever,
+ * loop_misc and the publish acknowledgements.
+ * Call without rates to remove the limit; messages already queued still go
+ * out on the next loop pass, and publishes made until then queue up behind
+ * them whatever the mode, so the order holds.
+ * @function rate_limit
+ * @tparam[opt=0] number msgs messages per second, 0 for unlimited
+ * @tparam[opt=0] number bytes payload bytes per second, 0 for unlimited
+ * @tparam[opt="reject"] string mode "reject" or "queue"
+ * @tparam[opt=0] number queue_max most messages held back, 0 for unbounded
+ * @tparam[opt] number burst_msgs bucket size for messages, defaults to one second worth
+ * @tparam[opt] number burst_bytes bucket size for bytes, defaults to one second worth
+ * @return boolean true
+ * @see publish
+ */
+static int ctx_rate_limit(lua_State *L)
+{
+	static const char *const modes[] = { "reject", "queue", NULL };
+	ctx_t *ctx = ctx_check(L, 1);
+	rate_t *rate = &ctx->rate;
+	double rates[2], burst[2];
+	enum rate_mode mode;
+	lua_Integer queue_max;
+	int i;
+
+	/* all checked before any of it is taken, a bad call changes nothing */
+	rates[0] = luaL_optnumber(L, 2, 0);
+	rates[1] = luaL_optnumber(L, 3, 0);
+	mode = luaL_checkoption(L, 4, "reject", modes) == 0 ? RATE_REJECT : RATE_QUEUE;
+	queue_max = luaL_optinteger(L, 5, 0);
+	burst[0] = luaL_optnumber(L, 6, rates[0]);
+	burst[1] = luaL_optnumber(L, 7, rates[1]);
+
+	luaL_argcheck(L, queue_max >= 0, 5, "must not be negative");
+	for (i = 0; i < 2; i++) {
+		luaL_argcheck(L, rates[i] >= 0, 2 + i, "must not be negative");
+		luaL_argcheck(L, burst[i] >= 0, 6 + i, "must not be negative");
+	}
+
+	rate->mode = mode;
+	rate->queue_max = queue_max;
+	for (i = 0; i < 2; i++) {
+		rate->rate[i] = rates[i];
+		rate->burst[i] = burst[i] > 0 ? burst[i] : rates[i];
+		rate->tokens[i] = rate->burst[i];
+	}
+	rate->last = mosq__now();
+	ctx__native_callbacks(ctx);
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Time until the rate limiter admits a publish
+ * Lets a scheduler sleep instead of retrying rejected publishes.
+ * @function rate_delay
+ * @tparam[opt=0] number payloadlen size of the payload to be published
+ * @treturn number seconds to wait, 0 if a publish would go out now
+ */
+static int ctx_rate_delay(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int payloadlen = luaL_optinteger(L, 2, 0);
+
+	rate__refill(&ctx->rate);
+	lua_pushnumber(L, ctx->rate.head != NULL ? rate__delay(&ctx->rate,
+		ctx->rate.head->payloadlen) : rate__delay(&ctx->rate, payloadlen));
+	return 1;
+}
+
+/***
+ * Enable or disable native latency tracking
+ * Records the time from publish until the library reports the message
+ * complete (the PUBACK or PUBCOMP for QoS 1 and 2, the write for QoS 0), and
+ * the time spent in the ON_MESSAGE handler. Disabling drops what was recorded.
+ * Switching it on or off needs the loop_start thread stopped.
+ * @function latency_set
+ * @tparam boolean enable
  * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * @raise For out of memory, or while loop_start is running
+ * @see latency
  */
-static int ctx_login_set(lua_State *L)
+static int ctx_latency_set(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	const char *username = (lua_isnil(L, 2) ? NULL : luaL_checkstring(L, 2));
-	const char *password = (lua_isnil(L, 3) ? NULL : luaL_checkstring(L, 3));
+	bool enable = lua_toboolean(L, 2);
 
-	int rc = mosquitto_username_pw_set(ctx->mosq, username, password);
-	return mosq__pstatus(L, rc);
+	if (enable != (ctx->latency != NULL)) {
+		ctx__check_stopped(L, ctx, "latency tracking");
+	}
+
+	if (enable && ctx->latency == NULL) {
+		ctx->latency = calloc(1, sizeof(latency_t));
+		if (ctx->latency == NULL) {
+			return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+		}
+		ctx__native_callbacks(ctx);
+	} else if (!enable) {
+		free(ctx->latency);
+		ctx->latency = NULL;
+	}
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+static void hist__push(lua_State *L, const hist_t *h)
+{
+	static const struct {
+		const char *name;
+		double p;
+	} percentiles[] = {
+		{"p50", 50}, {"p90", 90}, {"p99", 99}, {"p999", 99.9}, {NULL, 0}
+	};
+	int i;
+
+	lua_createtable(L, 0, 8);
+	lua_pushnumber(L, h->count);
+	lua_setfield(L, -2, "count");
+	if (h->count == 0) {
+		return;
+	}
+
+	lua_pushnumber(L, h->min / 1e3);
+	lua_setfield(L, -2, "min");
+	lua_pushnumber(L, h->max / 1e3);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, (double) h->sum / h->count / 1e3);
+	lua_setfield(L, -2, "mean");
+	for (i = 0; percentiles[i].name != NULL; i++) {
+		lua_pushnumber(L, hist__percentile(h, percentiles[i].p) / 1e3);
+		lua_setfield(L, -2, percentiles[i].name);
+	}
 }
 
 /***
- * Set TLS opts flag details
- * @function tls_opts_set
- * @tparam[opt=nil] int cert_reqs may be nil
- * @tparam[opt=nil] string tls_version may be nil
- * @tparam[opt=nil] string ciphers may be nil
- * @see mosquitto_tls_opts_set
+ * Latency recorded since latency_set or the last reset
+ * All times are in microseconds.
+ * @function latency
+ * @tparam[opt=false] boolean reset start over after reading
+ * @treturn[1] table with "publish" and "dispatch" subtables, each holding
+ * count, min, max, mean, p50, p90, p99 and p999
+ * @treturn[2] nil if latency tracking is not enabled
+ * @see latency_set
+ */
+static int ctx_latency(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	latency_t *lat = ctx->latency;
+
+	if (lat == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_createtable(L, 0, 2);
+	hist__push(L, &lat->publish);
+	lua_setfield(L, -2, "publish");
+	hist__push(L, &lat->dispatch);
+	lua_setfield(L, -2, "dispatch");
+
+	if (lua_toboolean(L, 2)) {
+		memset(&lat->publish, 0, sizeof(lat->publish));
+		memset(&lat->dispatch, 0, sizeof(lat->dispatch));
+	}
+
+	return 1;
+}
+
+/***
+ * Queue incoming messages instead of calling ON_MESSAGE
+ * Messages are copied into a native FIFO to be collected in bulk, which
+ * also makes loop_start safe to use as the library thread never enters Lua
+ * for messages. Messages arriving at a full queue are dropped and counted;
+ * combine with flow_control to push back on the broker before that happens.
+ * Disabling the queue discards the messages still in it. Under loop_start
+ * only the bound of an existing queue may change.
+ * @function queue_set
+ * @param[opt=0] max number of messages held at most, 0 for unbounded, or false to disable the queue
  * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * @raise For out of memory, or when creating or disabling the queue while
+ * loop_start is running
+ * @see flow_control
  */
-static int ctx_tls_opts_set(lua_State *L)
+static int ctx_queue_set(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	int cert_reqs = luaL_optinteger(L, 2, 0);
-	const char *tls_version	 = luaL_optstring(L, 3, NULL);
-	const char *ciphers = luaL_optstring(L, 4, NULL);
-		
-	int rc = mosquitto_tls_opts_set(ctx->mosq, cert_reqs, tls_version, ciphers);
-	return mosq__pstatus(L, rc);
+	bool enable = !(lua_isboolean(L, 2) && !lua_toboolean(L, 2));
+	lua_Integer max = lua_isboolean(L, 2) ? 0 : luaL_optinteger(L, 2, 0);
+
+	luaL_argcheck(L, max >= 0, 2, "must not be negative");
+	if (!enable || ctx->queue == NULL) {
+		ctx__check_stopped(L, ctx, "queue");
+	}
+
+	if (!enable) {
+		if (ctx->queue != NULL) {
+			msgq__free(ctx->queue);
+			ctx->queue = NULL;
+			ctx->flow.pending = 0;
+			ctx->flow.throttled = false;
+		}
+	} else if (ctx->queue != NULL) {
+		pthread_mutex_lock(&ctx->queue->lock);
+		ctx->queue->max = max;
+		pthread_mutex_unlock(&ctx->queue->lock);
+	} else {
+		ctx->queue = msgq__new(max);
+		if (ctx->queue == NULL) {
+			return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+		}
+		ctx->flow.pending = 0;
+		ctx__native_callbacks(ctx);
+	}
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
 }
 
 /***
- * Set mosquitto protocol version (mqttv31 or mqttv311)
- * @function version_set
- * @tparam[opt=nil] string mqtt_version may be nil
- * @see mosquitto_version_set
+ * Drop duplicate QoS 1 messages
+ * QoS 1 messages with the same topic and payload as one received within the
+ * last window_ms are dropped before they reach ON_MESSAGE or the queue, and
+ * counted as dedup_hits in stats. Meant for the redeliveries following a
+ * reconnect; messages legitimately repeating within the window are dropped
+ * as well. Changing it needs the loop_start thread stopped.
+ * @function dedup
+ * @param[opt=10000] window_ms how long messages are remembered, or false to
+ * disable
+ * @tparam[opt=4096] number slots messages remembered at most, rounded up to
+ * a power of two
  * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * @raise For out of memory, or while loop_start is running
+ * @see stats
  */
-static int ctx_version_set(lua_State *L)
+static int ctx_dedup(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	const char *mqtt_version = luaL_optstring(L, 2, NULL);
-	int protocol_version=MQTT_PROTOCOL_V31;
-	if(!strcmp(mqtt_version, "mqttv31"))
-	{
-		protocol_version = MQTT_PROTOCOL_V31;
-	}else if(!strcmp(mqtt_version, "mqttv311")){
-		protocol_version = MQTT_PROTOCOL_V311;
+	bool enable = !(lua_isboolean(L, 2) && !lua_toboolean(L, 2));
+	lua_Integer window = lua_isboolean(L, 2) ? 0 : luaL_optinteger(L, 2, 10000);
+	lua_Integer slots = luaL_optinteger(L, 3, 4096);
+	size_t n = DEDUP_PROBE;
+	dedup_t *d = NULL;
+
+	luaL_argcheck(L, window > 0 || !enable, 2, "must be positive");
+	luaL_argcheck(L, slots > 0 && slots <= (1 << 24), 3, "out of range");
+	ctx__check_stopped(L, ctx, "dedup");
+
+	if (enable) {
+		while (n < (size_t) slots)
+			n *= 2;
+		d = calloc(1, sizeof(*d) + n * sizeof(d->slot[0]));
+		if (d == NULL) {
+			return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+		}
+		d->window = window * 1000000ULL;
+		d->mask = n - 1;
 	}
-		
-	int rc = mosquitto_opts_set(ctx->mosq, MOSQ_OPT_PROTOCOL_VERSION, &protocol_version);
-	return mosq__pstatus(L, rc);
+	free(ctx->dedup);
+	ctx->dedup = d;
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+static lua_Integer filter__optint(lua_State *L, const char *name, lua_Integer def)
+{
+	lua_Integer v = def;
+
+	lua_getfield(L, 3, name);
+	if (!lua_isnil(L, -1)) {
+		if (!lua_isnumber(L, -1)) {
+			return luaL_error(L, "filter %s must be a number", name);
+		}
+		v = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+	return v;
 }
 
 /***
- * Set TLS details
- * This doesn't currently support callbacks for passphrase prompting!
- * @function tls_set
- * @tparam[opt=nil] string cafile may be nil
- * @tparam[opt=nil] string capath may be nil
- * @tparam[opt=nil] string certfile may be nil
- * @tparam[opt=nil] string keyfile may be nil
- * @see mosquitto_tls_set
+ * Filter incoming messages natively
+ * Messages on topics matching pattern are checked against spec before they
+ * are delivered. Those failing are dropped without entering Lua and counted
+ * as filtered in stats. Filters are tried in the order they were added, the
+ * first one matching the topic decides; adding a filter for a pattern
+ * already filtered replaces it in place.
+ *
+ * spec may hold min_len and max_len bounding the payload length, prefix for
+ * bytes the payload has to start with, or have at offset, changed to drop
+ * payloads equal to the previous one on the same topic, and sample to
+ * deliver only one in every sample messages. Checks run in that order.
+ * Filters can only change while the loop_start thread is stopped.
+ * @function filter
+ * @tparam string pattern subscription pattern, wildcards allowed
+ * @tparam[opt] table spec the checks, or nil to remove the filter for pattern
  * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * @raise For bad patterns or specs, out of memory, or while loop_start is
+ * running
+ * @see stats
  */
-static int ctx_tls_set(lua_State *L)
+static int ctx_filter(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	const char *cafile = luaL_optstring(L, 2, NULL);
-	const char *capath = luaL_optstring(L, 3, NULL);
-	const char *certfile = luaL_optstring(L, 4, NULL);
-	const char *keyfile = luaL_optstring(L, 5, NULL);
+	const char *pattern = luaL_checkstring(L, 2);
+	filter_t **pp, *f = NULL;
 
-	// the last param is a callback to a function that asks for a passphrase for a keyfile
-	// our keyfiles should NOT have a passphrase
-	int rc = mosquitto_tls_set(ctx->mosq, cafile, capath, certfile, keyfile, 0);
-	return mosq__pstatus(L, rc);
+	if (mosquitto_sub_topic_check(pattern) != MOSQ_ERR_SUCCESS) {
+		return luaL_argerror(L, 2, "invalid subscription pattern");
+	}
+	ctx__check_stopped(L, ctx, "filters");
+
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		/* read before allocating, these may raise */
+		lua_Integer min_len = filter__optint(L, "min_len", 0);
+		lua_Integer max_len = filter__optint(L, "max_len", -1);
+		lua_Integer offset = filter__optint(L, "offset", 0);
+		lua_Integer sample = filter__optint(L, "sample", 0);
+
+		if (offset < 0 || sample < 0) {
+			return luaL_error(L, "filter offset and sample must not be negative");
+		}
+		f = calloc(1, sizeof(*f));
+		if (f == NULL) {
+			return luaL_error(L, "out of memory");
+		}
+		f->min_len = min_len;
+		f->max_len = max_len;
+		f->offset = offset;
+		f->sample = sample;
+		f->pattern = strdup(pattern);
+
+		lua_getfield(L, 3, "prefix");
+		if (lua_isstring(L, -1)) {
+			const char *prefix = lua_tolstring(L, -1, &f->prefixlen);
+
+			f->prefix = malloc(f->prefixlen + 1);
+			if (f->prefix != NULL) {
+				memcpy(f->prefix, prefix, f->prefixlen + 1);
+			}
+		}
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "changed");
+		bool changed = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		if (changed) {
+			f->changed = calloc(FILTER_CHANGED_SLOTS, sizeof(*f->changed));
+		}
+
+		if (f->pattern == NULL || (f->prefixlen > 0 && f->prefix == NULL)
+				|| (changed && f->changed == NULL)) {
+			filter__free(f);
+			return luaL_error(L, "out of memory");
+		}
+	}
+
+	for (pp = &ctx->filters; *pp != NULL; pp = &(*pp)->next) {
+		if (strcmp((*pp)->pattern, pattern) == 0) {
+			filter_t *old = *pp;
+
+			if (f != NULL) {
+				f->next = old->next;
+				*pp = f;
+			} else {
+				*pp = old->next;
+			}
+			filter__free(old);
+			return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+		}
+	}
+	if (f != NULL) {
+		*pp = f;
+	}
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/* the plugin's optional symbol_init or symbol_free */
+static void *route__sym(void *dl, const char *symbol, const char *suffix)
+{
+	char name[256];
+
+	if ((size_t) snprintf(name, sizeof(name), "%s%s", symbol, suffix)
+			>= sizeof(name)) {
+		return NULL;
+	}
+	return dlsym(dl, name);
 }
 
 /***
- * Set TLS insecure flags
- * @function tls_insecure_set
- * @tparam boolean value true or false
- * @see mosquitto_tls_insecure_set
+ * Route messages to a native handler
+ * Messages on topics matching pattern are passed to a C handler loaded
+ * from a plugin, before they reach ON_MESSAGE or the queue and without
+ * entering Lua; lua-mosquitto-plugin.h describes the interface. The handler
+ * decides whether a message goes on to the next route and Lua or is
+ * consumed, counted as routed in stats. Routes are tried in the order they
+ * were added; routing a pattern already routed replaces it in place. Routes
+ * can't change while loop_start is running.
+ * @function route_native
+ * @tparam string pattern subscription pattern
+ * @param so path of the plugin, or false to remove the route
+ * @tparam string symbol name of the handler in the plugin
+ * @tparam[opt] string config passed to the plugin's symbol_init
  * @return[1] boolean true
  * @return[2] nil
  * @treturn[2] number error code
  * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * @raise For an invalid pattern, out of memory, or while loop_start is running
  */
-static int ctx_tls_insecure_set(lua_State *L)
+static int ctx_route_native(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	bool value = lua_toboolean(L, 2);
+	const char *pattern = luaL_checkstring(L, 2);
+	route_t **pp, *r = NULL;
+
+	if (mosquitto_sub_topic_check(pattern) != MOSQ_ERR_SUCCESS) {
+		return luaL_argerror(L, 2, "invalid subscription pattern");
+	}
+	ctx__check_stopped(L, ctx, "routes");
+
+	if (!(lua_isboolean(L, 3) && !lua_toboolean(L, 3))) {
+		const char *so = luaL_checkstring(L, 3);
+		const char *symbol = luaL_checkstring(L, 4);
+		const char *config = luaL_optstring(L, 5, NULL);
+		lua_mosquitto_plugin_init init;
+
+		r = calloc(1, sizeof(*r));
+		if (r == NULL || (r->pattern = strdup(pattern)) == NULL) {
+			free(r);
+			return luaL_error(L, "out of memory");
+		}
+		r->dl = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+		if (r->dl != NULL) {
+			*(void **) &r->handler = dlsym(r->dl, symbol);
+		}
+		if (r->handler == NULL) {
+			lua_pushnil(L);
+			lua_pushinteger(L, MOSQ_ERR_NOT_FOUND);
+			lua_pushstring(L, dlerror());
+			route__free(r);
+			return 3;
+		}
+		*(void **) &init = route__sym(r->dl, symbol, "_init");
+		if (init != NULL
+				&& init(LUA_MOSQUITTO_PLUGIN_VERSION, config, &r->state) != 0) {
+			route__free(r);
+			lua_pushnil(L);
+			lua_pushinteger(L, MOSQ_ERR_INVAL);
+			lua_pushfstring(L, "%s_init failed", symbol);
+			return 3;
+		}
+		*(void **) &r->free = route__sym(r->dl, symbol, "_free");
+	}
+
+	for (pp = &ctx->routes; *pp != NULL; pp = &(*pp)->next) {
+		if (strcmp((*pp)->pattern, pattern) == 0) {
+			route_t *old = *pp;
+
+			if (r != NULL) {
+				r->next = old->next;
+				*pp = r;
+			} else {
+				*pp = old->next;
+			}
+			route__free(old);
+			return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+		}
+	}
+	if (r != NULL) {
+		*pp = r;
+		ctx__native_callbacks(ctx);
+	}
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Keep the last value of every topic natively
+ * Every message delivered, after filters, is written to a cache holding the
+ * latest message per topic, whether or not ON_MESSAGE is set. Read it with
+ * last and snapshot. Disabling the cache drops its contents. The cache can
+ * only be replaced or disabled while the loop_start thread is stopped.
+ * @function cache_set
+ * @param[opt=4194304] arena_bytes memory for topics and payloads, or false
+ * to disable
+ * @return[1] boolean true
+ * @raise For out of memory, or while loop_start is running
+ * @see last
+ * @see snapshot
+ */
+static int ctx_cache_set(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	bool enable = !(lua_isboolean(L, 2) && !lua_toboolean(L, 2));
+	lua_Integer size = lua_isboolean(L, 2) ? 0 : luaL_optinteger(L, 2, 4194304);
+	lvc_t *c = NULL;
+
+	luaL_argcheck(L, !enable || (size > 0 && (uint64_t) size <= SIZE_MAX / 2), 2,
+		"out of range");
+	ctx__check_stopped(L, ctx, "cache");
+
+	if (enable) {
+		c = lvc__new(size);
+		if (c == NULL) {
+			return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+		}
+	}
+	if (ctx->cache != NULL) {
+		lvc__free(ctx->cache);
+	}
+	ctx->cache = c;
+	if (c != NULL) {
+		ctx__native_callbacks(ctx);
+	}
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Last value seen on a topic
+ * @function last
+ * @tparam string topic exact topic, no wildcards
+ * @treturn[1] string payload
+ * @treturn[1] number qos
+ * @treturn[1] boolean retain
+ * @treturn[1] number seconds since the value arrived
+ * @return[2] nil if nothing arrived on topic yet
+ * @raise If the cache is not enabled, and for out of memory
+ * @see cache_set
+ */
+static int ctx_last(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	size_t topiclen;
+	const char *topic = luaL_checklstring(L, 2, &topiclen);
+	lvc_t *c = ctx->cache;
+	lvc_entry_t *copy = NULL;
+	bool found = false;
+	size_t slot;
+
+	if (c == NULL) {
+		return luaL_error(L, "no cache, enable it with cache_set");
+	}
+
+	pthread_mutex_lock(&c->lock);
+	slot = lvc__slot(c, topic, topiclen);
+	if (c->index[slot] != 0) {
+		lvc_entry_t *e = lvc__at(c, slot);
+		size_t n = sizeof(*e) + topiclen + 1 + e->len;
+
+		found = true;
+		copy = malloc(n);
+		if (copy != NULL)
+			memcpy(copy, e, n);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if (!found) {
+		lua_pushnil(L);
+		return 1;
+	}
+	if (copy == NULL) {
+		return luaL_error(L, "out of memory");
+	}
+
+	lua_pushlstring(L, copy->data + topiclen + 1, copy->len);
+	lua_pushinteger(L, copy->qos);
+	lua_pushboolean(L, copy->retain);
+	lua_pushnumber(L, (mosq__now() - copy->updated) / 1e9);
+	free(copy);
+	return 4;
+}
+
+/***
+ * Last values of all topics matching a pattern
+ * Only the entries matching pattern are copied out of the cache.
+ * @function snapshot
+ * @tparam[opt="#"] string pattern subscription pattern, wildcards allowed
+ * @treturn table payloads by topic
+ * @raise If the cache is not enabled, and for out of memory
+ * @see cache_set
+ */
+static int ctx_snapshot(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	const char *pattern = luaL_optstring(L, 2, "#");
+	lvc_t *c = ctx->cache;
+	char *copy = NULL;
+	size_t n = 0, i;
+	bool failed = false;
+
+	if (c == NULL) {
+		return luaL_error(L, "no cache, enable it with cache_set");
+	}
+
+	/* matching entries copied back to back, so no Lua runs under the lock */
+	pthread_mutex_lock(&c->lock);
+	copy = malloc(c->used);
+	for (i = 0; copy != NULL && i <= c->mask; i++) {
+		if (c->index[i] != 0) {
+			lvc_entry_t *e = lvc__at(c, i);
+			size_t len = lvc__entry_size(e->topiclen, e->len);
+			bool match = false;
+
+			if (mosquitto_topic_matches_sub(pattern, e->data, &match)
+					!= MOSQ_ERR_SUCCESS) {
+				failed = true;
+				break;
+			}
+			if (match) {
+				memcpy(copy + n, e, sizeof(*e) + e->topiclen + 1 + e->len);
+				n += len;
+			}
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if (c->used > 0 && copy == NULL) {
+		return luaL_error(L, "out of memory");
+	}
+	if (failed) {
+		free(copy);
+		return luaL_argerror(L, 2, "invalid subscription pattern");
+	}
+
+	lua_newtable(L);
+	for (i = 0; i < n; ) {
+		lvc_entry_t *e = (lvc_entry_t *) (copy + i);
 
-	int rc = mosquitto_tls_insecure_set(ctx->mosq, value);
-	return mosq__pstatus(L, rc);
+		lua_pushlstring(L, e->data + e->topiclen + 1, e->len);
+		lua_setfield(L, -2, e->data);
+		i += lvc__entry_size(e->topiclen, e->len);
+	}
+	free(copy);
+
+	return 1;
 }
 
 /***
- * Set TLS PSK options
- * @function tls_psk_set
- * @tparam string psk
- * @tparam string identity
- * @tparam[opt] string ciphers
- * @see mosquitto_tls_psk_set
+ * Compress payloads
+ * Published payloads of at least min_len bytes are compressed with zstd when
+ * that makes them smaller, and sent behind a small header marking them as
+ * compressed. Compressed payloads received are decompressed before anything
+ * else sees them, so handlers always get the original. The receiving context
+ * needs compression enabled as well, with the same dictionary if one is
+ * used; other receivers see the header and the zstd frame. Under loop_start
+ * compression can't be switched or reconfigured.
+ * Only available when built with ZSTD=yes.
+ * @function compression
+ * @param codec "zstd", or false to turn compression off
+ * @tparam[opt=3] number level compression level
+ * @tparam[opt] string dictionary as trained by zstd --train
+ * @tparam[opt=64] number min_len smallest payload worth compressing
  * @return[1] boolean true
  * @return[2] nil
- * @treturn[2] number error code
+ * @treturn[2] number error code, MOSQ_ERR_NOT_SUPPORTED without zstd support
  * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * @raise For bad arguments, or while loop_start is running
+ * @see stats
  */
-static int ctx_tls_psk_set(lua_State *L)
+static int ctx_compression(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	const char *psk = luaL_checkstring(L, 2);
-	const char *identity = luaL_checkstring(L, 3);
-	const char *ciphers = luaL_optstring(L, 4, NULL);
+	bool enable = !(lua_isboolean(L, 2) && !lua_toboolean(L, 2));
 
-	int rc = mosquitto_tls_psk_set(ctx->mosq, psk, identity, ciphers);
-	return mosq__pstatus(L, rc);
+	if (enable) {
+		luaL_argcheck(L, strcmp(luaL_checkstring(L, 2), "zstd") == 0, 2,
+			"unknown codec");
+	}
+
+#ifdef LUA_MOSQUITTO_ZSTD
+	int level = luaL_optinteger(L, 3, 3);
+	size_t dictlen = 0;
+	const char *dict = luaL_optlstring(L, 4, NULL, &dictlen);
+	lua_Integer min_len = luaL_optinteger(L, 5, 64);
+	compress_t *c;
+
+	if (enable || ctx->compress != NULL) {
+		ctx__check_stopped(L, ctx, "compression");
+	}
+	if (ctx->compress != NULL) {
+		compress__free(ctx->compress);
+		ctx->compress = NULL;
+	}
+	if (!enable) {
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+	}
+	c->level = level;
+	c->min_len = min_len > 0 ? min_len : 0;
+	c->cctx = ZSTD_createCCtx();
+	c->dctx = ZSTD_createDCtx();
+	if (dict != NULL) {
+		c->cdict = ZSTD_createCDict(dict, dictlen, level);
+		c->ddict = ZSTD_createDDict(dict, dictlen);
+	}
+	if (c->cctx == NULL || c->dctx == NULL
+			|| (dict != NULL && (c->cdict == NULL || c->ddict == NULL))) {
+		compress__free(c);
+		return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+	}
+	ctx->compress = c;
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+#else
+	(void) ctx;
+	if (enable) {
+		/* returned rather than raised as mosq__pstatus would, so callers
+		 * can carry on uncompressed */
+		lua_pushnil(L);
+		lua_pushinteger(L, MOSQ_ERR_NOT_SUPPORTED);
+		lua_pushstring(L, mosquitto_strerror(MOSQ_ERR_NOT_SUPPORTED));
+		return 3;
+	}
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+#endif
+}
+
+/* the patterns argument as a NULL terminated copy, raises for bad ones */
+static char **stream__patterns(lua_State *L, int arg)
+{
+	bool single = lua_type(L, arg) == LUA_TSTRING;
+	int n, i;
+	char **patterns;
+
+	luaL_argcheck(L, single || lua_istable(L, arg), arg,
+		"pattern or table of patterns expected");
+	n = single ? 1 : (int) lua_rawlen(L, arg);
+	luaL_argcheck(L, n > 0, arg, "no patterns");
+
+	/* checked before allocating, so a bad one doesn't leak the rest */
+	for (i = 1; i <= n; i++) {
+		if (!single) {
+			lua_rawgeti(L, arg, i);
+		}
+		const char *pattern = lua_tostring(L, single ? arg : -1);
+
+		if (pattern == NULL || mosquitto_sub_topic_check(pattern) != MOSQ_ERR_SUCCESS) {
+			luaL_argerror(L, arg, "invalid subscription pattern");
+		}
+		if (!single) {
+			lua_pop(L, 1);
+		}
+	}
+
+	patterns = calloc(n + 1, sizeof(*patterns));
+	for (i = 1; patterns != NULL && i <= n; i++) {
+		if (!single) {
+			lua_rawgeti(L, arg, i);
+		}
+		patterns[i - 1] = strdup(lua_tostring(L, single ? arg : -1));
+		if (!single) {
+			lua_pop(L, 1);
+		}
+		if (patterns[i - 1] == NULL) {
+			streams__free_patterns(patterns);
+			patterns = NULL;
+		}
+	}
+	return patterns;
 }
 
 /***
- * Set/clear threaded flag
- * @function threaded_set
- * @tparam boolean value true or false
- * @see mosquitto_threaded_set
+ * Reassemble streams sent with publish_stream
+ * Frames on topics matching patterns are collected natively and each
+ * payload is delivered once, when complete, as a single message with the
+ * topic and QoS of its frames, to ON_MESSAGE or the queue. Messages on other
+ * topics, and those without a valid frame header, are delivered as they are.
+ * Reassembly buffers share a budget of max_bytes; streams that don't fit are
+ * dropped, the ones quiet for longest first, and counted as stream_dropped
+ * in stats.
+ * Disabling reassembly discards incomplete streams. Under loop_start only
+ * max_bytes may change.
+ * @function stream_reassembly
+ * @param[opt=16777216] max_bytes budget for reassembly buffers, or false to
+ * pass frames on as they are
+ * @param[opt] patterns subscription pattern or table of them for the topics
+ * streams are published on, required when enabling, keeps the current ones
+ * when nil
  * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * @raise For bad patterns, out of memory, or when enabling, disabling or
+ * changing patterns while loop_start is running
+ * @see publish_stream
  */
-static int ctx_threaded_set(lua_State *L)
+static int ctx_stream_reassembly(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	bool value = lua_toboolean(L, 2);
+	bool enable = !(lua_isboolean(L, 2) && !lua_toboolean(L, 2));
+	lua_Integer max = lua_isboolean(L, 2) ? 0 : luaL_optinteger(L, 2, 16777216);
+	char **patterns = NULL;
+
+	luaL_argcheck(L, max > 0 || !enable, 2, "must be positive");
+	if (enable && (ctx->streams == NULL || !lua_isnoneornil(L, 3))) {
+		ctx__check_stopped(L, ctx, "stream reassembly");
+		patterns = stream__patterns(L, 3);
+		if (patterns == NULL) {
+			return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+		}
+	} else if (!enable && ctx->streams != NULL) {
+		ctx__check_stopped(L, ctx, "stream reassembly");
+	}
 
-	int rc = mosquitto_threaded_set(ctx->mosq, value);
-	return mosq__pstatus(L, rc);
+	if (!enable) {
+		if (ctx->streams != NULL) {
+			streams__free(ctx->streams);
+			ctx->streams = NULL;
+		}
+	} else if (ctx->streams != NULL) {
+		ctx->streams->max = max;
+		if (patterns != NULL) {
+			streams__free_patterns(ctx->streams->patterns);
+			ctx->streams->patterns = patterns;
+		}
+	} else {
+		ctx->streams = calloc(1, sizeof(*ctx->streams));
+		if (ctx->streams == NULL) {
+			streams__free_patterns(patterns);
+			return mosq__pstatus(L, MOSQ_ERR_NOMEM);
+		}
+		ctx->streams->max = max;
+		ctx->streams->patterns = patterns;
+		ctx__native_callbacks(ctx);
+	}
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
 }
 
-/***
- * Connect to a broker
- * @function connect
- * @tparam[opt=localhost] string host
- * @tparam[opt=1883] number port
- * @tparam[opt=60] number keepalive in seconds
- * @see mosquitto_connect
- * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+/*
+ * The C side of mosquitto/ffi.lua. LuaJIT passes a userdata to a void *
+ * parameter as a pointer to its payload, so ctx is the ctx_t itself.
+ * LuaJIT aborts on a callback into Lua from an FFI call, so the handlers
+ * for what the library reports meanwhile run from the next loop instead.
  */
-static int ctx_connect(lua_State *L)
+
+LUA_MOSQUITTO_API int lua_mosquitto_publish(ctx_t *ctx, int *mid,
+	const char *topic, int payloadlen, const void *payload, int qos, bool retain)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	const char *host = luaL_optstring(L, 2, "localhost");
-	int port = luaL_optinteger(L, 3, 1883);
-	int keepalive = luaL_optinteger(L, 4, 60);
+	int rc;
 
-	int rc =  mosquitto_connect(ctx->mosq, host, port, keepalive);
-	return mosq__pstatus(L, rc);
+	if (ctx->mosq == NULL)
+		return MOSQ_ERR_INVAL;
+
+	if (ctx->ffi.depth++ == 0) {
+		ctx->ffi.thread = pthread_self();
+	}
+	ctx->ffi.used = true;
+	rc = ctx__publish(ctx, mid, topic, payloadlen, payload, qos, retain);
+	ctx->ffi.depth--;
+	return rc;
+}
+
+LUA_MOSQUITTO_API int lua_mosquitto_queue_pop(ctx_t *ctx,
+	struct mosquitto_message **msgs, int max)
+{
+	return ctx__queue_pop(ctx, msgs, max);
+}
+
+LUA_MOSQUITTO_API void lua_mosquitto_message_free(struct mosquitto_message *msg)
+{
+	msgq__release(msg);
 }
 
+struct stat_field {
+	const char *name;
+	size_t offset;
+};
+
+static const struct stat_field stat_fields[] = {
+	{"rate_rejected",	offsetof(ctx_stats_t, rate_rejected)},
+	{"rate_queued",		offsetof(ctx_stats_t, rate_queued)},
+	{"read_throttled",	offsetof(ctx_stats_t, read_throttled)},
+	{"queue_dropped",	offsetof(ctx_stats_t, queue_dropped)},
+	{"stream_frames",	offsetof(ctx_stats_t, stream_frames)},
+	{"stream_completed", offsetof(ctx_stats_t, stream_completed)},
+	{"stream_dropped",	offsetof(ctx_stats_t, stream_dropped)},
+	{"compressed",		offsetof(ctx_stats_t, compressed)},
+	{"compress_in",		offsetof(ctx_stats_t, compress_in)},
+	{"compress_out",	offsetof(ctx_stats_t, compress_out)},
+	{"decompressed",	offsetof(ctx_stats_t, decompressed)},
+	{"dedup_hits",		offsetof(ctx_stats_t, dedup_hits)},
+	{"filtered",		offsetof(ctx_stats_t, filtered)},
+	{"routed",			offsetof(ctx_stats_t, routed)},
+	{"cache_full",		offsetof(ctx_stats_t, cache_full)},
+	{"published",		offsetof(ctx_stats_t, published)},
+	{"callback_errors",	offsetof(ctx_stats_t, callback_errors)},
+	{NULL,				0}
+};
+
 /***
- * connect (async)
- * @function connect_async
- * @tparam[opt=localhost] string host
- * @tparam[opt=1883] number port
- * @tparam[opt=60] number keepalive in seconds
- * @see mosquitto_connect_async
- * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * Counters kept natively by the context
+ * @function stats
+ * @treturn table counters by name, plus "rate_queue" holding the number of
+ * messages currently held back by the rate limiter and "pending" holding the
+ * number of messages not consumed yet, and "compress_ratio" once payloads
+ * have been compressed
  */
-static int ctx_connect_async(lua_State *L)
+static int ctx_stats(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	const char *host = luaL_optstring(L, 2, "localhost");
-	int port = luaL_optinteger(L, 3, 1883);
-	int keepalive = luaL_optinteger(L, 4, 60);
+	const struct stat_field *f;
 
-	int rc =  mosquitto_connect_async(ctx->mosq, host, port, keepalive);
-	return mosq__pstatus(L, rc);
+	lua_newtable(L);
+	for (f = stat_fields; f->name != NULL; f++) {
+		lua_pushnumber(L, *(unsigned long *) ((char *) &ctx->stats + f->offset));
+		lua_setfield(L, -2, f->name);
+	}
+	lua_pushinteger(L, ctx->rate.queued);
+	lua_setfield(L, -2, "rate_queue");
+	lua_pushinteger(L, ctx->flow.pending);
+	lua_setfield(L, -2, "pending");
+	if (ctx->stats.compress_out > 0) {
+		lua_pushnumber(L, (double) ctx->stats.compress_in / ctx->stats.compress_out);
+		lua_setfield(L, -2, "compress_ratio");
+	}
+
+	return 1;
 }
 
 /***
- * @function reconnect
- * @see mosquitto_reconnect
- * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * Error raised by the last failing callback
+ * Errors in callbacks don't reach the loop, they are counted as
+ * "callback_errors" in stats and the latest one is kept here.
+ * @function last_error
+ * @treturn[1] string error message, with a traceback on Lua 5.2 and later
+ * @treturn[2] nil no callback has failed
+ * @see stats
  */
-static int ctx_reconnect(lua_State *L)
+static int ctx_last_error(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
 
-	int rc = mosquitto_reconnect(ctx->mosq);
-	return mosq__pstatus(L, rc);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->last_error);
+	return 1;
 }
+
 /***
- * @function reconnect_delay_set
- * @see mosquitto_reconnect_delay_set
- * @return[1] boolean true
+ * Subscribe to a topic
+ * @function subscribe
+ * @tparam string topic eg "blah/+/json/#"
+ * @tparam[opt=0] number qos 0, 1 or 2
+ * @treturn[1] number MID can be used for correlation with callbacks
  * @return[2] nil
  * @treturn[2] number error code
  * @treturn[2] string error description.
  * @raise For some out of memory or illegal states
+ * @see mosquitto_subscribe
  */
-static int ctx_reconnect_delay_set(lua_State *L)
+static int ctx_subscribe(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	int reconnect_delay = luaL_optinteger(L, 2, 1);
-	int reconnect_delay_max = luaL_optinteger(L, 3, 30);
-	bool reconnect_exponential_backoff = (lua_isboolean(L, 4) ? lua_toboolean(L, 4) : true);
+	int mid;
+	const char *sub = luaL_checkstring(L, 2);
+	int qos = luaL_optinteger(L, 3, 0);
 
-	int rc = mosquitto_reconnect_delay_set(ctx->mosq, reconnect_delay, reconnect_delay_max, reconnect_exponential_backoff);
-	return mosq__pstatus(L, rc);
+	ctx__enter(ctx);
+	int rc = mosquitto_subscribe(ctx->mosq, &mid, sub, qos);
+	ctx__leave(L, ctx);
+
+	if (rc != MOSQ_ERR_SUCCESS) {
+		return mosq__pstatus(L, rc);
+	} else {
+		lua_pushinteger(L, mid);
+		return 1;
+	}
 }
 
 /***
- * @function reconnect_async
- * @see mosquitto_reconnect_async
+ * Unsubscribe from a topic
+ * @function unsubscribe
+ * @tparam string topic to unsubscribe from
+ * @see mosquitto_unsubscribe
  * @return[1] boolean true
  * @return[2] nil
  * @treturn[2] number error code
  * @treturn[2] string error description.
  * @raise For some out of memory or illegal states
  */
-static int ctx_reconnect_async(lua_State *L)
+static int ctx_unsubscribe(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
+	int mid;
+	const char *sub = luaL_checkstring(L, 2);
 
-	int rc = mosquitto_reconnect_async(ctx->mosq);
-	return mosq__pstatus(L, rc);
+	ctx__enter(ctx);
+	int rc = mosquitto_unsubscribe(ctx->mosq, &mid, sub);
+	ctx__leave(L, ctx);
+
+	if (rc != MOSQ_ERR_SUCCESS) {
+		return mosq__pstatus(L, rc);
+	} else {
+		lua_pushinteger(L, mid);
+		return 1;
+	}
 }
 
 /***
- * @function disconnect
- * @see mosquitto_disconnect
- * @return[1] boolean true
+ * Open a persistent store for QoS 1 and 2 messages
+ * Every QoS 1/2 publish is recorded until its acknowledgement arrives. Messages
+ * still unacknowledged when the store was last closed, including those left
+ * behind by a crashed process, are published again after the next successful
+ * connect. Open the store before connecting, and before loop_start.
+ * @function store_open
+ * @tparam string path of the store file, created if missing
+ * @tparam[opt=65536] number capacity initial size of the store file in bytes
+ * @tparam[opt="log"] string backend store implementation
+ * @treturn[1] number count of recovered messages that will be republished
  * @return[2] nil
  * @treturn[2] number error code
  * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * @raise For an unknown backend, a store that is already open, or while
+ * loop_start is running
  */
-static int ctx_disconnect(lua_State *L)
+static int ctx_store_open(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	size_t capacity = luaL_optinteger(L, 3, 0);
+	const char *backend = luaL_optstring(L, 4, "log");
+	const struct store_ops **ops = store_backends;
+	int recovered = 0;
+
+	if (ctx->store != NULL) {
+		return luaL_error(L, "store already open");
+	}
+	ctx__check_stopped(L, ctx, "store");
 
-	int rc = mosquitto_disconnect(ctx->mosq);
-	return mosq__pstatus(L, rc);
+	while (*ops != NULL && strcmp((*ops)->name, backend) != 0) {
+		ops++;
+	}
+	if (*ops == NULL) {
+		return luaL_argerror(L, 4, "unknown store backend");
+	}
+
+	ctx->store = (*ops)->open(path, capacity, &recovered);
+	if (ctx->store == NULL) {
+		return mosq__pstatus(L, MOSQ_ERR_ERRNO);
+	}
+
+	ctx__native_callbacks(ctx);
+
+	lua_pushinteger(L, recovered);
+	return 1;
 }
 
 /***
- * Publish a message
- * @function publish
- * @tparam string topic
- * @tparam string payload (may be nil)
- * @tparam[opt=0] number qos 0, 1 or 2
- * @tparam[opt=nil] boolean retain flag
- * @return 
- * @see mosquitto_publish
- * @treturn[1] number MID can be used for correlation with callbacks
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
+ * Close the persistent store
+ * Messages still in flight stay recorded and are recovered by the next
+ * store_open.
+ * @function store_close
+ * @return boolean true
+ * @raise While loop_start is running
  */
-static int ctx_publish(lua_State *L)
+static int ctx_store_close(lua_State *L)
 {
 	ctx_t *ctx = ctx_check(L, 1);
-	int mid;	/* message id is referenced in the publish callback */
-	const char *topic = luaL_checkstring(L, 2);
-	size_t payloadlen = 0;
-	const void *payload = NULL;
 
-	if (!lua_isnil(L, 3)) {
-		payload = lua_tolstring(L, 3, &payloadlen);
-	};
+	if (ctx->store != NULL) {
+		ctx__check_stopped(L, ctx, "store");
+		ctx->store->ops->close(ctx->store);
+		ctx->store = NULL;
+	}
 
-	int qos = luaL_optinteger(L, 4, 0);
-	bool retain = lua_toboolean(L, 5);
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
 
-	int rc = mosquitto_publish(ctx->mosq, &mid, topic, payloadlen, payload, qos, retain);
+/* hand the completions collected during a loop pass to ON_PUBLISH at once */
+static void ctx__acks_flush(ctx_t *ctx)
+{
+	acks_t *acks = &ctx->acks;
+	lua_State *D;
+	int n = acks->len;
+	int i;
 
-	if (rc != MOSQ_ERR_SUCCESS) {
-		return mosq__pstatus(L, rc);
-	} else {
-		lua_pushinteger(L, mid);
-		return 1;
+	if (n == 0) {
+		return;
+	}
+	if (ctx->on_publish == LUA_REFNIL) {
+		acks->len = 0;
+		return;
 	}
+
+	D = ctx__dispatch_begin(ctx, SLOT_PUBLISH, 3);
+	if (D == NULL) {
+		acks->len = 0;
+		return;
+	}
+	lua_createtable(D, n, 0);
+	for (i = 0; i < n; i++) {
+		lua_pushinteger(D, acks->mids[i]);
+		lua_rawseti(D, -2, i + 1);
+	}
+	lua_pushinteger(D, n);
+	/* emptied before the call, the handler may publish and loop again */
+	acks->len = 0;
+	ctx__dispatch(ctx, 2);
 }
 
-/***
- * Subscribe to a topic
- * @function subscribe
- * @tparam string topic eg "blah/+/json/#"
- * @tparam[opt=0] number qos 0, 1 or 2
- * @treturn[1] number MID can be used for correlation with callbacks
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
- * @see mosquitto_subscribe
- */
-static int ctx_subscribe(lua_State *L)
+/* run the handlers for the callbacks raised inside FFI calls */
+static void ctx__ffi_flush(ctx_t *ctx)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int mid;
-	const char *sub = luaL_checkstring(L, 2);
-	int qos = luaL_optinteger(L, 3, 0);
+	ffi_event_t *events = ctx->ffi.events;
+	size_t n = ctx->ffi.len;
+	size_t i;
+	lua_State *D;
+
+	if (n == 0) {
+		return;
+	}
+	/* taken over, the handlers may publish through the FFI again */
+	ctx->ffi.events = NULL;
+	ctx->ffi.len = 0;
+	ctx->ffi.cap = 0;
+
+	for (i = 0; i < n; i++) {
+		ffi_event_t *ev = &events[i];
+
+		if (ctx->mosq == NULL) {
+			/* destroyed by one of them, the others go with it */
+		} else if (ev->slot == SLOT_PUBLISH && ctx->on_publish != LUA_REFNIL) {
+			if ((D = ctx__dispatch_begin(ctx, SLOT_PUBLISH, 1)) != NULL) {
+				lua_pushinteger(D, ev->arg);
+				ctx__dispatch(ctx, 1);
+			}
+		} else if (ev->slot == SLOT_DISCONNECT && ctx->on_disconnect != LUA_REFNIL) {
+			if ((D = ctx__dispatch_begin(ctx, SLOT_DISCONNECT, 3)) != NULL) {
+				lua_pushboolean(D, ev->arg == 0);
+				lua_pushinteger(D, ev->arg);
+				lua_pushstring(D, ev->arg ? "unexpected disconnect" : "client-initiated disconnect");
+				ctx__dispatch(ctx, 3);
+			}
+		} else if (ev->slot == SLOT_LOG && ctx->on_log != LUA_REFNIL) {
+			if ((D = ctx__dispatch_begin(ctx, SLOT_LOG, 2)) != NULL) {
+				lua_pushinteger(D, ev->arg);
+				lua_pushstring(D, ev->str);
+				ctx__dispatch(ctx, 2);
+			}
+		}
+		free(ev->str);
+	}
+	free(events);
+}
+
+static bool ctx__read_blocked(ctx_t *ctx)
+{
+	return ctx->flow.paused || ctx->flow.throttled;
+}
+
+/* mosquitto_loop minus the reading, so the socket buffers fill up and TCP
+ * pushes back on the broker */
+static int ctx__loop_noread(ctx_t *ctx, int timeout, int max_packets)
+{
+	struct pollfd pfd;
+	int rc;
 
-	int rc = mosquitto_subscribe(ctx->mosq, &mid, sub, qos);
+	pfd.fd = mosquitto_socket(ctx->mosq);
+	if (pfd.fd < 0) {
+		return MOSQ_ERR_NO_CONN;
+	}
+	pfd.events = mosquitto_want_write(ctx->mosq) ? POLLOUT : 0;
+	pfd.revents = 0;
 
-	if (rc != MOSQ_ERR_SUCCESS) {
-		return mosq__pstatus(L, rc);
+	if (poll(&pfd, 1, timeout < 0 ? 1000 : timeout) < 0 && errno != EINTR) {
+		return MOSQ_ERR_ERRNO;
+	}
+
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		/* reading would dispatch what is still queued in the socket past
+		 * the pause: report the error, reconnecting deals with the rest */
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		if (!(pfd.revents & POLLNVAL)
+				&& getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0
+				&& err != 0) {
+			errno = err;
+			return MOSQ_ERR_ERRNO;
+		}
+		return MOSQ_ERR_CONN_LOST;
+	}
+
+	if (pfd.revents & POLLOUT) {
+		rc = mosquitto_loop_write(ctx->mosq, max_packets);
+		if (rc != MOSQ_ERR_SUCCESS) {
+			return rc;
+		}
+	}
+
+	return mosquitto_loop_misc(ctx->mosq);
+}
+
+/* one pass of the loop including the native per-pass work */
+static int ctx__loop_once(ctx_t *ctx, int timeout, int max_packets)
+{
+	int rc;
+
+	if (ctx__read_blocked(ctx)) {
+		rc = ctx__loop_noread(ctx, timeout, max_packets);
 	} else {
-		lua_pushinteger(L, mid);
-		return 1;
+		rc = mosquitto_loop(ctx->mosq, timeout, max_packets);
 	}
+	ctx__rate_drain(ctx);
+	ctx__ffi_flush(ctx);
+	ctx__acks_flush(ctx);
+	ctx__resume_parked(ctx, ctx->nparked);
+
+	return rc;
 }
 
-/***
- * Unsubscribe from a topic
- * @function unsubscribe
- * @tparam string topic to unsubscribe from
- * @see mosquitto_unsubscribe
- * @return[1] boolean true
- * @return[2] nil
- * @treturn[2] number error code
- * @treturn[2] string error description.
- * @raise For some out of memory or illegal states
- */
-static int ctx_unsubscribe(lua_State *L)
+/* does loop_forever have to come back to us after each pass? */
+static bool ctx__loop_hooked(ctx_t *ctx)
 {
-	ctx_t *ctx = ctx_check(L, 1);
-	int mid;
-	const char *sub = luaL_checkstring(L, 2);
+	return ctx->flow.used || ctx->rate.mode == RATE_QUEUE
+		|| ctx->acks.mode == ACK_BATCH || ctx->nparked > 0 || ctx->ffi.used;
+}
 
-	int rc = mosquitto_unsubscribe(ctx->mosq, &mid, sub);
+/* mosquitto_loop_forever, rebuilt on top of ctx__loop_once */
+static int ctx__loop_forever(ctx_t *ctx, int timeout, int max_packets)
+{
+	unsigned int reconnects = 0;
+	int rc;
 
-	if (rc != MOSQ_ERR_SUCCESS) {
-		return mosq__pstatus(L, rc);
-	} else {
-		lua_pushinteger(L, mid);
-		return 1;
+	for (;;) {
+		do {
+			rc = ctx__loop_once(ctx, timeout, max_packets);
+		} while (rc == MOSQ_ERR_SUCCESS);
+
+		/* same set of fatal errors mosquitto_loop_forever gives up on */
+		switch (rc) {
+			case MOSQ_ERR_NOMEM:
+			case MOSQ_ERR_PROTOCOL:
+			case MOSQ_ERR_INVAL:
+			case MOSQ_ERR_NOT_FOUND:
+			case MOSQ_ERR_TLS:
+			case MOSQ_ERR_PAYLOAD_SIZE:
+			case MOSQ_ERR_NOT_SUPPORTED:
+			case MOSQ_ERR_AUTH:
+			case MOSQ_ERR_ACL_DENIED:
+			case MOSQ_ERR_UNKNOWN:
+				return rc;
+		}
+		if (rc == MOSQ_ERR_ERRNO && errno == EPROTO) {
+			return rc;
+		}
+
+		do {
+			unsigned int delay;
+			struct timespec ts;
+
+			if (ctx->reconnect.disconnecting) {
+				return MOSQ_ERR_SUCCESS;
+			}
+
+			/* the backoff as mosquitto_loop_forever computes it */
+			delay = ctx->reconnect.delay;
+			if (ctx->reconnect.delay_max > ctx->reconnect.delay) {
+				delay *= ctx->reconnect.backoff
+					? (reconnects + 1) * (reconnects + 1) : reconnects + 1;
+			}
+			if (delay > ctx->reconnect.delay_max) {
+				delay = ctx->reconnect.delay_max;
+			} else {
+				reconnects++;
+			}
+
+			ts.tv_sec = delay;
+			ts.tv_nsec = 0;
+			nanosleep(&ts, NULL);
+
+			rc = mosquitto_reconnect(ctx->mosq);
+		} while (rc != MOSQ_ERR_SUCCESS);
+
+		reconnects = 0;
 	}
 }
 
@@ -767,13 +5688,20 @@ static int mosq_loop(lua_State *L, bool forever)
 	int timeout = luaL_optinteger(L, 2, -1);
 	int max_packets = luaL_optinteger(L, 3, 1);
 	int rc;
-	ctx->L = L;
-	if (forever) {
+	/* a new pass, the pooled records of the last one are up for reuse */
+	ctx->pool_records = 0;
+	ctx->pool_batches = 0;
+	ctx__loop_enter(L, ctx);
+	if (forever && ctx__loop_hooked(ctx)) {
+		rc = ctx__loop_forever(ctx, timeout, max_packets);
+	} else if (forever) {
+		ctx->forever = true;
 		rc = mosquitto_loop_forever(ctx->mosq, timeout, max_packets);
+		ctx->forever = false;
 	} else {
-		rc = mosquitto_loop(ctx->mosq, timeout, max_packets);
+		rc = ctx__loop_once(ctx, timeout, max_packets);
 	}
-	ctx->L = NULL;
+	ctx__leave(L, ctx);
 	return mosq__pstatus(L, rc);
 }
 
@@ -826,8 +5754,8 @@ static int ctx_loop_start(lua_State *L)
 	ctx_t *ctx = ctx_check(L, 1);
 	int rc;
 
-	ctx->L = L;
 	rc = mosquitto_loop_start(ctx->mosq);
+	ctx->threaded = (rc == MOSQ_ERR_SUCCESS);
 	return mosq__pstatus(L, rc);
 }
 
@@ -847,10 +5775,312 @@ static int ctx_loop_stop(lua_State *L)
 	bool force = lua_toboolean(L, 2);
 
 	int rc = mosquitto_loop_stop(ctx->mosq, force);
-	ctx->L = NULL;
+	ctx->threaded = false;
 	return mosq__pstatus(L, rc);
 }
 
+/***
+ * Stop reading from the broker
+ * loop, loop_forever and loop_read keep writing and doing housekeeping but
+ * leave incoming data in the socket, so TCP back-pressure reaches the broker.
+ * Pausing for longer than the keepalive interval loses the connection, as
+ * ping responses are not read either. A connection lost while paused comes
+ * back from the loop as an error and what was left in the socket is not
+ * dispatched.
+ * @function pause_read
+ * @return boolean true
+ * @see resume_read
+ */
+static int ctx_pause_read(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	ctx->flow.paused = true;
+	ctx->flow.used = true;
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Resume reading from the broker
+ * @function resume_read
+ * @return boolean true
+ * @see pause_read
+ */
+static int ctx_resume_read(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	ctx->flow.paused = false;
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Pause reading automatically on a backlog of unprocessed messages
+ * Every message delivered to ON_MESSAGE counts as pending until the
+ * application reports it done with consumed. Reading stops when the count
+ * reaches high and resumes once it has dropped to low.
+ * @function flow_control
+ * @tparam[opt=0] number high pending messages that stop reading, 0 to disable
+ * @tparam[opt] number low pending messages that resume reading, defaults to high / 2
+ * @return boolean true
+ * @see consumed
+ */
+static int ctx_flow_control(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer high = luaL_optinteger(L, 2, 0);
+	lua_Integer low = luaL_optinteger(L, 3, high / 2);
+
+	luaL_argcheck(L, high >= 0, 2, "must not be negative");
+	luaL_argcheck(L, low >= 0 && (high == 0 || low < high), 3, "must be below high");
+
+	ctx->flow.high = high;
+	ctx->flow.low = low;
+	ctx->flow.pending = 0;
+	ctx->flow.throttled = false;
+	if (high > 0) {
+		ctx->flow.used = true;
+	}
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Report messages as processed
+ * @function consumed
+ * @tparam[opt=1] number count of messages the application is done with
+ * @treturn number messages still pending
+ * @see flow_control
+ */
+static int ctx_consumed(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	lua_Integer count = luaL_optinteger(L, 2, 1);
+	flow_t *flow = &ctx->flow;
+
+	flow->pending = (lua_Integer) flow->pending > count ? flow->pending - count : 0;
+	if (flow->throttled && flow->pending <= flow->low) {
+		flow->throttled = false;
+	}
+
+	lua_pushinteger(L, flow->pending);
+	return 1;
+}
+
+/* wait up to timeout ms for the queue to fill, returns the loop status */
+static int ctx__recv_wait(lua_State *L, ctx_t *ctx, int timeout)
+{
+	msgq_t *q = ctx->queue;
+	uint64_t deadline = mosq__now() + (uint64_t) timeout * 1000000;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if (ctx->threaded) {
+		/* the library thread fills the queue, just sleep on it */
+		struct timespec ts;
+		ts.tv_sec = deadline / 1000000000;
+		ts.tv_nsec = deadline % 1000000000;
+		pthread_mutex_lock(&q->lock);
+		while (q->len == 0) {
+			if (pthread_cond_timedwait(&q->nonempty, &q->lock, &ts) != 0)
+				break;
+		}
+		pthread_mutex_unlock(&q->lock);
+		return rc;
+	}
+
+	/* otherwise run the loop until something arrives or time is up */
+	ctx__loop_enter(L, ctx);
+	while (q->len == 0 && !ctx->destroy_pending) {
+		uint64_t now = mosq__now();
+		if (now >= deadline)
+			break;
+		rc = ctx__loop_once(ctx, (deadline - now + 999999) / 1000000, 1);
+		if (rc != MOSQ_ERR_SUCCESS)
+			break;
+	}
+	ctx__leave(L, ctx);
+	return rc;
+}
+
+/* field names of message records, pushed once per batch */
+static const char *const message_fields[] = {
+	"mid", "topic", "payload", "qos", "retain", NULL
+};
+
+/* fill the record table at the top of the stack, keys starting at index k */
+static void ctx__fill_message(lua_State *L, int k, const struct mosquitto_message *msg)
+{
+	lua_pushvalue(L, k);
+	lua_pushinteger(L, msg->mid);
+	lua_rawset(L, -3);
+	lua_pushvalue(L, k + 1);
+	lua_pushstring(L, msg->topic);
+	lua_rawset(L, -3);
+	lua_pushvalue(L, k + 2);
+	lua_pushlstring(L, msg->payload, msg->payloadlen);
+	lua_rawset(L, -3);
+	lua_pushvalue(L, k + 3);
+	lua_pushinteger(L, msg->qos);
+	lua_rawset(L, -3);
+	lua_pushvalue(L, k + 4);
+	lua_pushboolean(L, msg->retain);
+	lua_rawset(L, -3);
+}
+
+/* push the next free table of pool list i (1 records, 2 batches), growing it if needed */
+static void ctx__pool_take(lua_State *L, int pool, int i, int *used)
+{
+	lua_rawgeti(L, pool, i);
+	lua_rawgeti(L, -1, ++(*used));
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_createtable(L, i == 1 ? 0 : 64, i == 1 ? 5 : 0);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, *used);
+	}
+	lua_remove(L, -2);
+}
+
+/***
+ * Collect queued messages
+ * Takes messages off the queue enabled with queue_set. If the queue is
+ * empty, waits up to timeout ms for messages to arrive: by running the loop,
+ * or, when a loop_start thread is running, by sleeping until it queued some.
+ * @function recv
+ * @tparam[opt=64] number max messages to return at most
+ * @tparam[opt=0] number timeout ms to wait for the first message
+ * @treturn[1] table array of messages, each a table with mid, topic,
+ * payload, qos and retain fields; empty on timeout. See recv_pool for
+ * reusing these tables.
+ * @return[2] nil
+ * @treturn[2] number error code
+ * @treturn[2] string error description.
+ * @raise If no queue is enabled, and for some out of memory or illegal states
+ * @see queue_set
+ */
+static int ctx_recv(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	int max = luaL_optinteger(L, 2, 64);
+	int timeout = luaL_optinteger(L, 3, 0);
+	struct mosquitto_message *msgs[64];
+	int i, n, count = 0;
+	int pool = 0;
+	int stale = 0;
+
+	if (ctx->queue == NULL) {
+		return luaL_error(L, "no message queue, enable it with queue_set");
+	}
+	luaL_argcheck(L, max > 0, 2, "must be positive");
+
+	if (timeout > 0 && ctx->queue->len == 0) {
+		int rc = ctx__recv_wait(L, ctx, timeout);
+		if (ctx->queue == NULL) {
+			/* destroyed by a callback while waiting */
+			return mosq__pstatus(L, rc);
+		}
+		if (rc != MOSQ_ERR_SUCCESS && ctx->queue->len == 0) {
+			return mosq__pstatus(L, rc);
+		}
+	}
+
+	/* stack: ctx, max, timeout, keys..., [pool], batch */
+	lua_settop(L, 3);
+	for (i = 0; message_fields[i] != NULL; i++) {
+		lua_pushstring(L, message_fields[i]);
+	}
+	if (ctx->pool != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->pool);
+		pool = lua_gettop(L);
+		ctx__pool_take(L, pool, 2, &ctx->pool_batches);
+		stale = (int) lua_rawlen(L, -1);
+	} else {
+		lua_createtable(L, max < 64 ? max : 64, 0);
+	}
+
+	do {
+		n = ctx__queue_pop(ctx, msgs, max - count < 64 ? max - count : 64);
+		for (i = 0; i < n; i++) {
+			if (pool) {
+				ctx__pool_take(L, pool, 1, &ctx->pool_records);
+			} else {
+				lua_createtable(L, 0, 5);
+			}
+			ctx__fill_message(L, 4, msgs[i]);
+			lua_rawseti(L, -2, ++count);
+			msgq__release(msgs[i]);
+		}
+	} while (n == 64 && count < max);
+
+	/* a recycled batch may still hold records from its last use */
+	while (stale > count) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, stale--);
+	}
+
+	return 1;
+}
+
+/***
+ * Reuse record tables across recv calls
+ * With a pool, recv fills preallocated tables in place instead of creating
+ * a table per message and per batch, so steady state ingestion allocates
+ * only the payload strings. Records and batches stay valid until the next
+ * loop or loop_forever call, or until release; after that they are
+ * overwritten by later recv calls. The pool grows to the largest number of
+ * records outstanding at once.
+ * @function recv_pool
+ * @param[opt=64] size number of records to preallocate, or false to drop the pool
+ * @return boolean true
+ * @see recv
+ * @see release
+ */
+static int ctx_recv_pool(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+	bool enable = !(lua_isboolean(L, 2) && !lua_toboolean(L, 2));
+	int size = lua_isboolean(L, 2) ? 64 : luaL_optinteger(L, 2, 64);
+	int i;
+
+	luaL_unref(L, LUA_REGISTRYINDEX, ctx->pool);
+	ctx->pool = LUA_NOREF;
+	ctx->pool_records = 0;
+	ctx->pool_batches = 0;
+
+	if (enable) {
+		luaL_argcheck(L, size >= 0, 2, "must not be negative");
+		lua_createtable(L, 2, 0);
+		lua_createtable(L, size, 0);
+		for (i = 1; i <= size; i++) {
+			lua_createtable(L, 0, 5);
+			lua_rawseti(L, -2, i);
+		}
+		lua_rawseti(L, -2, 1);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 2);
+		ctx->pool = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
+/***
+ * Hand pooled records back for reuse
+ * Releases every batch returned by recv since the last loop call or
+ * release, not just the one passed in. Only meaningful with recv_pool.
+ * @function release
+ * @tparam[opt] table batch as returned by recv
+ * @return boolean true
+ * @see recv_pool
+ */
+static int ctx_release(lua_State *L)
+{
+	ctx_t *ctx = ctx_check(L, 1);
+
+	ctx->pool_records = 0;
+	ctx->pool_batches = 0;
+	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+}
+
 /***
  * Get the underlying socket
  * @function socket
@@ -892,9 +6122,15 @@ static int ctx_loop_read(lua_State *L)
 	int max_packets = luaL_optinteger(L, 2, 1);
 	int rc;
 
-	ctx->L = L;
+	if (ctx__read_blocked(ctx)) {
+		return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
+	}
+
+	ctx__loop_enter(L, ctx);
 	rc = mosquitto_loop_read(ctx->mosq, max_packets);
-	ctx->L = NULL;
+	ctx__ffi_flush(ctx);
+	ctx__acks_flush(ctx);
+	ctx__leave(L, ctx);
 	return mosq__pstatus(L, rc);
 }
 
@@ -915,9 +6151,11 @@ static int ctx_loop_write(lua_State *L)
 	int max_packets = luaL_optinteger(L, 2, 1);
 	int rc;
 
-	ctx->L = L;
+	ctx__loop_enter(L, ctx);
 	rc = mosquitto_loop_write(ctx->mosq, max_packets);
-	ctx->L = NULL;
+	ctx__ffi_flush(ctx);
+	ctx__acks_flush(ctx);
+	ctx__leave(L, ctx);
 	return mosq__pstatus(L, rc);
 }
 
@@ -936,9 +6174,13 @@ static int ctx_loop_misc(lua_State *L)
 	ctx_t *ctx = ctx_check(L, 1);
 	int rc;
 
-	ctx->L = L;
+	ctx__loop_enter(L, ctx);
 	rc = mosquitto_loop_misc(ctx->mosq);
-	ctx->L = NULL;
+	ctx__rate_drain(ctx);
+	ctx__ffi_flush(ctx);
+	ctx__acks_flush(ctx);
+	ctx__resume_parked(ctx, ctx->nparked);
+	ctx__leave(L, ctx);
 	return mosq__pstatus(L, rc);
 }
 
@@ -956,9 +6198,8 @@ static int ctx_want_write(lua_State *L)
 	return 1;
 }
 
-static int ctx_on_connect_safe(lua_State *L) {
-	int ref = lua_tointeger(L, 1);
-	int rc = lua_tointeger(L, 2);
+static const char *connect_str(int rc, bool *successp)
+{
 	bool success = false;
 	char *str = "reserved for future use";
 
@@ -993,15 +6234,8 @@ static int ctx_on_connect_safe(lua_State *L) {
 			break;
 	}
 
-	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
-
-	lua_pushboolean(L, success);
-	lua_pushinteger(L, rc);
-	lua_pushstring(L, str);
-
-	lua_call(L, 3, 0);
-
-	return 0;
+	*successp = success;
+	return str;
 }
 
 static void ctx_on_connect(
@@ -1010,53 +6244,55 @@ static void ctx_on_connect(
 	int rc)
 {
 	ctx_t *ctx = obj;
-	lua_State *L = ctx->L;
-	lua_pushcfunction(L, ctx_on_connect_safe);
-	lua_pushinteger(L, ctx->on_connect);
-	lua_pushinteger(L, rc);
-	if (lua_pcall(L, 2, 0, 0)) {
-		/* pop error message */
-		lua_pop(L, 1);
+	lua_State *D;
+	const char *str;
+	bool success;
+
+	if (rc == CONN_ACCEPT && ctx->store != NULL) {
+		pthread_mutex_lock(&ctx->store->lock);
+		ctx->store->ops->resume(ctx->store, mosq);
+		pthread_mutex_unlock(&ctx->store->lock);
 	}
-}
 
-
-static int ctx_on_disconnect_safe(lua_State *L) {
-	int ref = lua_tointeger(L, 1);
-	int rc = lua_tointeger(L, 2);
-	bool success = true;
-	char *str = "client-initiated disconnect";
-
-	if (rc) {
-		success = false;
-		str = "unexpected disconnect";
+	if (ctx->on_connect == LUA_REFNIL) {
+		return;
 	}
 
-	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
-
-	lua_pushboolean(L, success);
-	lua_pushinteger(L, rc);
-	lua_pushstring(L, str);
-
-	lua_call(L, 3, 0);
-
-	return 0;
+	str = connect_str(rc, &success);
+	D = ctx__dispatch_begin(ctx, SLOT_CONNECT, 3);
+	if (D == NULL) {
+		return;
+	}
+	lua_pushboolean(D, success);
+	lua_pushinteger(D, rc);
+	lua_pushstring(D, str);
+	ctx__dispatch(ctx, 3);
 }
 
+
 static void ctx_on_disconnect(
 	struct mosquitto *mosq,
 	void *obj,
 	int rc)
 {
 	ctx_t *ctx = obj;
-	lua_State *L = ctx->L;
-	lua_pushcfunction(L, ctx_on_disconnect_safe);
-	lua_pushinteger(L, ctx->on_disconnect);
-	lua_pushinteger(L, rc);
-	if (lua_pcall(L, 2, 0, 0)) {
-		/* pop error message */
-		lua_pop(L, 1);
+	lua_State *D;
+
+	if (ctx->on_disconnect == LUA_REFNIL) {
+		return;
+	}
+	if (ctx__in_ffi(ctx)) {
+		ctx__ffi_defer(ctx, SLOT_DISCONNECT, rc, NULL);
+		return;
+	}
+	D = ctx__dispatch_begin(ctx, SLOT_DISCONNECT, 3);
+	if (D == NULL) {
+		return;
 	}
+	lua_pushboolean(D, rc == 0);
+	lua_pushinteger(D, rc);
+	lua_pushstring(D, rc ? "unexpected disconnect" : "client-initiated disconnect");
+	ctx__dispatch(ctx, 3);
 }
 
 static void ctx_on_publish(
@@ -1065,31 +6301,105 @@ static void ctx_on_publish(
 	int mid)
 {
 	ctx_t *ctx = obj;
-	lua_State *L = ctx->L;
-	lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->on_publish);
-	lua_pushinteger(L, mid);
-	if (lua_pcall(L, 1, 0, 0)) {
-		/* pop error message */
-		lua_pop(L, 1);
+	lua_State *D;
+
+	if (ctx->latency != NULL) {
+		latency__acked(ctx->latency, mid);
+	}
+	if (ctx->store != NULL) {
+		pthread_mutex_lock(&ctx->store->lock);
+		ctx->store->ops->ack(ctx->store, mid);
+		pthread_mutex_unlock(&ctx->store->lock);
+	}
+	ctx__rate_drain(ctx);
+
+	ctx->stats.published++;
+	if (ctx->acks.mode == ACK_COUNT) {
+		return;
+	}
+	if (ctx->acks.mode == ACK_BATCH && !ctx->threaded) {
+		acks_t *acks = &ctx->acks;
+
+		if (acks->len == acks->cap) {
+			size_t cap = acks->cap ? acks->cap * 2 : 64;
+			int *mids = realloc(acks->mids, cap * sizeof(*mids));
+
+			if (mids == NULL) {
+				return;
+			}
+			acks->mids = mids;
+			acks->cap = cap;
+		}
+		acks->mids[acks->len++] = mid;
+		return;
+	}
+
+	if (ctx->on_publish == LUA_REFNIL) {
+		return;
+	}
+	if (ctx__in_ffi(ctx)) {
+		ctx__ffi_defer(ctx, SLOT_PUBLISH, mid, NULL);
+		return;
+	}
+
+	D = ctx__dispatch_begin(ctx, SLOT_PUBLISH, 1);
+	if (D == NULL) {
+		return;
 	}
+	lua_pushinteger(D, mid);
+	ctx__dispatch(ctx, 1);
 }
 
-static int ctx_on_message_safe(lua_State *L) {
-	int ref = lua_tointeger(L, 1);
-	const struct mosquitto_message *msg = lua_touserdata(L, 2);
+/* hand a message over to the application, through the queue or ON_MESSAGE */
+static void ctx__deliver(ctx_t *ctx, const struct mosquitto_message *msg)
+{
+	lua_State *D;
 
-	/* push registered Lua callback function onto the stack */
-	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
-	/* push function args */
-	lua_pushinteger(L, msg->mid);
-	lua_pushstring(L, msg->topic);
-	lua_pushlstring(L, msg->payload, msg->payloadlen);
-	lua_pushinteger(L, msg->qos);
-	lua_pushboolean(L, msg->retain);
+	if (ctx->filters != NULL && ctx__filtered(ctx, msg)) {
+		ctx->stats.filtered++;
+		return;
+	}
 
-	lua_call(L, 5, 0); /* args: mid, topic, payload, qos, retain */
+	if (ctx->cache != NULL) {
+		ctx__cache_update(ctx, msg);
+	}
 
-	return 0;
+	if (ctx->routes != NULL && ctx__routed(ctx, msg)) {
+		ctx->stats.routed++;
+		return;
+	}
+
+	if (ctx->queue != NULL) {
+		ctx__queue_push(ctx, msg);
+		return;
+	}
+
+	if (ctx->on_message == LUA_REFNIL) {
+		return;
+	}
+
+	if (ctx->flow.high > 0 && ++ctx->flow.pending >= ctx->flow.high
+			&& !ctx->flow.throttled) {
+		ctx->flow.throttled = true;
+		ctx->stats.read_throttled++;
+	}
+
+	uint64_t start = ctx->latency != NULL ? mosq__now() : 0;
+
+	D = ctx__dispatch_begin(ctx, SLOT_MESSAGE, 5);
+	if (D == NULL) {
+		return;
+	}
+	lua_pushinteger(D, msg->mid);
+	lua_pushstring(D, msg->topic);
+	lua_pushlstring(D, msg->payload, msg->payloadlen);
+	lua_pushinteger(D, msg->qos);
+	lua_pushboolean(D, msg->retain);
+	ctx__dispatch(ctx, 5); /* args: mid, topic, payload, qos, retain */
+
+	if (ctx->latency != NULL) {
+		hist__add(&ctx->latency->dispatch, mosq__now() - start);
+	}
 }
 
 static void ctx_on_message(
@@ -1098,14 +6408,27 @@ static void ctx_on_message(
 	const struct mosquitto_message *msg)
 {
 	ctx_t *ctx = obj;
-	lua_State *L = ctx->L;
-	lua_pushcfunction(L, ctx_on_message_safe);
-	lua_pushinteger(L, ctx->on_message);
-	lua_pushlightuserdata(L, (void*)msg);
-	if (lua_pcall(L, 2, 0, 0)) {
-		/* pop error message */
-		lua_pop(L, 1);
+
+	if (ctx->dedup != NULL && msg->qos == 1 && dedup__seen(ctx->dedup, msg)) {
+		ctx->stats.dedup_hits++;
+		return;
+	}
+
+#ifdef LUA_MOSQUITTO_ZSTD
+	struct mosquitto_message plain;
+
+	/* first, so every later stage sees the original payload */
+	if (ctx->compress != NULL && ctx__decompress(ctx, msg, &plain)) {
+		msg = &plain;
+	}
+#endif
+
+	if (ctx->streams != NULL && stream__is_frame(ctx->streams, msg)) {
+		ctx__stream_frame(ctx, msg);
+		return;
 	}
+
+	ctx__deliver(ctx, msg);
 }
 
 static void ctx_on_subscribe(
@@ -1116,24 +6439,22 @@ static void ctx_on_subscribe(
 	const int *granted_qos)
 {
 	ctx_t *ctx = obj;
-	lua_State *L = ctx->L;
+	lua_State *D;
 	int i;
 
-	if (!lua_checkstack(L, qos_count + 2)) {
+	if (ctx->on_subscribe == LUA_REFNIL) {
+		return;
+	}
+	D = ctx__dispatch_begin(ctx, SLOT_SUBSCRIBE, qos_count + 1);
+	if (D == NULL) {
 		/* can't allocate enough stack space */
 		return;
 	}
-
-	lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->on_subscribe);
-	lua_pushinteger(L, mid);
+	lua_pushinteger(D, mid);
 	for (i = 0; i < qos_count; i++) {
-		lua_pushinteger(L, granted_qos[i]);
-	}
-
-	if (lua_pcall(L, qos_count + 1, 0, 0)) {
-		/* pop error message */
-		lua_pop(L, 1);
+		lua_pushinteger(D, granted_qos[i]);
 	}
+	ctx__dispatch(ctx, qos_count + 1);
 }
 
 static void ctx_on_unsubscribe(
@@ -1142,28 +6463,17 @@ static void ctx_on_unsubscribe(
 	int mid)
 {
 	ctx_t *ctx = obj;
-	lua_State *L = ctx->L;
-	lua_rawgeti(L, LUA_REGISTRYINDEX, ctx->on_unsubscribe);
-	lua_pushinteger(L, mid);
-	if (lua_pcall(L, 1, 0, 0)) {
-		/* pop error message */
-		lua_pop(L, 1);
-	}
-}
-
-static int ctx_on_log_safe(lua_State *L) {
-	int ref = lua_tointeger(L, 1);
-	int level = lua_tointeger(L, 2);
-	const char *str = lua_touserdata(L, 3);
-
-	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
-
-	lua_pushinteger(L, level);
-	lua_pushstring(L, str);
+	lua_State *D;
 
-	lua_call(L, 2, 0);
-
-	return 0;
+	if (ctx->on_unsubscribe == LUA_REFNIL) {
+		return;
+	}
+	D = ctx__dispatch_begin(ctx, SLOT_UNSUBSCRIBE, 1);
+	if (D == NULL) {
+		return;
+	}
+	lua_pushinteger(D, mid);
+	ctx__dispatch(ctx, 1);
 }
 
 static void ctx_on_log(
@@ -1173,15 +6483,22 @@ static void ctx_on_log(
 	const char *str)
 {
 	ctx_t *ctx = obj;
-	lua_State *L = ctx->L;
-	lua_pushcfunction(L, ctx_on_log_safe);
-	lua_pushinteger(L, ctx->on_log);
-	lua_pushinteger(L, level);
-	lua_pushlightuserdata(L, (void*)str);
-	if (lua_pcall(L, 3, 0, 0)) {
-		/* pop error message */
-		lua_pop(L, 1);
+	lua_State *D;
+
+	if (ctx->on_log == LUA_REFNIL) {
+		return;
+	}
+	if (ctx__in_ffi(ctx)) {
+		ctx__ffi_defer(ctx, SLOT_LOG, level, str);
+		return;
+	}
+	D = ctx__dispatch_begin(ctx, SLOT_LOG, 2);
+	if (D == NULL) {
+		return;
 	}
+	lua_pushinteger(D, level);
+	lua_pushstring(D, str);
+	ctx__dispatch(ctx, 2);
 }
 
 static int callback_type_from_string(const char *);
@@ -1201,53 +6518,63 @@ static int ctx_callback_set(lua_State *L)
 		return luaL_argerror(L, 3, "expecting a callback function");
 	}
 
+	if (ctx->D == NULL) {
+		ctx__dispatch_new(L, 1, ctx);
+	}
+
 	/* pop the function from the stack and store it in the registry */
+	lua_settop(L, 3);
 	int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	int *slot;
 
 	switch (callback_type) {
 		case CONNECT:
-			ctx->on_connect = ref;
+			slot = &ctx->on_connect;
 			mosquitto_connect_callback_set(ctx->mosq, ctx_on_connect);
 			break;
 
 		case DISCONNECT:
-			ctx->on_disconnect = ref;
+			slot = &ctx->on_disconnect;
 			mosquitto_disconnect_callback_set(ctx->mosq, ctx_on_disconnect);
 			break;
 
 		case PUBLISH:
-			ctx->on_publish = ref;
+			slot = &ctx->on_publish;
 			mosquitto_publish_callback_set(ctx->mosq, ctx_on_publish);
 			break;
 
 		case MESSAGE:
 			/* store the reference into the context, to be retrieved by ctx_on_message */
-			ctx->on_message = ref;
+			slot = &ctx->on_message;
 			/* register C callback in mosquitto */
 			mosquitto_message_callback_set(ctx->mosq, ctx_on_message);
 			break;
 
 		case SUBSCRIBE:
-			ctx->on_subscribe = ref;
+			slot = &ctx->on_subscribe;
 			mosquitto_subscribe_callback_set(ctx->mosq, ctx_on_subscribe);
 			break;
 
 		case UNSUBSCRIBE:
-			ctx->on_unsubscribe = ref;
+			slot = &ctx->on_unsubscribe;
 			mosquitto_unsubscribe_callback_set(ctx->mosq, ctx_on_unsubscribe);
 			break;
 
 		case LOG:
-			ctx->on_log = ref;
+			slot = &ctx->on_log;
 			mosquitto_log_callback_set(ctx->mosq, ctx_on_log);
 			break;
 
 		default:
 			luaL_unref(L, LUA_REGISTRYINDEX, ref);
-			luaL_argerror(L, 2, "not a proper callback type");
-			break;
+			return luaL_argerror(L, 2, "not a proper callback type");
 	}
 
+	/* a replaced handler is released */
+	luaL_unref(L, LUA_REGISTRYINDEX, *slot);
+	*slot = ref;
+	ctx__handlers_sync(ctx);
+
 	return mosq__pstatus(L, MOSQ_ERR_SUCCESS);
 }
 
@@ -1273,6 +6600,8 @@ static const struct define D[] = {
 	{"LOG_DEBUG",	MOSQ_LOG_DEBUG},
 	{"LOG_ALL",		MOSQ_LOG_ALL},
 
+	{"ERR_RATE_LIMIT",	ERR_RATE_LIMIT},
+
 	{NULL,			0}
 };
 
@@ -1306,6 +6635,22 @@ static const struct luaL_Reg R[] = {
 	{"__gc",	mosq_cleanup},
 	{"new",		mosq_new},
 	{"topic_matches_sub",mosq_topic_matches_sub},
+	{"clock",	mosq_clock},
+	{"poll",	mosq_poll},
+	{"pool",	mosq_pool},
+	{"worker",	mosq_worker},
+	{"worker_send",	mosq_worker_send},
+	{"worker_recv",	mosq_worker_recv},
+	{NULL,		NULL}
+};
+
+static const struct luaL_Reg pool_M[] = {
+	{"send",	pool_send},
+	{"recv",	pool_recv},
+	{"stop",	pool_stop},
+	{"join",	pool_join},
+	{"share",	pool_share},
+	{"__gc",	pool_gc},
 	{NULL,		NULL}
 };
 
@@ -1322,6 +6667,7 @@ static const struct luaL_Reg ctx_M[] = {
 	{"tls_psk_set",				ctx_tls_psk_set},
 	{"threaded_set",			ctx_threaded_set},
 	{"version_set",				ctx_version_set},
+	{"option",					ctx_option},
 	{"connect",					ctx_connect},
 	{"connect_async",			ctx_connect_async},
 	{"reconnect",				ctx_reconnect},
@@ -1329,8 +6675,31 @@ static const struct luaL_Reg ctx_M[] = {
 	{"reconnect_delay_set",		ctx_reconnect_delay_set},
 	{"disconnect",				ctx_disconnect},
 	{"publish",					ctx_publish},
+	{"publish_file",			ctx_publish_file},
+	{"publish_stream",			ctx_publish_stream},
+	{"publish_coalesce",		ctx_publish_coalesce},
 	{"subscribe",				ctx_subscribe},
 	{"unsubscribe",				ctx_unsubscribe},
+	{"store_open",				ctx_store_open},
+	{"store_close",				ctx_store_close},
+	{"rate_limit",				ctx_rate_limit},
+	{"rate_delay",				ctx_rate_delay},
+	{"stats",					ctx_stats},
+	{"last_error",				ctx_last_error},
+	{"latency_set",				ctx_latency_set},
+	{"latency",					ctx_latency},
+	{"queue_set",				ctx_queue_set},
+	{"stream_reassembly",		ctx_stream_reassembly},
+	{"compression",				ctx_compression},
+	{"dedup",					ctx_dedup},
+	{"filter",					ctx_filter},
+	{"route_native",			ctx_route_native},
+	{"cache_set",				ctx_cache_set},
+	{"last",					ctx_last},
+	{"snapshot",				ctx_snapshot},
+	{"recv",					ctx_recv},
+	{"recv_pool",				ctx_recv_pool},
+	{"release",					ctx_release},
 	{"loop",					ctx_loop},
 	{"loop_forever",			ctx_loop_forever},
 	{"loop_start",				ctx_loop_start},
@@ -1340,6 +6709,10 @@ static const struct luaL_Reg ctx_M[] = {
 	{"loop_write",				ctx_loop_write},
 	{"loop_misc",				ctx_loop_misc},
 	{"want_write",				ctx_want_write},
+	{"pause_read",				ctx_pause_read},
+	{"resume_read",				ctx_resume_read},
+	{"flow_control",			ctx_flow_control},
+	{"consumed",				ctx_consumed},
 	{"callback_set",			ctx_callback_set},
 	{"__newindex",				ctx_callback_set},
 
@@ -1359,7 +6732,7 @@ static const struct luaL_Reg ctx_M[] = {
 	{NULL,		NULL}
 };
 
-int luaopen_mosquitto(lua_State *L)
+LUA_MOSQUITTO_API int luaopen_mosquitto(lua_State *L)
 {
 	mosquitto_lib_init();
 	mosq_initialized = 1;
@@ -1376,6 +6749,12 @@ int luaopen_mosquitto(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	luaL_setfuncs(L, ctx_M, 0);
 
+	luaL_newmetatable(L, MOSQ_META_POOL);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	luaL_setfuncs(L, pool_M, 0);
+	lua_pop(L, 1);
+
 	luaL_newlib(L, R);
 
 	/* register callback defs into mosquitto table */
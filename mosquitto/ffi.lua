@@ -0,0 +1,106 @@
+--- LuaJIT FFI fast path for publishing and receiving.
+--
+-- Calls through the classic Lua C API abort JIT traces. This module reaches
+-- the same contexts through `ffi`, so publish and receive loops can stay
+-- compiled. Publishing goes through the same native stages as
+-- `ctx:publish` (store, rate limiter, latency tracking); receiving drains
+-- the queue enabled with `ctx:queue_set`. LuaJIT can't run Lua from inside
+-- an FFI call, so the ON_PUBLISH, ON_DISCONNECT and ON_LOG handlers for
+-- what the library reports during `publish` run from the next loop call.
+--
+--	local mosq = require "mosquitto"
+--	local mffi = require "mosquitto.ffi"
+--
+--	local client = mosq.new()
+--	client:queue_set(10000)
+--	client:connect()
+--	client:subscribe("sensors/#")
+--	while true do
+--		client:loop(10)
+--		local n, msgs = mffi.recv(client, 64)
+--		for i = 0, n - 1 do
+--			local msg = msgs[i]
+--			mffi.publish(client, "mirror", msg.payload, msg.payloadlen)
+--		end
+--	end
+--
+-- @module mosquitto.ffi
+
+local ffi = require "ffi"
+require "mosquitto"
+
+ffi.cdef[[
+struct mosquitto_message {
+	int mid;
+	char *topic;
+	void *payload;
+	int payloadlen;
+	int qos;
+	bool retain;
+};
+
+int lua_mosquitto_publish(void *ctx, int *mid, const char *topic,
+	int payloadlen, const void *payload, int qos, bool retain);
+int lua_mosquitto_queue_pop(void *ctx, struct mosquitto_message **msgs, int max);
+void lua_mosquitto_message_free(struct mosquitto_message *msg);
+]]
+
+-- the module is already loaded by require, this only resolves its symbols
+local C = ffi.load(assert(package.searchpath("mosquitto", package.cpath)))
+
+local M = {}
+
+local mid = ffi.new("int[1]")
+
+--- Publish a message
+-- @param ctx a mosquitto instance
+-- @tparam string topic
+-- @param payload string, or a pointer together with payloadlen
+-- @tparam[opt=#payload] number payloadlen
+-- @tparam[opt=0] number qos 0, 1 or 2
+-- @tparam[opt=false] boolean retain
+-- @treturn[1] number MID, or true if the rate limiter queued the message
+-- @return[2] nil
+-- @treturn[2] number error code
+function M.publish(ctx, topic, payload, payloadlen, qos, retain)
+	if payloadlen == nil then
+		payloadlen = payload and #payload or 0
+	end
+	local rc = C.lua_mosquitto_publish(ctx, mid, topic, payloadlen, payload,
+		qos or 0, retain or false)
+	if rc ~= 0 then
+		return nil, rc
+	end
+	return mid[0] ~= 0 and mid[0] or true
+end
+
+local batch, batch_size, batch_len = nil, 0, 0
+
+--- Take messages off the queue
+-- The returned messages are valid until the next call to recv or release.
+-- Use ffi.string on topic and payload to turn them into Lua strings.
+-- @param ctx a mosquitto instance with a queue enabled
+-- @tparam[opt=64] number max messages to take at most
+-- @treturn number count of messages taken
+-- @return cdata array of struct mosquitto_message pointers, indexed from 0
+function M.recv(ctx, max)
+	max = max or 64
+	M.release()
+	if max > batch_size then
+		batch = ffi.new("struct mosquitto_message *[?]", max)
+		batch_size = max
+	end
+	batch_len = C.lua_mosquitto_queue_pop(ctx, batch, max)
+	return batch_len, batch
+end
+
+--- Free the messages returned by the last recv
+-- Only needed to give the memory back early, recv does it as well.
+function M.release()
+	for i = 0, batch_len - 1 do
+		C.lua_mosquitto_message_free(batch[i])
+	end
+	batch_len = 0
+end
+
+return M
@@ -0,0 +1,115 @@
+#!/usr/bin/env lua
+
+--[[
+Call overhead benchmark: what loading the module costs a fresh interpreter,
+and what a call through the binding into libmosquitto costs, without a
+broker. Meant to compare builds, e.g. a dynamic and a static libmosquitto,
+see test/bench/compare.sh.
+
+usage: calls.lua [option=value ...]
+
+	lua=        interpreter for the load runs, default: the running one
+	runs=100    interpreters started for the load time
+	calls=1e6   iterations per call benchmark
+
+The result goes to stdout as a single JSON object: the module load time in
+milliseconds and each call in nanoseconds.
+]]
+
+local mosq = require "mosquitto"
+
+local opts = { lua = false, runs = 100, calls = 1e6 }
+
+for _, a in ipairs(arg) do
+	local k, v = a:match("^([%w_]+)=(.*)$")
+	if not k or opts[k] == nil then
+		io.stderr:write("bad option: ", a, "\n")
+		os.exit(2)
+	end
+	opts[k] = k == "lua" and v or tonumber(v)
+end
+
+local clock = mosq.clock
+
+if not opts.lua then
+	local i = -1
+	while arg[i - 1] do
+		i = i - 1
+	end
+	opts.lua = arg[i]
+end
+
+-- wall time of starting the interpreter on chunk, per run
+local function spawn(chunk)
+	local cmd = string.format("%s -e %q", opts.lua, chunk)
+	local start = clock()
+	for _ = 1, opts.runs do
+		if not os.execute(cmd) then
+			io.stderr:write("failed: ", cmd, "\n")
+			os.exit(1)
+		end
+	end
+	return (clock() - start) / opts.runs
+end
+
+local bare = spawn("")
+local loaded = spawn("require 'mosquitto'")
+
+-- nanoseconds per call of fn, the empty loop taken out
+local function per_call(n, fn, ...)
+	local start = clock()
+	for _ = 1, n do
+		fn(...)
+	end
+	local t = clock() - start
+	start = clock()
+	for _ = 1, n do
+	end
+	t = t - (clock() - start)
+	return t / n * 1e9
+end
+
+local function noop() end
+
+mosq.init()
+local ctx = mosq.new("calls", true)
+local payload = string.rep("c", 64)
+
+local result = {
+	{ "lua", opts.lua },
+	{ "load_ms", (loaded - bare) * 1e3 },
+	{ "calls_ns", {
+		{ "lua_function", per_call(opts.calls, noop) },
+		{ "version", per_call(opts.calls, mosq.version) },
+		{ "topic_matches_sub", per_call(opts.calls, mosq.topic_matches_sub,
+			"a/+/c/#", "a/b/c/d/e") },
+		-- not connected, so this is the binding and the library's checks
+		{ "publish", per_call(opts.calls, ctx.publish, ctx, "a/b", payload) },
+		{ "new_destroy", per_call(opts.calls / 100, function()
+			mosq.new(nil, true):destroy()
+		end) },
+	} },
+}
+
+ctx:destroy()
+
+-- ordered pairs, so the output is stable and diffable between runs
+local function json(fields)
+	local out = {}
+	for _, f in ipairs(fields) do
+		local k, v = f[1], f[2]
+		if type(v) == "table" then
+			v = json(v)
+		elseif type(v) == "string" then
+			v = string.format("%q", v)
+		elseif type(v) == "number" and v ~= math.floor(v) then
+			v = string.format("%.3f", v)
+		else
+			v = tostring(v)
+		end
+		out[#out + 1] = string.format("%q: %s", k, v)
+	end
+	return "{" .. table.concat(out, ", ") .. "}"
+end
+
+print(json(result))
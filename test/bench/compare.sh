@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Build the module with each profile and compare size, ring throughput
+# and call overhead.
+#
+# usage: test/bench/compare.sh [build ...]
+#
+#   build is one of size, perf, pgo or static (default: size perf pgo),
+#   each built the way 'make PROFILE=size', 'make PROFILE=perf', 'make pgo'
+#   and 'make PROFILE=perf STATIC=yes' do; static takes LIBMOSQUITTO_A from
+#   the environment like the makefile does.
+#   RING_ARGS are passed on to test/ring/ring.lua, MODES picks its modes,
+#   CALLS_ARGS are passed on to test/bench/calls.lua.
+#
+# Prints one JSON object per build and mode, and one with the call
+# overhead per build, on stdout. Run from the top of
+# the tree, the module and object file there are removed on the way.
+
+set -e
+
+MAKE=${MAKE:-make}
+LUA=${LUA:-lua}
+MODES=${MODES:-"manual threaded reactor"}
+RING_ARGS=${RING_ARGS:-"nodes=8 messages=64 ttl=1000 size=16 qos=1"}
+CALLS_ARGS=${CALLS_ARGS:-""}
+BUILDS=${*:-"size perf pgo"}
+
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+
+$MAKE -s broker
+
+for build in $BUILDS; do
+	rm -f mosquitto.so lua-mosquitto.o
+	case $build in
+		size|perf) $MAKE -s PROFILE=$build >&2 ;;
+		pgo) $MAKE -s pgo >&2 ;;
+		static) $MAKE -s PROFILE=perf STATIC=yes >&2 ;;
+		*) echo "unknown build: $build" >&2; exit 2 ;;
+	esac
+	mkdir -p "$out/$build"
+	mv mosquitto.so "$out/$build/"
+	bytes=$(wc -c < "$out/$build/mosquitto.so")
+	text=$(size "$out/$build/mosquitto.so" | awk 'NR == 2 { print $1 }')
+
+	for mode in $MODES; do
+		ring=$(LUA_CPATH="$out/$build/?.so;;" \
+			$LUA test/ring/ring.lua mode=$mode $RING_ARGS)
+		printf '{"build": "%s", "bytes": %s, "text": %s, "ring": %s}\n' \
+			"$build" "$bytes" "$text" "$ring"
+	done
+	calls=$(LUA_CPATH="$out/$build/?.so;;" \
+		$LUA test/bench/calls.lua lua=$LUA $CALLS_ARGS)
+	printf '{"build": "%s", "calls": %s}\n' "$build" "$calls"
+done
+
+rm -f lua-mosquitto.o
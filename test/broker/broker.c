@@ -0,0 +1,963 @@
+/*
+
+  broker.c - stub MQTT broker for tests and benchmarks
+
+  A single threaded, poll driven MQTT 3.1/3.1.1 broker, small enough to
+  start per test run. It routes QoS 0, 1 and 2 with + and # wildcards,
+  hands $share/group/filter messages round robin to the clients in the
+  group, keeps retained messages and wills, and can inject faults:
+  dropping deliveries, delaying them, and disconnecting clients. Sessions
+  are not kept and nothing is retransmitted, so every connection is
+  treated as a clean session.
+
+  usage: broker [-p port] [-u path] [-d drop%] [-D delay_ms]
+                [-x packets] [-s seed] [-v]
+
+    -p port      listen on 127.0.0.1:port, 0 picks a free port (default 1883)
+    -u path      listen on a Unix socket instead
+    -d drop%     drop that percentage of deliveries to subscribers
+    -D delay_ms  hold every delivery back for delay_ms
+    -x packets   disconnect each client after that many packets from it
+    -s seed      seed for the drop decisions
+    -v           log packets to stderr
+
+  Once listening, "listening <address>" is printed on stdout, with the
+  port actually bound.
+
+  Faults can be changed at runtime by publishing to $stub/fault a payload
+  like "drop=10 delay=5 disconnect=0"; publishing anything to
+  $stub/disconnect drops the publishing client on the spot. Neither is
+  routed to subscribers.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* mqtt3 packet types */
+#define CONNECT		0x10
+#define CONNACK		0x20
+#define PUBLISH		0x30
+#define PUBACK		0x40
+#define PUBREC		0x50
+#define PUBREL		0x60
+#define PUBCOMP		0x70
+#define SUBSCRIBE	0x80
+#define SUBACK		0x90
+#define UNSUBSCRIBE	0xA0
+#define UNSUBACK	0xB0
+#define PINGREQ		0xC0
+#define PINGRESP	0xD0
+#define DISCONNECT	0xE0
+
+/* a client not reading this much gets disconnected */
+#define WBUF_MAX	(64 * 1024 * 1024)
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t cap;
+} buf_t;
+
+typedef struct sub {
+	struct sub *next;
+	int qos;
+	char filter[];
+} sub_t;
+
+typedef struct {
+	int fd;
+	unsigned gen;			/* tells reused slots apart */
+	bool connected;
+	char *id;
+	buf_t rbuf;
+	buf_t wbuf;
+	sub_t *subs;
+	uint16_t last_mid;
+	unsigned long packets;
+	uint8_t qos2[65536 / 8];	/* inbound QoS 2 mids waiting for PUBREL */
+	/* will, published when the connection ends without DISCONNECT */
+	char *will_topic;
+	char *will_payload;
+	size_t will_len;
+	int will_qos;
+	bool will_retain;
+} client_t;
+
+typedef struct retained {
+	struct retained *next;
+	size_t len;
+	int qos;
+	char *payload;
+	char topic[];
+} retained_t;
+
+/* a delivery held back by the delay fault */
+typedef struct delayed {
+	struct delayed *next;
+	int client;
+	unsigned gen;
+	uint64_t due;
+	size_t len;
+	char data[];
+} delayed_t;
+
+static struct {
+	int drop;			/* percent */
+	int delay;			/* ms */
+	unsigned long disconnect;	/* packets, 0 for never */
+} fault;
+
+static client_t *clients;
+static int nclients;
+static unsigned generation;
+static retained_t *retained;
+static delayed_t *delayed_head, *delayed_tail;
+static unsigned share_next;
+static bool verbose;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *xmalloc(size_t n)
+{
+	void *p = malloc(n);
+
+	if (p == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	return p;
+}
+
+static bool buf_append(buf_t *b, const void *data, size_t len)
+{
+	if (b->len + len > b->cap) {
+		size_t cap = b->cap ? b->cap : 4096;
+		char *p;
+
+		while (cap < b->len + len)
+			cap *= 2;
+		p = realloc(b->buf, cap);
+		if (p == NULL)
+			return false;
+		b->buf = p;
+		b->cap = cap;
+	}
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+	return true;
+}
+
+static void buf_consume(buf_t *b, size_t len)
+{
+	memmove(b->buf, b->buf + len, b->len - len);
+	b->len -= len;
+}
+
+/* fixed header with the remaining length, returns its size */
+static size_t header(uint8_t *h, int type, size_t remaining)
+{
+	size_t n = 0;
+
+	h[n++] = type;
+	do {
+		uint8_t b = remaining % 128;
+
+		remaining /= 128;
+		h[n++] = remaining > 0 ? b | 0x80 : b;
+	} while (remaining > 0);
+	return n;
+}
+
+/*
+ * Topic matching, as of the MQTT spec: + matches one level, # the rest
+ * including the parent level, and wildcards don't match topics starting
+ * with $.
+ */
+static bool topic_matches(const char *filter, const char *topic)
+{
+	if ((*filter == '+' || *filter == '#') && *topic == '$')
+		return false;
+
+	while (*filter != '\0') {
+		if (*filter == '#')
+			return true;
+		if (*filter == '+') {
+			while (*topic != '\0' && *topic != '/')
+				topic++;
+			filter++;
+		} else {
+			while (*filter != '\0' && *filter != '/' && *filter == *topic) {
+				filter++;
+				topic++;
+			}
+			if ((*filter == '\0' || *filter == '/') && (*topic == '\0' || *topic == '/')) {
+				/* level matched */
+			} else {
+				return false;
+			}
+		}
+		if (*filter == '\0')
+			return *topic == '\0';
+		/* both at a '/' now, or the topic ended */
+		if (*topic == '\0')
+			return strcmp(filter, "/#") == 0;
+		filter++;
+		topic++;
+	}
+	return *topic == '\0';
+}
+
+static void client_close(int i, bool clean);
+
+static void queue_bytes(int i, const void *data, size_t len)
+{
+	client_t *c = &clients[i];
+
+	if (c->fd < 0)
+		return;
+	if (c->wbuf.len + len > WBUF_MAX || !buf_append(&c->wbuf, data, len)) {
+		if (verbose)
+			fprintf(stderr, "client %s: not reading, dropped\n", c->id ? c->id : "?");
+		client_close(i, false);
+	}
+}
+
+static void send_ack(int i, int type, uint16_t mid)
+{
+	uint8_t p[4] = { type, 2, mid >> 8, mid & 0xff };
+
+	queue_bytes(i, p, sizeof(p));
+}
+
+/* PUBLISH to client i, through the drop and delay faults */
+static void deliver(int i, const char *topic, const char *payload, size_t len,
+	int qos, bool retain)
+{
+	client_t *c = &clients[i];
+	size_t topiclen = strlen(topic);
+	size_t remaining = 2 + topiclen + (qos > 0 ? 2 : 0) + len;
+	uint8_t h[5];
+	size_t hlen = header(h, PUBLISH | qos << 1 | (retain ? 1 : 0), remaining);
+	size_t total = hlen + remaining;
+	char *p, *packet;
+
+	if (fault.drop > 0 && rand() % 100 < fault.drop)
+		return;
+
+	packet = p = xmalloc(total);
+	memcpy(p, h, hlen);
+	p += hlen;
+	*p++ = topiclen >> 8;
+	*p++ = topiclen & 0xff;
+	memcpy(p, topic, topiclen);
+	p += topiclen;
+	if (qos > 0) {
+		if (++c->last_mid == 0)
+			c->last_mid = 1;
+		*p++ = c->last_mid >> 8;
+		*p++ = c->last_mid & 0xff;
+	}
+	memcpy(p, payload, len);
+
+	if (fault.delay > 0) {
+		delayed_t *d = xmalloc(sizeof(*d) + total);
+
+		d->next = NULL;
+		d->client = i;
+		d->gen = c->gen;
+		d->due = now_ms() + fault.delay;
+		d->len = total;
+		memcpy(d->data, packet, total);
+		if (delayed_tail != NULL)
+			delayed_tail->next = d;
+		else
+			delayed_head = d;
+		delayed_tail = d;
+	} else {
+		queue_bytes(i, packet, total);
+	}
+	free(packet);
+}
+
+static void retain_store(const char *topic, const char *payload, size_t len, int qos)
+{
+	retained_t **pp, *r;
+
+	for (pp = &retained; *pp != NULL; pp = &(*pp)->next) {
+		if (strcmp((*pp)->topic, topic) == 0) {
+			r = *pp;
+			*pp = r->next;
+			free(r->payload);
+			free(r);
+			break;
+		}
+	}
+	if (len == 0)
+		return;
+
+	r = xmalloc(sizeof(*r) + strlen(topic) + 1);
+	strcpy(r->topic, topic);
+	r->payload = xmalloc(len);
+	memcpy(r->payload, payload, len);
+	r->len = len;
+	r->qos = qos;
+	r->next = retained;
+	retained = r;
+}
+
+/* the filter of a $share/group/filter subscription, NULL for others */
+static const char *share_filter(const char *filter)
+{
+	const char *p;
+
+	if (strncmp(filter, "$share/", 7) != 0)
+		return NULL;
+	p = strchr(filter + 7, '/');
+	return p != NULL ? p + 1 : NULL;
+}
+
+/* the subscription of client i to filter, if it is connected */
+static sub_t *share_member(int i, const char *filter)
+{
+	client_t *c = &clients[i];
+	sub_t *s;
+
+	if (c->fd < 0 || !c->connected)
+		return NULL;
+	for (s = c->subs; s != NULL; s = s->next) {
+		if (strcmp(s->filter, filter) == 0)
+			return s;
+	}
+	return NULL;
+}
+
+/* one delivery per group, to the next of the clients in it */
+static void route_shared(const char *topic, const char *payload, size_t len, int qos)
+{
+	int i, j;
+
+	for (i = 0; i < nclients; i++) {
+		sub_t *s;
+
+		if (clients[i].fd < 0 || !clients[i].connected)
+			continue;
+		for (s = clients[i].subs; s != NULL; s = s->next) {
+			const char *f = share_filter(s->filter);
+			int members = 0, pick;
+
+			if (f == NULL || !topic_matches(f, topic))
+				continue;
+			/* the group was served from the first client in it */
+			for (j = 0; j < i && share_member(j, s->filter) == NULL; j++)
+				;
+			if (j < i)
+				continue;
+			for (j = i; j < nclients; j++)
+				members += share_member(j, s->filter) != NULL;
+			pick = share_next++ % members;
+			for (j = i; j < nclients; j++) {
+				sub_t *m = share_member(j, s->filter);
+
+				if (m != NULL && pick-- == 0) {
+					deliver(j, topic, payload, len, qos < m->qos ? qos : m->qos, false);
+					break;
+				}
+			}
+			/* dropped for not reading, its subscriptions are gone */
+			if (clients[i].fd < 0)
+				break;
+		}
+	}
+}
+
+static void route(const char *topic, const char *payload, size_t len, int qos, bool retain)
+{
+	int i;
+
+	if (retain)
+		retain_store(topic, payload, len, qos);
+
+	for (i = 0; i < nclients; i++) {
+		client_t *c = &clients[i];
+		sub_t *s;
+		int best = -1;
+
+		if (c->fd < 0 || !c->connected)
+			continue;
+		/* once per client, at the highest QoS of its matching subscriptions */
+		for (s = c->subs; s != NULL; s = s->next) {
+			if (s->qos > best && share_filter(s->filter) == NULL
+					&& topic_matches(s->filter, topic))
+				best = s->qos;
+		}
+		if (best >= 0)
+			deliver(i, topic, payload, len, qos < best ? qos : best, false);
+	}
+	route_shared(topic, payload, len, qos);
+}
+
+static void fault_set(const char *payload, size_t len)
+{
+	char spec[256], *tok, *save = NULL;
+
+	if (len >= sizeof(spec))
+		len = sizeof(spec) - 1;
+	memcpy(spec, payload, len);
+	spec[len] = '\0';
+
+	for (tok = strtok_r(spec, " ,", &save); tok != NULL; tok = strtok_r(NULL, " ,", &save)) {
+		if (strncmp(tok, "drop=", 5) == 0)
+			fault.drop = atoi(tok + 5);
+		else if (strncmp(tok, "delay=", 6) == 0)
+			fault.delay = atoi(tok + 6);
+		else if (strncmp(tok, "disconnect=", 11) == 0)
+			fault.disconnect = strtoul(tok + 11, NULL, 10);
+	}
+	if (verbose)
+		fprintf(stderr, "faults: drop=%d delay=%d disconnect=%lu\n",
+			fault.drop, fault.delay, fault.disconnect);
+}
+
+static void client_close(int i, bool clean)
+{
+	client_t *c = &clients[i];
+	sub_t *s;
+
+	if (c->fd < 0)
+		return;
+	close(c->fd);
+	c->fd = -1;
+
+	if (!clean && c->connected && c->will_topic != NULL)
+		route(c->will_topic, c->will_payload, c->will_len, c->will_qos, c->will_retain);
+	if (verbose)
+		fprintf(stderr, "client %s: closed\n", c->id ? c->id : "?");
+
+	while ((s = c->subs) != NULL) {
+		c->subs = s->next;
+		free(s);
+	}
+	free(c->id);
+	free(c->rbuf.buf);
+	free(c->wbuf.buf);
+	free(c->will_topic);
+	free(c->will_payload);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+/* bounds checked reading of packet bodies */
+typedef struct {
+	const uint8_t *p;
+	size_t left;
+	bool bad;
+} reader_t;
+
+static unsigned read_u8(reader_t *r)
+{
+	if (r->left < 1) {
+		r->bad = true;
+		return 0;
+	}
+	r->left--;
+	return *r->p++;
+}
+
+static unsigned read_u16(reader_t *r)
+{
+	unsigned hi = read_u8(r);
+
+	return hi << 8 | read_u8(r);
+}
+
+/* length prefixed string as a NUL terminated copy, *len set if not NULL */
+static char *read_str(reader_t *r, size_t *len)
+{
+	size_t n = read_u16(r);
+	char *s;
+
+	if (r->bad || r->left < n) {
+		r->bad = true;
+		return NULL;
+	}
+	s = xmalloc(n + 1);
+	memcpy(s, r->p, n);
+	s[n] = '\0';
+	r->p += n;
+	r->left -= n;
+	if (len != NULL)
+		*len = n;
+	return s;
+}
+
+static bool handle_connect(int i, reader_t *r)
+{
+	client_t *c = &clients[i];
+	char *proto = read_str(r, NULL);
+	unsigned level = read_u8(r);
+	unsigned flags = read_u8(r);
+	uint8_t connack[4] = { CONNACK, 2, 0, 0 };
+
+	read_u16(r);	/* keepalive, not enforced */
+	c->id = read_str(r, NULL);
+	if (flags & 0x04) {
+		c->will_topic = read_str(r, NULL);
+		c->will_payload = read_str(r, &c->will_len);
+		c->will_qos = (flags >> 3) & 3;
+		c->will_retain = flags & 0x20;
+	}
+	if (flags & 0x80)
+		free(read_str(r, NULL));
+	if (flags & 0x40)
+		free(read_str(r, NULL));
+
+	if (r->bad || proto == NULL) {
+		free(proto);
+		return false;
+	}
+	if (!((level == 3 && strcmp(proto, "MQIsdp") == 0)
+			|| (level == 4 && strcmp(proto, "MQTT") == 0))) {
+		/* unacceptable protocol version, MQTT 5 included */
+		connack[3] = 1;
+	}
+	free(proto);
+
+	if (connack[3] != 0) {
+		/* the connection is dropped right away, so no queueing */
+		if (write(c->fd, connack, sizeof(connack)) < 0) {
+			/* closing anyway */
+		}
+		return false;
+	}
+	queue_bytes(i, connack, sizeof(connack));
+	c->connected = true;
+	if (verbose)
+		fprintf(stderr, "client %s: connected\n", c->id);
+	return c->connected;
+}
+
+static bool handle_publish(int i, int flags, reader_t *r)
+{
+	client_t *c = &clients[i];
+	int qos = (flags >> 1) & 3;
+	bool retain = flags & 1;
+	char *topic = read_str(r, NULL);
+	uint16_t mid = qos > 0 ? read_u16(r) : 0;
+	bool route_it = true;
+
+	if (r->bad || qos > 2) {
+		free(topic);
+		return false;
+	}
+
+	if (qos == 2) {
+		/* a resent PUBLISH before PUBREL was routed already */
+		route_it = !(c->qos2[mid / 8] & (1 << (mid % 8)));
+		c->qos2[mid / 8] |= 1 << (mid % 8);
+	}
+
+	if (strcmp(topic, "$stub/fault") == 0) {
+		fault_set((const char *) r->p, r->left);
+		route_it = false;
+	} else if (strcmp(topic, "$stub/disconnect") == 0) {
+		free(topic);
+		return false;
+	}
+
+	if (route_it)
+		route(topic, (const char *) r->p, r->left, qos, retain);
+	free(topic);
+
+	if (qos == 1)
+		send_ack(i, PUBACK, mid);
+	else if (qos == 2)
+		send_ack(i, PUBREC, mid);
+	return true;
+}
+
+static bool handle_subscribe(int i, reader_t *r)
+{
+	client_t *c = &clients[i];
+	uint16_t mid = read_u16(r);
+	uint8_t granted[256];
+	size_t n = 0;
+
+	while (!r->bad && r->left > 0 && n < sizeof(granted)) {
+		char *filter = read_str(r, NULL);
+		int qos = read_u8(r) & 3;
+		sub_t **pp, *s;
+
+		if (r->bad)
+			break;
+		if (qos > 2)
+			qos = 2;
+		/* a repeated filter replaces the subscription */
+		for (pp = &c->subs; *pp != NULL; pp = &(*pp)->next) {
+			if (strcmp((*pp)->filter, filter) == 0) {
+				s = *pp;
+				*pp = s->next;
+				free(s);
+				break;
+			}
+		}
+		s = xmalloc(sizeof(*s) + strlen(filter) + 1);
+		strcpy(s->filter, filter);
+		s->qos = qos;
+		s->next = c->subs;
+		c->subs = s;
+		granted[n++] = qos;
+		free(filter);
+	}
+	if (r->bad || n == 0)
+		return false;
+
+	uint8_t h[5];
+	size_t hlen = header(h, SUBACK, 2 + n);
+	uint8_t m[2] = { mid >> 8, mid & 0xff };
+
+	queue_bytes(i, h, hlen);
+	queue_bytes(i, m, 2);
+	queue_bytes(i, granted, n);
+
+	/* retained messages follow the SUBACK; the new subscriptions are the
+	 * first n on the list */
+	sub_t *s = c->subs;
+	size_t k;
+
+	for (k = 0; k < n && s != NULL && c->fd >= 0; k++, s = s->next) {
+		retained_t *rt;
+
+		for (rt = retained; rt != NULL; rt = rt->next) {
+			if (topic_matches(s->filter, rt->topic))
+				deliver(i, rt->topic, rt->payload, rt->len,
+					rt->qos < s->qos ? rt->qos : s->qos, true);
+		}
+	}
+	return true;
+}
+
+static bool handle_unsubscribe(int i, reader_t *r)
+{
+	client_t *c = &clients[i];
+	uint16_t mid = read_u16(r);
+
+	while (!r->bad && r->left > 0) {
+		char *filter = read_str(r, NULL);
+		sub_t **pp;
+
+		if (r->bad)
+			break;
+		for (pp = &c->subs; *pp != NULL; pp = &(*pp)->next) {
+			if (strcmp((*pp)->filter, filter) == 0) {
+				sub_t *s = *pp;
+				*pp = s->next;
+				free(s);
+				break;
+			}
+		}
+		free(filter);
+	}
+	if (r->bad)
+		return false;
+	send_ack(i, UNSUBACK, mid);
+	return true;
+}
+
+/* one complete packet, false to drop the client */
+static bool handle_packet(int i, uint8_t type, const uint8_t *body, size_t len)
+{
+	client_t *c = &clients[i];
+	reader_t r = { body, len, false };
+	uint16_t mid;
+
+	if (verbose)
+		fprintf(stderr, "client %s: packet 0x%02x, %zu bytes\n",
+			c->id ? c->id : "?", type, len);
+
+	if (!c->connected && (type & 0xF0) != CONNECT)
+		return false;
+
+	switch (type & 0xF0) {
+	case CONNECT:
+		return !c->connected && handle_connect(i, &r);
+	case PUBLISH:
+		return handle_publish(i, type & 0x0F, &r);
+	case PUBACK:
+	case PUBCOMP:
+		/* outbound QoS 1 and 2 done, nothing kept to clean up */
+		return true;
+	case PUBREC:
+		mid = read_u16(&r);
+		send_ack(i, PUBREL | 0x02, mid);
+		return !r.bad;
+	case PUBREL:
+		mid = read_u16(&r);
+		c->qos2[mid / 8] &= ~(1 << (mid % 8));
+		send_ack(i, PUBCOMP, mid);
+		return !r.bad;
+	case SUBSCRIBE:
+		return handle_subscribe(i, &r);
+	case UNSUBSCRIBE:
+		return handle_unsubscribe(i, &r);
+	case PINGREQ: {
+		uint8_t p[2] = { PINGRESP, 0 };
+		queue_bytes(i, p, 2);
+		return true;
+	}
+	case DISCONNECT:
+		client_close(i, true);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* handle the complete packets in the read buffer */
+static void client_read(int i)
+{
+	client_t *c = &clients[i];
+	char tmp[65536];
+	ssize_t n = read(c->fd, tmp, sizeof(tmp));
+
+	if (n <= 0) {
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		client_close(i, false);
+		return;
+	}
+	if (!buf_append(&c->rbuf, tmp, n)) {
+		client_close(i, false);
+		return;
+	}
+
+	while (c->fd >= 0 && c->rbuf.len >= 2) {
+		const uint8_t *p = (const uint8_t *) c->rbuf.buf;
+		size_t remaining = 0, hlen = 1;
+		int shift = 0;
+
+		/* remaining length, at most 4 bytes */
+		do {
+			if (hlen >= c->rbuf.len)
+				return;
+			if (hlen > 4) {
+				client_close(i, false);
+				return;
+			}
+			remaining |= (size_t) (p[hlen] & 0x7f) << shift;
+			shift += 7;
+		} while (p[hlen++] & 0x80);
+
+		if (c->rbuf.len < hlen + remaining)
+			return;
+
+		if (!handle_packet(i, p[0], p + hlen, remaining)) {
+			client_close(i, false);
+			return;
+		}
+		if (c->fd < 0)
+			return;
+		buf_consume(&c->rbuf, hlen + remaining);
+
+		if (fault.disconnect > 0 && ++c->packets >= fault.disconnect) {
+			client_close(i, false);
+			return;
+		}
+	}
+}
+
+static void client_write(int i)
+{
+	client_t *c = &clients[i];
+	ssize_t n = write(c->fd, c->wbuf.buf, c->wbuf.len);
+
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			client_close(i, false);
+		return;
+	}
+	buf_consume(&c->wbuf, n);
+}
+
+static void client_accept(int lfd)
+{
+	int fd = accept(lfd, NULL, NULL);
+	int i, one = 1;
+
+	if (fd < 0)
+		return;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	for (i = 0; i < nclients && clients[i].fd >= 0; i++)
+		;
+	if (i == nclients) {
+		client_t *grown = realloc(clients, (nclients + 16) * sizeof(*clients));
+
+		if (grown == NULL) {
+			close(fd);
+			return;
+		}
+		clients = grown;
+		for (i = nclients; i < nclients + 16; i++) {
+			memset(&clients[i], 0, sizeof(clients[i]));
+			clients[i].fd = -1;
+		}
+		i = nclients;
+		nclients += 16;
+	}
+	clients[i].fd = fd;
+	clients[i].gen = ++generation;
+}
+
+/* move due deliveries to their clients, returns ms until the next is due */
+static int delayed_flush(void)
+{
+	uint64_t now = now_ms();
+
+	while (delayed_head != NULL && delayed_head->due <= now) {
+		delayed_t *d = delayed_head;
+
+		delayed_head = d->next;
+		if (delayed_head == NULL)
+			delayed_tail = NULL;
+		if (clients[d->client].fd >= 0 && clients[d->client].gen == d->gen)
+			queue_bytes(d->client, d->data, d->len);
+		free(d);
+	}
+	return delayed_head != NULL ? (int) (delayed_head->due - now) : -1;
+}
+
+static int listen_on(const char *path, int port, char *addr, size_t addrlen)
+{
+	int fd, one = 1;
+
+	if (path != NULL) {
+		struct sockaddr_un sun;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+		unlink(path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+			return -1;
+		snprintf(addr, addrlen, "%s", path);
+	} else {
+		struct sockaddr_in sin;
+		socklen_t len = sizeof(sin);
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0
+				|| getsockname(fd, (struct sockaddr *) &sin, &len) < 0)
+			return -1;
+		snprintf(addr, addrlen, "127.0.0.1:%d", ntohs(sin.sin_port));
+	}
+	if (listen(fd, 128) < 0)
+		return -1;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-p port] [-u path] [-d drop%%] [-D delay_ms] "
+		"[-x packets] [-s seed] [-v]\n", name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = NULL;
+	int port = 1883, opt, lfd;
+	unsigned seed = 1;
+	char addr[128];
+	struct pollfd *fds = NULL;
+
+	while ((opt = getopt(argc, argv, "p:u:d:D:x:s:v")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 'u': path = optarg; break;
+		case 'd': fault.drop = atoi(optarg); break;
+		case 'D': fault.delay = atoi(optarg); break;
+		case 'x': fault.disconnect = strtoul(optarg, NULL, 10); break;
+		case 's': seed = strtoul(optarg, NULL, 10); break;
+		case 'v': verbose = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	srand(seed);
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = listen_on(path, port, addr, sizeof(addr));
+	if (lfd < 0) {
+		perror("listen");
+		return 1;
+	}
+	printf("listening %s\n", addr);
+	fflush(stdout);
+
+	for (;;) {
+		int timeout = delayed_flush();
+		int n = 0, i, k;
+
+		fds = realloc(fds, (nclients + 1) * sizeof(*fds));
+		if (fds == NULL) {
+			perror("realloc");
+			return 1;
+		}
+		fds[n].fd = lfd;
+		fds[n++].events = POLLIN;
+		for (i = 0; i < nclients; i++) {
+			/* slots line up with clients, closed ones are ignored by poll */
+			fds[n].fd = clients[i].fd;
+			fds[n++].events = POLLIN | (clients[i].wbuf.len > 0 ? POLLOUT : 0);
+		}
+
+		if (poll(fds, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+
+		for (k = 1; k < n; k++) {
+			i = k - 1;
+			if (clients[i].fd < 0 || fds[k].fd != clients[i].fd)
+				continue;
+			if (fds[k].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read(i);
+			if (clients[i].fd >= 0 && (fds[k].revents & POLLOUT))
+				client_write(i);
+		}
+		if (fds[0].revents & POLLIN)
+			client_accept(lfd);
+	}
+}
@@ -0,0 +1,700 @@
+#!/usr/bin/env lua
+
+--[[
+Behaviour tests: each check drives one feature of the module through a
+broker and looks at what comes out the other end. Checks needing
+something this build or tree lacks are skipped.
+
+usage: features.lua [option=value ...]
+
+	host=        broker host, default: start test/broker/broker on a free port
+	port=1883    broker port, with host
+	only=        comma separated names of the checks to run, default: all
+	timeout=5    seconds to wait for anything to arrive
+	verbose=0    1 to print every check as it completes to stderr
+
+The result goes to stdout as a single JSON object, "ok", "skipped: why" or
+"failed: why" per check. The exit status is 0 only when nothing failed.
+]]
+
+local mosq = require "mosquitto"
+
+local opts = {
+	host = false, port = 1883,
+	only = false, timeout = 5, verbose = 0,
+}
+
+for _, a in ipairs(arg) do
+	local k, v = a:match("^([%w_]+)=(.*)$")
+	if not k or opts[k] == nil then
+		io.stderr:write("bad option: ", a, "\n")
+		os.exit(2)
+	end
+	opts[k] = type(opts[k]) == "number" and tonumber(v) or v
+end
+
+local clock = mosq.clock
+local dir = arg[0]:match("^(.*)/[^/]*$") or "."
+
+-- start the stub broker, unless pointed at one
+local broker
+if not opts.host then
+	local proc = io.popen("echo $$; exec " .. dir .. "/../broker/broker -p 0")
+	local pid = proc:read("*l")
+	local addr = proc:read("*l")
+	local host, port = (addr or ""):match("^listening ([^:]+):(%d+)$")
+	if not host then
+		io.stderr:write("no broker, build it with 'make broker' or pass host=\n")
+		os.exit(1)
+	end
+	broker = { proc = proc, pid = pid }
+	opts.host, opts.port = host, tonumber(port)
+end
+
+local function stop_broker()
+	if broker then
+		os.execute("kill " .. broker.pid)
+		broker.proc:close()
+	end
+end
+
+mosq.init()
+
+local CONN_LOST = 7		-- MOSQ_ERR_CONN_LOST
+local NOT_SUPPORTED = 10	-- MOSQ_ERR_NOT_SUPPORTED
+local ERRNO = 14		-- MOSQ_ERR_ERRNO
+
+-- instances and files a check leaves behind, cleared after each check
+local created, tmpfiles = {}, {}
+
+local function expect(cond, fmt, ...)
+	if not cond then
+		error(string.format(fmt or "unexpected result", ...), 0)
+	end
+	return cond
+end
+
+local function skip(why)
+	error({ skip = why }, 0)
+end
+
+local function tmpfile()
+	local path = os.tmpname()
+	tmpfiles[#tmpfiles + 1] = path
+	return path
+end
+
+-- loop ctxs until done() holds, or for the timeout when it never does
+local function pump(ctxs, done, timeout)
+	local deadline = clock() + (timeout or opts.timeout)
+	repeat
+		for _, ctx in ipairs(ctxs) do
+			local ok, _, err = ctx:loop(5, 64)
+			expect(ok, "loop: %s", tostring(err))
+		end
+		if done() then
+			return true
+		end
+	until clock() > deadline
+	return false
+end
+
+local function never()
+	return false
+end
+
+local function destroy(ctx)
+	for i, c in ipairs(created) do
+		if rawequal(c, ctx) then
+			table.remove(created, i)
+			break
+		end
+	end
+	ctx:destroy()
+end
+
+-- a connected instance, setup gets it before connecting
+local function client(setup)
+	local ctx = mosq.new(nil, true)
+	local connected = false
+
+	created[#created + 1] = ctx
+	if setup then
+		setup(ctx)
+	end
+	ctx.ON_CONNECT = function()
+		connected = true
+	end
+	expect(ctx:connect(opts.host, opts.port, 60))
+	expect(pump({ ctx }, function() return connected end), "no CONNACK")
+	return ctx
+end
+
+local function subscribe(ctx, topic, qos)
+	local done = false
+
+	ctx.ON_SUBSCRIBE = function()
+		done = true
+	end
+	expect(ctx:subscribe(topic, qos or 0))
+	expect(pump({ ctx }, function() return done end), "no SUBACK for %s", topic)
+end
+
+-- messages ctx gets from ON_MESSAGE, in order
+local function collect(ctx)
+	local got = {}
+
+	ctx.ON_MESSAGE = function(mid, topic, payload, qos, retain)
+		got[#got + 1] = { topic = topic, payload = payload, qos = qos }
+	end
+	return got
+end
+
+local function payloads(got)
+	local out = {}
+	for i, m in ipairs(got) do
+		out[i] = m.payload
+	end
+	return table.concat(out, ",")
+end
+
+local checks = {}
+
+local function check(name, fn)
+	checks[#checks + 1] = { name, fn }
+end
+
+check("store_replay", function()
+	local path = tmpfile()
+	local sub = client()
+	local got = collect(sub)
+	subscribe(sub, "features/store", 1)
+
+	-- first run: published, then gone before reading a single ack
+	local a = client(function(ctx)
+		expect(ctx:store_open(path) == 0, "a new store isn't empty")
+	end)
+	for i = 1, 3 do
+		expect(a:publish("features/store", "m" .. i, 1))
+	end
+	a:store_close()
+	destroy(a)
+	pump({ sub }, never, 0.2)
+	for i = #got, 1, -1 do
+		got[i] = nil
+	end
+
+	-- second run: the store hands them back, published again on connect
+	local recovered
+	local b = client(function(ctx)
+		recovered = ctx:store_open(path)
+	end)
+	expect(recovered == 3, "recovered %s, not 3", tostring(recovered))
+	expect(pump({ sub, b }, function()
+		return #got >= 3 and b:stats().published >= 3
+	end), "replayed %d of 3", #got)
+	expect(payloads(got) == "m1,m2,m3", "replayed %s", payloads(got))
+	b:store_close()
+
+	-- acknowledged now, nothing left to recover
+	local c = mosq.new(nil, true)
+	created[#created + 1] = c
+	expect(c:store_open(path) == 0, "acknowledged messages recovered")
+	c:store_close()
+end)
+
+check("rate_limit", function()
+	local sub = client()
+	local got = collect(sub)
+	subscribe(sub, "features/rate", 1)
+	local pub = client()
+
+	-- a bucket of two, the rest is refused
+	expect(pub:rate_limit(1, 0, "reject", 0, 2))
+	local sent, rejected = 0, 0
+	for i = 1, 5 do
+		local ok, code = pub:publish("features/rate", "r" .. i, 1)
+		if ok then
+			sent = sent + 1
+		else
+			expect(code == mosq.ERR_RATE_LIMIT, "rejected with %s", tostring(code))
+			rejected = rejected + 1
+		end
+	end
+	expect(sent == 2 and rejected == 3, "sent %d, rejected %d", sent, rejected)
+	expect(pub:stats().rate_rejected == 3, "rate_rejected not counted")
+	expect(pub:rate_delay() > 0, "no delay with an empty bucket")
+
+	-- queued instead, going out in order as the bucket refills
+	expect(pub:rate_limit(50, 0, "queue", 0, 1))
+	expect(pump({ sub, pub }, function() return #got >= 2 end), "first two lost")
+	for i = 1, 5 do
+		expect(pub:publish("features/rate", "q" .. i, 1))
+	end
+	expect(pub:stats().rate_queue > 0, "nothing held back")
+	local start = clock()
+	expect(pump({ sub, pub }, function() return #got >= 7 end),
+		"got %d of 7", #got)
+	expect(clock() - start > 0.05, "no pacing")
+	expect(payloads(got) == "r1,r2,q1,q2,q3,q4,q5", "got %s", payloads(got))
+	expect(pub:stats().rate_queue == 0, "queue not drained")
+end)
+
+check("flow_control", function()
+	local sub = client()
+	local got = collect(sub)
+	subscribe(sub, "features/flow")
+	expect(sub:flow_control(4, 2))
+	local pub = client()
+
+	for i = 1, 20 do
+		expect(pub:publish("features/flow", "f" .. i))
+	end
+	pump({ sub, pub }, never, 0.3)
+	expect(#got >= 4 and #got < 20, "got %d of 20 while throttled", #got)
+	expect(sub:stats().read_throttled >= 1, "read_throttled not counted")
+
+	-- consuming resumes reading
+	local consumed = 0
+	expect(pump({ sub, pub }, function()
+		sub:consumed(#got - consumed)
+		consumed = #got
+		return #got >= 20
+	end), "got %d of 20 after consuming", #got)
+end)
+
+check("pause_drop", function()
+	local sub = client()
+	local got = collect(sub)
+	subscribe(sub, "features/drop")
+	expect(sub:pause_read())
+	local pub = client()
+
+	for i = 1, 5 do
+		expect(pub:publish("features/drop", "d" .. i))
+	end
+	pump({ sub, pub }, never, 0.3)
+	expect(#got == 0, "got %d while paused", #got)
+
+	-- the broker drops sub; a closed peer only shows once sub writes to it
+	expect(sub:publish("$stub/disconnect", ""))
+	local ok, code
+	local deadline = clock() + opts.timeout
+	repeat
+		ok, code = sub:loop(5, 64)
+		if ok then
+			sub:publish("features/drop/poke", "")
+		end
+	until not ok or clock() > deadline
+	expect(not ok, "connection loss not reported")
+	expect(code == CONN_LOST or code == ERRNO,
+		"loop: error %s", tostring(code))
+	expect(#got == 0, "got %d past the pause", #got)
+end)
+
+check("recv", function()
+	local sub = client()
+	expect(sub:queue_set(0))
+	subscribe(sub, "features/recv", 1)
+	local pub = client()
+
+	for i = 1, 20 do
+		expect(pub:publish("features/recv", "v" .. i, 1))
+	end
+	pump({ pub }, function() return pub:stats().published >= 20 end)
+
+	local got = {}
+	local deadline = clock() + opts.timeout
+	while #got < 20 and clock() < deadline do
+		local batch = expect(sub:recv(8, 100))
+		expect(#batch <= 8, "%d messages, asked for 8 at most", #batch)
+		for _, m in ipairs(batch) do
+			expect(m.topic == "features/recv" and m.qos == 1 and m.retain == false,
+				"record %s %s", tostring(m.topic), tostring(m.qos))
+			got[#got + 1] = m
+		end
+	end
+	local want = {}
+	for i = 1, 20 do
+		want[i] = "v" .. i
+	end
+	expect(payloads(got) == table.concat(want, ","), "got %s", payloads(got))
+	expect(#sub:recv(8, 0) == 0, "messages left over")
+end)
+
+check("recv_pool", function()
+	local sub = client()
+	expect(sub:queue_set(0))
+	expect(sub:recv_pool(4))
+	subscribe(sub, "features/pool", 1)
+	local pub = client()
+
+	for i = 1, 20 do
+		expect(pub:publish("features/pool", "v" .. i, 1))
+	end
+	pump({ pub }, function() return pub:stats().published >= 20 end)
+
+	local got, first = {}, nil
+	local deadline = clock() + opts.timeout
+	while #got < 20 and clock() < deadline do
+		local batch = expect(sub:recv(8, 100))
+		-- released after each round, so the pool hands out the same table
+		first = first or batch
+		expect(rawequal(batch, first), "batch table not reused")
+		for _, m in ipairs(batch) do
+			got[#got + 1] = { payload = m.payload }
+		end
+		sub:release(batch)
+	end
+	local want = {}
+	for i = 1, 20 do
+		want[i] = "v" .. i
+	end
+	expect(payloads(got) == table.concat(want, ","), "got %s", payloads(got))
+
+	-- records still held aren't handed out again
+	expect(pub:publish("features/pool", "w1", 1))
+	expect(pub:publish("features/pool", "w2", 1))
+	local a = expect(sub:recv(1, 1000))
+	local b = expect(sub:recv(1, 1000))
+	expect(#a == 1 and #b == 1, "got %d and %d", #a, #b)
+	expect(not rawequal(a, b) and not rawequal(a[1], b[1]), "held records reused")
+	expect(a[1].payload == "w1" and b[1].payload == "w2", "got %s and %s",
+		tostring(a[1].payload), tostring(b[1].payload))
+end)
+
+check("publish_file", function()
+	local path = tmpfile()
+	local f = assert(io.open(path, "wb"))
+	f:write("0123456789abcdef")
+	f:close()
+
+	local sub = client()
+	local got = collect(sub)
+	subscribe(sub, "features/file", 1)
+	local pub = client()
+
+	expect(pub:publish_file("features/file", path, 0, nil, 1))
+	expect(pub:publish_file("features/file", path, 4, 6, 1))
+	expect(not pcall(pub.publish_file, pub, "features/file", path, 12, 8),
+		"a range past the end published")
+	expect(pump({ sub, pub }, function() return #got >= 2 end), "got %d of 2", #got)
+	expect(payloads(got) == "0123456789abcdef,456789", "got %s", payloads(got))
+end)
+
+check("stream", function()
+	local parts = {}
+	for i = 1, 25000 do
+		parts[i] = string.char(i % 251)
+	end
+	local big = string.rep(table.concat(parts), 4)
+
+	local sub = client()
+	local got = collect(sub)
+	expect(sub:stream_reassembly(1024 * 1024, "features/stream/#"))
+	subscribe(sub, "features/stream/#", 1)
+	local pub = client()
+
+	expect(pub:publish_stream("features/stream/string", big, 1, 4096))
+	local off = 1
+	expect(pub:publish_stream("features/stream/source", function()
+		local piece = big:sub(off, off + 999)
+		off = off + 1000
+		return piece
+	end, 1, 4096))
+	expect(pump({ sub, pub }, function() return #got >= 2 end), "got %d of 2", #got)
+	expect(#got == 2, "%d messages, not 2", #got)
+	for _, m in ipairs(got) do
+		expect(m.payload == big, "%s: %d bytes differ", m.topic, #m.payload)
+	end
+	local stats = sub:stats()
+	expect(stats.stream_completed == 2, "stream_completed %d", stats.stream_completed)
+	expect(stats.stream_frames > 2, "stream_frames %d", stats.stream_frames)
+end)
+
+check("compression", function()
+	local text = string.rep("compress me, compress me not. ", 200)
+	local sub = client()
+	local got = collect(sub)
+	local ok, code = sub:compression("zstd")
+	if not ok and code == NOT_SUPPORTED then
+		skip("built without ZSTD=yes")
+	end
+	expect(ok, "compression: %s", tostring(code))
+	subscribe(sub, "features/zstd", 1)
+	local pub = client()
+	expect(pub:compression("zstd", 3, nil, 64))
+
+	expect(pub:publish("features/zstd", text, 1))
+	expect(pub:publish("features/zstd", "short", 1))
+	expect(pump({ sub, pub }, function() return #got >= 2 end), "got %d of 2", #got)
+	expect(got[1].payload == text and got[2].payload == "short", "payloads differ")
+	local stats = pub:stats()
+	expect(stats.compressed == 1, "compressed %d", stats.compressed)
+	expect(stats.compress_ratio > 1, "no smaller")
+	expect(sub:stats().decompressed == 1, "decompressed %d", sub:stats().decompressed)
+end)
+
+check("dedup", function()
+	local sub = client()
+	local got = collect(sub)
+	expect(sub:dedup(10000))
+	subscribe(sub, "features/dedup", 1)
+	local pub = client()
+
+	for _, p in ipairs({ "a", "a", "b", "a" }) do
+		expect(pub:publish("features/dedup", p, 1))
+	end
+	expect(pub:publish("features/dedup", "a", 0))
+	expect(pump({ sub, pub }, function() return #got >= 3 end), "got %d of 3", #got)
+	pump({ sub, pub }, never, 0.1)
+	-- QoS 0 isn't deduplicated
+	expect(payloads(got) == "a,b,a", "got %s", payloads(got))
+	expect(sub:stats().dedup_hits == 2, "dedup_hits %d", sub:stats().dedup_hits)
+end)
+
+check("filter", function()
+	local sub = client()
+	local got = collect(sub)
+	expect(sub:filter("features/filter/len", { min_len = 2, prefix = "ok" }))
+	expect(sub:filter("features/filter/changed", { changed = true }))
+	subscribe(sub, "features/filter/#", 1)
+	local pub = client()
+
+	for _, p in ipairs({ "ok1", "o", "bad", "ok2" }) do
+		expect(pub:publish("features/filter/len", p, 1))
+	end
+	for _, p in ipairs({ "x", "x", "y", "x" }) do
+		expect(pub:publish("features/filter/changed", p, 1))
+	end
+	expect(pub:publish("features/filter/other", "o", 1))
+	expect(pump({ sub, pub }, function() return #got >= 6 end), "got %d of 6", #got)
+	pump({ sub, pub }, never, 0.1)
+	expect(payloads(got) == "ok1,ok2,x,y,x,o", "got %s", payloads(got))
+	expect(sub:stats().filtered == 3, "filtered %d", sub:stats().filtered)
+end)
+
+check("cache", function()
+	local sub = client()
+	expect(sub:cache_set(65536))
+	subscribe(sub, "features/cache/#", 1)
+	local pub = client()
+
+	expect(pub:publish("features/cache/a", "1", 1))
+	expect(pub:publish("features/cache/b", "x", 1, true))
+	expect(pub:publish("features/cache/a", "2", 1))
+	expect(pump({ sub, pub }, function()
+		return sub:last("features/cache/a") == "2"
+			and sub:last("features/cache/b") ~= nil
+	end), "latest values not cached")
+
+	local payload, qos, retain, age = sub:last("features/cache/b")
+	expect(payload == "x" and qos == 1 and age >= 0, "last gave %s %s",
+		tostring(payload), tostring(qos))
+	expect(sub:last("features/cache/none") == nil, "a value never published")
+	local snap = sub:snapshot("features/cache/+")
+	expect(snap["features/cache/a"] == "2" and snap["features/cache/b"] == "x",
+		"snapshot differs")
+	-- clear the retained message for later runs on the same broker
+	pub:publish("features/cache/b", "", 1, true)
+end)
+
+check("coalesce", function()
+	local pub = client()
+	local seen, calls, bad = {}, 0, nil
+
+	expect(pub:publish_coalesce("batch"))
+	-- errors raised in handlers don't reach the loop, note them instead
+	pub.ON_PUBLISH = function(mids, n)
+		calls = calls + 1
+		if type(mids) ~= "table" or #mids ~= n then
+			bad = "not a batch"
+			return
+		end
+		for _, mid in ipairs(mids) do
+			if seen[mid] then
+				bad = "mid " .. mid .. " twice"
+			end
+			seen[mid] = true
+		end
+	end
+	local mids = {}
+	for i = 1, 10 do
+		mids[i] = expect(pub:publish("features/coalesce", "c" .. i, 1))
+	end
+	expect(pump({ pub }, function() return pub:stats().published >= 10 end),
+		"published %d of 10", pub:stats().published)
+	expect(not bad, bad)
+	for _, mid in ipairs(mids) do
+		expect(seen[mid], "mid %d not reported", mid)
+	end
+	expect(calls >= 1 and calls <= 10, "%d calls", calls)
+
+	-- counted only
+	expect(pub:publish_coalesce("count"))
+	calls = 0
+	for i = 1, 10 do
+		expect(pub:publish("features/coalesce", "n" .. i, 1))
+	end
+	expect(pump({ pub }, function() return pub:stats().published >= 20 end),
+		"published %d of 20", pub:stats().published)
+	expect(calls == 0, "ON_PUBLISH called in count mode")
+end)
+
+-- the pool's replies matching pattern, counted by "sender topic payload"
+local function pool_wait(pool, want, pattern, timeout)
+	local got = {}
+	local n = 0
+	local deadline = clock() + (timeout or opts.timeout)
+	while n < want and clock() < deadline do
+		local topic, payload = pool:recv(100)
+		expect(topic ~= false, "pool stopping")
+		if topic and (not pattern or topic:match(pattern)) then
+			got[topic .. " " .. payload] = (got[topic .. " " .. payload] or 0) + 1
+			n = n + 1
+		end
+	end
+	return got, n
+end
+
+check("pool", function()
+	local pool = mosq.pool{ init = dir .. "/worker.lua", threads = 2 }
+	expect(mosq.worker() == nil, "worker outside a pool")
+
+	expect(pool:send(1, "ping", "one"))
+	expect(pool:send(2, "ping", "two"))
+	local got, n = pool_wait(pool, 2)
+	expect(n == 2 and got["0 ping one"] == 1 and got["0 ping two"] == 1,
+		"%d replies", n)
+
+	expect(pool:stop())
+	expect(pool:join())
+end)
+
+check("share", function()
+	local pool = mosq.pool{ init = dir .. "/worker.lua", threads = 2 }
+	local ok, err = pcall(function()
+		expect(pool:share("features", "features/share/#", {
+			host = opts.host, port = opts.port, qos = 1, connections = 2,
+		}))
+		local pub = client()
+
+		-- nothing tells when the shared subscriptions are in place
+		expect(pump({ pub }, function()
+			pub:publish("features/share/probe", "p", 1)
+			return pool:recv(20) ~= nil
+		end), "nothing arrives")
+
+		for i = 1, 20 do
+			expect(pub:publish("features/share/n", "s" .. i, 1))
+		end
+		pump({ pub }, function()
+			return pub:stats().published >= 20
+		end)
+		local got, n = pool_wait(pool, 20, "^features features/share/n$")
+		expect(n == 20, "got %d of 20", n)
+		for i = 1, 20 do
+			expect(got["features features/share/n s" .. i] == 1, "s%d lost", i)
+		end
+		-- and each went to one worker only
+		local _, extra = pool_wait(pool, 1, "^features features/share/n$", 0.3)
+		expect(extra == 0, "a message delivered twice")
+	end)
+	pool:stop()
+	expect(pool:join())
+	if not ok then
+		error(err, 0)
+	end
+end)
+
+check("route_native", function()
+	local plugin = dir .. "/../plugin/append.so"
+	local f = io.open(plugin, "rb")
+	if not f then
+		skip("no plugin, build it with 'make plugin'")
+	end
+	f:close()
+	local path = tmpfile()
+
+	local sub = client()
+	local got = collect(sub)
+	expect(sub:route_native("features/route/log/#", plugin, "append", path))
+	subscribe(sub, "features/route/#", 1)
+	local pub = client()
+
+	for i = 1, 3 do
+		expect(pub:publish("features/route/log/" .. i, "l" .. i, 1))
+	end
+	expect(pub:publish("features/route/other", "o", 1))
+	expect(pump({ sub, pub }, function()
+		return #got >= 1 and sub:stats().routed >= 3
+	end), "routed %d of 3", sub:stats().routed)
+	expect(payloads(got) == "o", "got %s", payloads(got))
+
+	-- removing the route closes the file
+	expect(sub:route_native("features/route/log/#", false))
+	f = assert(io.open(path, "rb"))
+	local log = f:read("*a")
+	f:close()
+	expect(log == "features/route/log/1 l1\nfeatures/route/log/2 l2\n"
+		.. "features/route/log/3 l3\n", "log %q", log)
+end)
+
+local selected
+if opts.only then
+	selected = {}
+	for name in opts.only:gmatch("[^,]+") do
+		selected[name] = true
+	end
+end
+
+local results, failures = {}, 0
+for _, c in ipairs(checks) do
+	local name, fn = c[1], c[2]
+	if not selected or selected[name] then
+		local ok, err = pcall(fn)
+		local result
+		if ok then
+			result = "ok"
+		elseif type(err) == "table" and err.skip then
+			result = "skipped: " .. err.skip
+		else
+			result = "failed: " .. tostring(err)
+			failures = failures + 1
+		end
+		results[#results + 1] = { name, result }
+		if opts.verbose ~= 0 then
+			io.stderr:write(name, ": ", result, "\n")
+		end
+
+		for _, ctx in ipairs(created) do
+			ctx:destroy()
+		end
+		for _, path in ipairs(tmpfiles) do
+			os.remove(path)
+		end
+		created, tmpfiles = {}, {}
+		collectgarbage("collect")
+	end
+end
+stop_broker()
+
+results[#results + 1] = { "failures", failures }
+
+-- ordered pairs, so the output is stable and diffable between runs
+local function json(fields)
+	local out = {}
+	for _, f in ipairs(fields) do
+		local k, v = f[1], f[2]
+		if type(v) == "string" then
+			v = string.format("%q", v)
+		else
+			v = tostring(v)
+		end
+		out[#out + 1] = string.format("%q: %s", k, v)
+	end
+	return "{" .. table.concat(out, ", ") .. "}"
+end
+
+print(json(results))
+os.exit(failures == 0 and 0 or 1)
@@ -0,0 +1,15 @@
+-- pool worker for features.lua: hands everything it receives back to the
+-- creating state, as "sender topic", the sender being a worker index or the
+-- group of a shared subscription
+
+local mosq = require "mosquitto"
+
+while true do
+	local topic, payload, from = mosq.worker_recv(-1)
+	if topic == false then
+		return
+	end
+	if topic then
+		mosq.worker_send(0, from .. " " .. topic, payload)
+	end
+end
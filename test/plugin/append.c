@@ -0,0 +1,41 @@
+/*
+ * Example plugin for ctx:route_native: appends every message routed to it
+ * to a file, one "topic payload" line each, without entering Lua.
+ *
+ *	make plugin
+ *	ctx:route_native("log/#", "test/plugin/append.so", "append", "/tmp/log")
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lua-mosquitto-plugin.h"
+
+int append_init(int version, const char *config, void **state)
+{
+	FILE *f;
+
+	if (version != LUA_MOSQUITTO_PLUGIN_VERSION || config == NULL) {
+		return -1;
+	}
+	f = fopen(config, "a");
+	if (f == NULL) {
+		return -1;
+	}
+	*state = f;
+	return 0;
+}
+
+int append(void *state, const struct mosquitto_message *msg)
+{
+	FILE *f = state;
+
+	fprintf(f, "%s ", msg->topic);
+	fwrite(msg->payload, 1, msg->payloadlen, f);
+	fputc('\n', f);
+	return LUA_MOSQUITTO_PLUGIN_CONSUMED;
+}
+
+void append_free(void *state)
+{
+	fclose(state);
+}
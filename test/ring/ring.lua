@@ -1,146 +1,270 @@
 #!/usr/bin/env lua
 
-if not arg[3] then
-	print(string.format("Usage: %s <host> <#nodes> <#messages> <ttl>", arg[0]))
-	os.exit(1)
-end
+--[[
+Ring benchmark: messages travel around a ring of nodes, each node passing
+them on to the next until their ttl runs out. All nodes are instances in
+this one process, so nothing is needed beyond the module and a broker.
 
-local nixio = require "nixio"
-nixio.fs    = require "nixio.fs"
-local mosq  = require "mosquitto"
+usage: ring.lua [option=value ...]
 
-local POLLIN          = nixio.poll_flags("in")
-local POLLOUT         = nixio.poll_flags("out")
-local POLLNVAL        = nixio.poll_flags("nval")
+	host=       broker host, default: start test/broker/broker on a free port
+	port=1883   broker port, with host
+	nodes=8     instances in the ring
+	messages=64 messages injected into the ring at once
+	ttl=1000    hops per message
+	size=16     payload bytes
+	qos=0       0, 1 or 2
+	mode=manual manual:   loop() on every instance in turn
+	            threaded: loop_start() and queue_set() + recv() per instance
+	            reactor:  mosquitto.poll() + loop_read/loop_write/loop_misc
+	timeout=60  give up after that many seconds
 
-local POLL_TIMEOUT_MS = -1 -- no timeout
+The result goes to stdout as a single JSON object: hops per second and the
+per hop latency percentiles in microseconds.
+]]
 
-local TIMERFD_SEC     = 1
-local TIMERFD_NS      = 0
+local mosq = require "mosquitto"
 
-local timer = {
-	fd = nixio.timerfd(TIMERFD_SEC, TIMERFD_NS, TIMERFD_SEC, TIMERFD_NS),
-	events = POLLIN,
-	revents = 0
+local opts = {
+	host = false, port = 1883,
+	nodes = 8, messages = 64, ttl = 1000, size = 16, qos = 0,
+	mode = "manual", timeout = 60,
 }
 
-local MOSQ_MAX_NODE      = arg[2]
-local MOSQ_MAX_MSG       = arg[3]
-local MOSQ_TTL           = arg[4]
-local MOSQ_INFLIGHT_MSG  = MOSQ_MAX_MSG
-local MOSQ_START_SEC, MOSQ_START_USEC
+for _, a in ipairs(arg) do
+	local k, v = a:match("^([%w_]+)=(.*)$")
+	if not k or opts[k] == nil then
+		io.stderr:write("bad option: ", a, "\n")
+		os.exit(2)
+	end
+	opts[k] = type(opts[k]) == "number" and tonumber(v) or v
+end
 
-local MOSQ_ID            = "flukso"
-local MOSQ_CLEAN_SESSION = true
-local MOSQ_HOST          = arg[1]
-local MOSQ_PORT          = 1883
-local MOSQ_KEEPALIVE     = 300
-local MOSQ_MAX_READ      = 100 -- packets
-local MOSQ_MAX_WRITE     = 100 -- packets
+local MODES = { manual = true, threaded = true, reactor = true }
+if not MODES[opts.mode] then
+	io.stderr:write("unknown mode: ", opts.mode, "\n")
+	os.exit(2)
+end
 
-mosq.init()
-local mqtt = mosq.new(MOSQ_ID, MOSQ_CLEAN_SESSION)
---[[
-mqtt:set_callback(mosq.ON_CONNECT, function(...)
-	-- inject #messages into the ring
-	for i = 0, MOSQ_MAX_MSG - 1 do
-    	mqtt:publish("/node/0", MOSQ_TTL, 0, false)
-	end
-end)
-]]--
---mqtt:set_callback(mosq.ON_DISCONNECT, function(...) print("DISCONNECT", ...) end)
---mqtt:set_callback(mosq.ON_PUBLISH, function(...) print("PUBLISH", ...) end)
-
-mqtt:set_callback(mosq.ON_MESSAGE, function(...)
-	local sec, usec = nixio.gettimeofday()
-	MOSQ_INFLIGHT_MSG = MOSQ_INFLIGHT_MSG - 1
-
-	print(string.format("%d in-flight messages remaining at %d sec %6d usec", MOSQ_INFLIGHT_MSG, sec, usec))
-
-	if MOSQ_INFLIGHT_MSG == 0 then
-		local elapsed_sec = sec - MOSQ_START_SEC
-		local elapsed_msec = math.floor((usec - MOSQ_START_USEC) / 1e3)
-		if elapsed_msec < 0 then
-			elapsed_sec = elapsed_sec - 1
-			elapsed_msec = 1e3 + elapsed_msec
-		end
+local SAMPLES_MAX = 100000
+local clock = mosq.clock
 
-		print(string.format("Elapsed time: %d.%03d sec", elapsed_sec, elapsed_msec))
-		print(string.format("Throughput: %d msg/sec", math.floor((MOSQ_MAX_MSG * MOSQ_TTL) / (elapsed_sec + elapsed_msec / 1e3))))
-		-- clean up the parent and all forked ring processes
-		nixio.kill(0, nixio.const.SIGTERM)
+-- start the stub broker, unless pointed at one
+local broker
+if not opts.host then
+	local dir = arg[0]:match("^(.*)/[^/]*$") or "."
+	local proc = io.popen("echo $$; exec " .. dir .. "/../broker/broker -p 0")
+	local pid = proc:read("*l")
+	local addr = proc:read("*l")
+	local host, port = (addr or ""):match("^listening ([^:]+):(%d+)$")
+	if not host then
+		io.stderr:write("no broker, build it with 'make broker' or pass host=\n")
+		os.exit(1)
 	end
-end)
-
---mqtt:set_callback(mosq.ON_SUBSCRIBE, function(...) print("SUBSCRIBE", ...) end)
---mqtt:set_callback(mosq.ON_UNSUBSCRIBE, function(...) print("UNSUBSCRIBE", ...) end)
---mqtt:set_callback(mosq.ON_LOG, function(...) print("LOG", ...) end)
+	broker = { proc = proc, pid = pid }
+	opts.host, opts.port = host, tonumber(port)
+end
 
-while not mqtt:connect(MOSQ_HOST, MOSQ_PORT, MOSQ_KEEPALIVE) do
-	print("trying to connect to broker ...")
+local function stop_broker()
+	if broker then
+		os.execute("kill " .. broker.pid)
+		broker.proc:close()
+	end
 end
 
-mqtt:subscribe("/done/#", 2)
+mosq.init()
+
+local nodes, ctxs = {}, {}
+local done, hops = 0, 0
+local samples, seen = {}, 0
+local padding = string.rep("x", opts.size)
 
-local broker = {
-	fd = nixio.fd_wrap(mqtt:socket()),
-	events = POLLIN + POLLOUT,
-	revents = 0
-}
+local function payload(ttl)
+	local p = string.format("%d %.9f ", ttl, clock())
+	if #p < opts.size then
+		p = p .. padding:sub(1, opts.size - #p)
+	end
+	return p
+end
 
-local fds = { timer, broker }
+-- reservoir sampling keeps latency memory bounded on long runs
+local function sample(v)
+	seen = seen + 1
+	if seen <= SAMPLES_MAX then
+		samples[seen] = v
+	else
+		local j = math.random(seen)
+		if j <= SAMPLES_MAX then
+			samples[j] = v
+		end
+	end
+end
 
--- fork #nodes
-for i = 0, MOSQ_MAX_NODE - 1 do
-	local pid = nixio.fork()
+local function forward(node, msg)
+	local ttl, sent = msg:match("^(%d+) (%S+)")
+	ttl = tonumber(ttl) - 1
+	hops = hops + 1
+	sample(clock() - tonumber(sent))
 
-	if pid == 0 then -- child process
-		nixio.exec("node.lua", MOSQ_HOST, i, MOSQ_MAX_NODE)
+	if ttl > 0 then
+		node.ctx:publish(node.next_topic, payload(ttl), opts.qos)
+	else
+		done = done + 1
 	end
+end
+
+-- connect and subscribe, waiting for every SUBACK instead of sleeping
+local subscribed = 0
+for i = 1, opts.nodes do
+	local ctx = mosq.new("ring-" .. i, true)
+	local node = {
+		ctx = ctx,
+		topic = "ring/" .. (i - 1),
+		next_topic = "ring/" .. (i % opts.nodes),
+	}
+
+	ctx.ON_SUBSCRIBE = function() subscribed = subscribed + 1 end
+	assert(ctx:connect(opts.host, opts.port, 60))
+	ctx:subscribe(node.topic, opts.qos)
+	nodes[i], ctxs[i] = node, ctx
+end
 
-	nixio.nanosleep(0, 20000000) -- 20ms
+local deadline = clock() + opts.timeout
+while subscribed < opts.nodes do
+	for _, ctx in ipairs(ctxs) do
+		ctx:loop(10, 100)
+	end
+	if clock() > deadline then
+		io.stderr:write("timed out subscribing\n")
+		stop_broker()
+		os.exit(1)
+	end
 end
 
--- sleep for a while to allow all forked processes to settle down
-nixio.nanosleep(math.floor(MOSQ_MAX_NODE / 5), 0)
+if opts.mode == "threaded" then
+	-- no Lua callbacks may run on the library threads, messages are queued
+	for _, ctx in ipairs(ctxs) do
+		ctx:queue_set()
+		assert(ctx:loop_start())
+	end
+else
+	for _, node in ipairs(nodes) do
+		node.ctx.ON_MESSAGE = function(mid, topic, msg) forward(node, msg) end
+	end
+end
 
-MOSQ_START_SEC, MOSQ_START_USEC = nixio.gettimeofday()
-print(string.format("Sending %d messages with ttl %d into a ring of %d nodes", MOSQ_MAX_MSG, MOSQ_TTL, MOSQ_MAX_NODE))
-print(string.format("Starting at %d sec %d usec", MOSQ_START_SEC, MOSQ_START_USEC))
+local start = clock()
+deadline = start + opts.timeout
 
--- inject #messages into the ring
-for i = 0, MOSQ_MAX_MSG - 1 do
-	mqtt:publish("/node/0", MOSQ_TTL, 0, false)
+for _ = 1, opts.messages do
+	ctxs[1]:publish(nodes[1].topic, payload(opts.ttl), opts.qos)
 end
 
-while true do
-	local poll = nixio.poll(fds, POLL_TIMEOUT_MS)
+local timed_out = false
 
-	if not poll then -- poll == -1
-	elseif poll == 0 then
-	elseif poll > 0 then
-		if nixio.bit.check(broker.revents, POLLIN) then
-			mqtt:read(MOSQ_MAX_READ)
+if opts.mode == "manual" then
+	while done < opts.messages and not timed_out do
+		for _, ctx in ipairs(ctxs) do
+			ctx:loop(0, 100)
 		end
-
-		if nixio.bit.check(broker.revents, POLLOUT) and mqtt:want_write() then
-			mqtt:write(MOSQ_MAX_WRITE)
+		timed_out = clock() > deadline
+	end
+elseif opts.mode == "threaded" then
+	while done < opts.messages and not timed_out do
+		local idle = true
+		for _, node in ipairs(nodes) do
+			local batch = node.ctx:recv(64, 0)
+			for _, m in ipairs(batch) do
+				forward(node, m.payload)
+			end
+			idle = idle and #batch == 0
 		end
-
-		if nixio.bit.check(timer.revents, POLLIN) then
-			timer.fd:numexp() -- reset the numexp counter
-			mqtt:misc()       -- mqtt housekeeping
+		if idle then
+			-- nothing anywhere, sleep on the first queue for a moment
+			for _, m in ipairs(nodes[1].ctx:recv(64, 1)) do
+				forward(nodes[1], m.payload)
+			end
+		end
+		timed_out = clock() > deadline
+	end
+else
+	local misc = clock()
+	while done < opts.messages and not timed_out do
+		local readable, writable = mosq.poll(ctxs, 100)
+		for _, ctx in ipairs(readable) do
+			ctx:loop_read(100)
+		end
+		for _, ctx in ipairs(writable) do
+			ctx:loop_write(100)
 		end
+		local now = clock()
+		if now - misc >= 1 then
+			for _, ctx in ipairs(ctxs) do
+				ctx:loop_misc()
+			end
+			misc = now
+		end
+		timed_out = now > deadline
 	end
+end
+
+local elapsed = clock() - start
 
-	while (not mqtt:socket()) and (not mqtt:reconnect()) do
-		print("trying to reconnect to broker ...")
-		nixio.nanosleep(1, 0)
+for _, ctx in ipairs(ctxs) do
+	ctx:disconnect()
+	if opts.mode == "threaded" then
+		ctx:loop_stop()
 	end
+end
+stop_broker()
 
-	if mqtt:want_write() then
-		broker.events = nixio.bit.set(broker.events, POLLOUT)
-	else
-		broker.events = nixio.bit.unset(broker.events, POLLOUT)
+table.sort(samples)
+local function percentile(p)
+	if #samples == 0 then
+		return 0
+	end
+	local i = math.max(1, math.ceil(#samples * p))
+	return samples[i] * 1e6
+end
+
+local result = {
+	{ "mode", opts.mode },
+	{ "nodes", opts.nodes },
+	{ "messages", opts.messages },
+	{ "ttl", opts.ttl },
+	{ "size", opts.size },
+	{ "qos", opts.qos },
+	{ "hops", hops },
+	{ "elapsed_s", elapsed },
+	{ "hops_per_s", hops / elapsed },
+	{ "latency_us", {
+		{ "p50", percentile(0.5) },
+		{ "p90", percentile(0.9) },
+		{ "p99", percentile(0.99) },
+		{ "p999", percentile(0.999) },
+		{ "max", percentile(1) },
+	} },
+	{ "timed_out", timed_out },
+}
+
+-- ordered pairs, so the output is stable and diffable between runs
+local function json(fields)
+	local out = {}
+	for _, f in ipairs(fields) do
+		local k, v = f[1], f[2]
+		if type(v) == "table" then
+			v = json(v)
+		elseif type(v) == "string" then
+			v = string.format("%q", v)
+		elseif type(v) == "number" and v ~= math.floor(v) then
+			v = string.format("%.3f", v)
+		else
+			v = tostring(v)
+		end
+		out[#out + 1] = string.format("%q: %s", k, v)
 	end
+	return "{" .. table.concat(out, ", ") .. "}"
 end
+
+print(json(result))
+os.exit(timed_out and 1 or 0)
@@ -0,0 +1,322 @@
+#!/usr/bin/env lua
+
+--[[
+Stress test: many instances in one process flood each other through a
+broker while their handlers pick random actions, re-entering the module
+from inside callbacks: publishing, (un)subscribing, disconnecting, getting
+kicked by the broker, destroying their own instance, looping another
+instance, replacing handlers, raising errors and yielding.
+
+It is meant to run under AddressSanitizer and UBSan, see 'make stress'.
+Unexpected results are counted as failures; the throughput makes changes
+to the dispatch path comparable between runs.
+
+usage: stress.lua [option=value ...]
+
+	host=        broker host, default: start test/broker/broker on a free port
+	port=1883    broker port, with host
+	clients=16   instances alive at any time
+	burst=32     messages each instance publishes per pass
+	size=64      payload bytes
+	duration=10  seconds to run
+	seed=        random seed, default: time based
+	verbose=0    1 to print every failure to stderr
+
+The result goes to stdout as a single JSON object. The exit status is 0
+only when nothing failed.
+]]
+
+local mosq = require "mosquitto"
+
+local opts = {
+	host = false, port = 1883,
+	clients = 16, burst = 32, size = 64, duration = 10,
+	seed = false, verbose = 0,
+}
+
+for _, a in ipairs(arg) do
+	local k, v = a:match("^([%w_]+)=(.*)$")
+	if not k or opts[k] == nil then
+		io.stderr:write("bad option: ", a, "\n")
+		os.exit(2)
+	end
+	opts[k] = (type(opts[k]) == "number" or k == "seed") and tonumber(v) or v
+end
+
+local clock = mosq.clock
+local seed = opts.seed or math.floor(clock() * 1000) % 2147483647
+math.randomseed(seed)
+
+-- start the stub broker, unless pointed at one
+local broker
+if not opts.host then
+	local dir = arg[0]:match("^(.*)/[^/]*$") or "."
+	local proc = io.popen("echo $$; exec " .. dir .. "/../broker/broker -p 0")
+	local pid = proc:read("*l")
+	local addr = proc:read("*l")
+	local host, port = (addr or ""):match("^listening ([^:]+):(%d+)$")
+	if not host then
+		io.stderr:write("no broker, build it with 'make broker' or pass host=\n")
+		os.exit(1)
+	end
+	broker = { proc = proc, pid = pid }
+	opts.host, opts.port = host, tonumber(port)
+end
+
+local function stop_broker()
+	if broker then
+		os.execute("kill " .. broker.pid)
+		broker.proc:close()
+	end
+end
+
+mosq.init()
+
+local clients = {}
+local generation = 0
+local counts = {
+	received = 0, published = 0, acked = 0,
+	connects = 0, disconnects = 0, created = 0, destroyed = 0,
+	failures = 0,
+}
+local actions = {}
+local payload = string.rep("s", opts.size)
+
+local function fail(what)
+	counts.failures = counts.failures + 1
+	if opts.verbose ~= 0 then
+		io.stderr:write("failure: ", tostring(what), "\n")
+	end
+end
+
+local function random_topic()
+	return "stress/" .. math.random(opts.clients)
+end
+
+local function other(client)
+	local c = clients[math.random(#clients)]
+	if c ~= client and c.ctx and not c.dead then
+		return c
+	end
+end
+
+-- weighted, most messages should just be consumed
+local ACTIONS = {
+	{ "none", 60 },
+	{ "publish", 12 },
+	{ "subscribe", 4 },
+	{ "unsubscribe", 4 },
+	{ "disconnect", 1 },
+	{ "kick", 1 },
+	{ "destroy", 1 },
+	{ "loop_self", 2 },
+	{ "loop_other", 3 },
+	{ "replace", 3 },
+	{ "error", 5 },
+	{ "collect", 4 },
+	{ "yield", 3 },
+}
+local WEIGHT = 0
+for _, a in ipairs(ACTIONS) do
+	WEIGHT = WEIGHT + a[2]
+	actions[a[1]] = 0
+end
+
+local handler
+
+local function act(client)
+	local n = math.random(WEIGHT)
+	local name
+	for _, a in ipairs(ACTIONS) do
+		n = n - a[2]
+		if n <= 0 then
+			name = a[1]
+			break
+		end
+	end
+	actions[name] = actions[name] + 1
+
+	local ctx = client.ctx
+	if name == "publish" then
+		if ctx:publish(random_topic(), payload, math.random(0, 2)) then
+			counts.published = counts.published + 1
+		end
+	elseif name == "subscribe" then
+		ctx:subscribe("stress/x/" .. math.random(8), math.random(0, 2))
+	elseif name == "unsubscribe" then
+		ctx:unsubscribe("stress/x/" .. math.random(8))
+	elseif name == "disconnect" then
+		ctx:disconnect()
+	elseif name == "kick" then
+		-- the broker drops us, the library finds out on its own
+		ctx:publish("$stub/disconnect", "", 0)
+	elseif name == "destroy" then
+		ctx:destroy()
+		client.dead = true
+		counts.destroyed = counts.destroyed + 1
+		-- the instance is gone, nothing of it may be reachable any more
+		if pcall(function() return ctx:publish(random_topic(), payload) end) then
+			fail("publish after destroy")
+		end
+	elseif name == "loop_self" then
+		if pcall(ctx.loop, ctx, 0, 1) then
+			fail("nested loop on the same instance")
+		end
+	elseif name == "loop_other" then
+		local c = other(client)
+		if c then
+			-- may legitimately refuse if c is up the stack already
+			pcall(c.ctx.loop, c.ctx, 0, 8)
+		end
+	elseif name == "replace" then
+		ctx.ON_MESSAGE = function(...) return handler(client, ...) end
+	elseif name == "error" then
+		error("raised from a handler")
+	elseif name == "collect" then
+		collectgarbage("step")
+	elseif name == "yield" then
+		-- resumed by a later loop pass, the instance may be gone by then
+		coroutine.yield()
+		if not client.dead then
+			act(client)
+		end
+	end
+end
+
+function handler(client, mid, topic, msg)
+	counts.received = counts.received + 1
+	if #msg ~= opts.size then
+		fail("payload of " .. #msg .. " bytes on " .. topic)
+	end
+	if not client.dead then
+		act(client)
+	end
+end
+
+local function spawn(i)
+	generation = generation + 1
+	-- state: "connecting", "up" or "down"
+	local client = { i = i, state = "connecting", since = clock(), dead = false }
+	local ctx = mosq.new(string.format("stress-%d-%d", i, generation), true)
+	client.ctx = ctx
+
+	ctx.ON_CONNECT = function(success)
+		if success then
+			client.state = "up"
+			counts.connects = counts.connects + 1
+			ctx:subscribe("stress/" .. i, math.random(0, 2))
+			ctx:subscribe("stress/x/#", 0)
+		end
+	end
+	ctx.ON_DISCONNECT = function()
+		client.state = "down"
+		counts.disconnects = counts.disconnects + 1
+	end
+	ctx.ON_PUBLISH = function()
+		counts.acked = counts.acked + 1
+		if not client.dead and math.random(100) == 1 then
+			act(client)
+		end
+	end
+	ctx.ON_MESSAGE = function(...) return handler(client, ...) end
+
+	if not ctx:connect(opts.host, opts.port, 60) then
+		fail("connect")
+	end
+	counts.created = counts.created + 1
+	clients[i] = client
+end
+
+for i = 1, opts.clients do
+	spawn(i)
+end
+
+local start = clock()
+local deadline = start + opts.duration
+local now = start
+
+while now < deadline do
+	for i = 1, #clients do
+		local client = clients[i]
+		if client.dead then
+			client.ctx = nil
+			spawn(i)
+		elseif client.state == "down"
+				or (client.state == "connecting" and now - client.since > 2) then
+			client.state, client.since = "connecting", now
+			client.ctx:reconnect()
+		elseif client.state == "up" then
+			-- completions run handlers too, which may destroy the instance
+			for _ = 1, opts.burst do
+				if client.dead then
+					break
+				end
+				if client.ctx:publish(random_topic(), payload, math.random(0, 2)) then
+					counts.published = counts.published + 1
+				end
+			end
+		end
+		-- the handlers may have destroyed it in the meantime
+		if not client.dead then
+			client.ctx:loop(0, 64)
+		end
+	end
+	now = clock()
+end
+
+local elapsed = now - start
+
+for _, client in ipairs(clients) do
+	if not client.dead then
+		client.ctx:disconnect()
+		client.ctx:loop(10, 64)
+	end
+end
+clients = nil
+collectgarbage("collect")
+stop_broker()
+
+local action_fields = {}
+for _, a in ipairs(ACTIONS) do
+	action_fields[#action_fields + 1] = { a[1], actions[a[1]] }
+end
+
+local result = {
+	{ "seed", seed },
+	{ "clients", opts.clients },
+	{ "burst", opts.burst },
+	{ "size", opts.size },
+	{ "elapsed_s", elapsed },
+	{ "received", counts.received },
+	{ "received_per_s", counts.received / elapsed },
+	{ "published", counts.published },
+	{ "acked", counts.acked },
+	{ "connects", counts.connects },
+	{ "disconnects", counts.disconnects },
+	{ "created", counts.created },
+	{ "destroyed", counts.destroyed },
+	{ "actions", action_fields },
+	{ "failures", counts.failures },
+}
+
+-- ordered pairs, so the output is stable and diffable between runs
+local function json(fields)
+	local out = {}
+	for _, f in ipairs(fields) do
+		local k, v = f[1], f[2]
+		if type(v) == "table" then
+			v = json(v)
+		elseif type(v) == "string" then
+			v = string.format("%q", v)
+		elseif type(v) == "number" and v ~= math.floor(v) then
+			v = string.format("%.3f", v)
+		else
+			v = tostring(v)
+		end
+		out[#out + 1] = string.format("%q: %s", k, v)
+	end
+	return "{" .. table.concat(out, ", ") .. "}"
+end
+
+print(json(result))
+os.exit(counts.failures == 0 and 0 or 1)